@@ -15,15 +15,30 @@
  * 02111-1307, USA.
  */
 
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include "db.h"
+#include "evr.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
 
 /*  We have a lot of code so we can "quickly" update the .sqlite file using
  * the old .sqlite data and the new .xml data. However it seems to have weird
  * edge cases where it doesn't work, rhbz 465898 etc. ... so we turn it off. */
 #define YMP_CONFIG_UPDATE_DB 0
 
+/* Lets sqlite fold evr_key() of constants, older versions do without */
+#ifndef SQLITE_DETERMINISTIC
+#define SQLITE_DETERMINISTIC 0
+#endif
+
 GQuark
 yum_db_error_quark (void)
 {
@@ -35,489 +50,4473 @@ yum_db_error_quark (void)
     return quark;
 }
 
-#define ENCODED_PACKAGE_FILE_FILES 2048
-#define ENCODED_PACKAGE_FILE_TYPES 60
+#define PACKAGE_STRINGS_CHUNK 4096
+
+#define FILELIST_ARENA_SIZE 4096
+
+char *
+yum_db_filename (const char *prefix)
+{
+    char *filename;
+
+    filename = g_strconcat (prefix, ".sqlite", NULL);
+    return filename;
+}
+
+/* Every table is described once here, the layout options decide how each
+   column is stored. A table with encoded columns is stored as
+   <name>_data and read through a view with the plain name and the
+   original column shape, so existing queries keep working. */
+
+#define COLUMN_DICT  (1 << 0)   /* Interned into strings in the dict layout */
+#define COLUMN_KEY   (1 << 1)   /* Never NULL */
+#define COLUMN_FLAGS (1 << 2)   /* Dependency flags, integers when typed */
+#define COLUMN_BOOL  (1 << 3)   /* "TRUE"/"FALSE", 1/0 when typed */
+#define COLUMN_HEX   (1 << 4)   /* Hex digest, a BLOB when typed */
+#define COLUMN_DIR   (1 << 5)   /* Interned into dirnames, dirnames layout */
+#define COLUMN_PATH  (1 << 6)   /* Directory interned, the rest kept */
+#define COLUMN_ZSTD  (1 << 7)   /* Compressed in the compressed layout */
+#define COLUMN_COLD  (1 << 8)   /* In <table>_detail in the split layout */
+
+typedef enum {
+    ENCODING_PLAIN,
+    ENCODING_STRINGS,
+    ENCODING_FLAGS,
+    ENCODING_BOOL,
+    ENCODING_HEX,
+    ENCODING_DIRNAME,
+    ENCODING_PATH,
+    ENCODING_ZSTD
+} ColumnEncoding;
+
+/* Typed flags are the position in this list plus one */
+static const char *dependency_flags[] = { "LT", "GT", "EQ", "LE", "GE", NULL };
+
+typedef struct {
+    const char *name;
+    const char *type;
+    guint flags;
+} TableColumn;
+
+#define TABLE_DEPENDENCY (1 << 0)   /* Packed into package_deps if asked to */
+#define TABLE_SHARED     (1 << 1)   /* Rows shared by packages, sets layout */
+#define TABLE_RESOLVED   (1 << 2)   /* Keyed for requires_providers */
 
 typedef struct {
-    GString *files;
-    GString *types;
-} EncodedPackageFile;
+    const char *name;
+    const char *data_name;
+    const TableColumn *columns;
+    guint flags;
+} TableSpec;
+
+static const TableColumn package_columns[] = {
+    { "pkgKey",           "INTEGER PRIMARY KEY", 0 },
+    { "pkgId",            "TEXT",    COLUMN_HEX },
+    { "name",             "TEXT",    0 },
+    { "arch",             "TEXT",    COLUMN_DICT },
+    { "version",          "TEXT",    0 },
+    { "epoch",            "TEXT",    0 },
+    { "release",          "TEXT",    0 },
+    { "summary",          "TEXT",    COLUMN_COLD },
+    { "description",      "TEXT",    COLUMN_COLD },
+    { "url",              "TEXT",    COLUMN_COLD },
+    { "time_file",        "INTEGER", 0 },
+    { "time_build",       "INTEGER", 0 },
+    { "rpm_license",      "TEXT",    COLUMN_DICT | COLUMN_COLD },
+    { "rpm_vendor",       "TEXT",    COLUMN_DICT | COLUMN_COLD },
+    { "rpm_group",        "TEXT",    COLUMN_DICT | COLUMN_COLD },
+    { "rpm_buildhost",    "TEXT",    COLUMN_DICT | COLUMN_COLD },
+    { "rpm_sourcerpm",    "TEXT",    0 },
+    { "rpm_header_start", "INTEGER", 0 },
+    { "rpm_header_end",   "INTEGER", 0 },
+    { "rpm_packager",     "TEXT",    COLUMN_DICT | COLUMN_COLD },
+    { "size_package",     "INTEGER", 0 },
+    { "size_installed",   "INTEGER", 0 },
+    { "size_archive",     "INTEGER", 0 },
+    { "location_href",    "TEXT",    0 },
+    { "location_base",    "TEXT",    0 },
+    { "checksum_type",    "TEXT",    COLUMN_DICT },
+    { "evr",              "BLOB",    0 },
+    { NULL, NULL, 0 }
+};
+
+static const TableColumn file_columns[] = {
+    { "name",   "TEXT",    COLUMN_PATH },
+    { "type",   "TEXT",    0 },
+    { "pkgKey", "INTEGER", 0 },
+    { NULL, NULL, 0 }
+};
+
+static const TableColumn dependency_columns[] = {
+    { "name",    "TEXT",    COLUMN_DICT | COLUMN_KEY },
+    { "flags",   "TEXT",    COLUMN_DICT | COLUMN_FLAGS },
+    { "epoch",   "TEXT",    0 },
+    { "version", "TEXT",    0 },
+    { "release", "TEXT",    0 },
+    { "pkgKey",  "INTEGER", 0 },
+    { NULL, NULL, 0 }
+};
+
+static const TableColumn requires_columns[] = {
+    { "name",    "TEXT",    COLUMN_DICT | COLUMN_KEY },
+    { "flags",   "TEXT",    COLUMN_DICT | COLUMN_FLAGS },
+    { "epoch",   "TEXT",    0 },
+    { "version", "TEXT",    0 },
+    { "release", "TEXT",    0 },
+    { "pkgKey",  "INTEGER", 0 },
+    { "pre",     "BOOLEAN DEFAULT FALSE", COLUMN_BOOL },
+    { NULL, NULL, 0 }
+};
+
+/* pkgId stays text even when typed: yum looks packages up by pkgId here
+   one at a time, which a decoding view would turn into scans */
+static const TableColumn package_id_columns[] = {
+    { "pkgKey", "INTEGER PRIMARY KEY", 0 },
+    { "pkgId",  "TEXT", 0 },
+    { NULL, NULL, 0 }
+};
+
+static const TableColumn filelist_columns[] = {
+    { "pkgKey",    "INTEGER", 0 },
+    { "dirname",   "TEXT",    COLUMN_DIR | COLUMN_KEY },
+    { "filenames", "TEXT",    0 },
+    { "filetypes", "TEXT",    0 },
+    { NULL, NULL, 0 }
+};
+
+static const TableColumn changelog_columns[] = {
+    { "pkgKey",    "INTEGER", 0 },
+    { "author",    "TEXT",    COLUMN_DICT },
+    { "date",      "INTEGER", 0 },
+    { "changelog", "TEXT",    COLUMN_ZSTD },
+    { NULL, NULL, 0 }
+};
+
+/* The packages table comes first, the others hang off its pkgKey */
+
+static const TableSpec primary_tables[] = {
+    { "packages",  "packages_data",  package_columns,    0 },
+    { "files",     "files_data",     file_columns,       0 },
+    { "requires",  "requires_data",  requires_columns,
+      TABLE_DEPENDENCY | TABLE_RESOLVED },
+    { "provides",  "provides_data",  dependency_columns, TABLE_DEPENDENCY },
+    { "conflicts", "conflicts_data", dependency_columns, TABLE_DEPENDENCY },
+    { "obsoletes", "obsoletes_data", dependency_columns, TABLE_DEPENDENCY },
+    { NULL, NULL, NULL, 0 }
+};
+
+static const TableSpec filelist_tables[] = {
+    { "packages", "packages_data", package_id_columns, 0 },
+    { "filelist", "filelist_data", filelist_columns,   0 },
+    { NULL, NULL, NULL, 0 }
+};
+
+static const TableSpec other_tables[] = {
+    { "packages",  "packages_data",  package_id_columns, 0 },
+    { "changelog", "changelog_data", changelog_columns,  TABLE_SHARED },
+    { NULL, NULL, NULL, 0 }
+};
+
+static const TableSpec *
+table_find (const TableSpec *tables, const char *name)
+{
+    for (; tables->name; tables++) {
+        if (!strcmp (tables->name, name))
+            return tables;
+    }
 
-static EncodedPackageFile *
-encoded_package_file_new (void)
+    return NULL;
+}
+
+/* Only the packages tables share a name, look up anything else */
+static const TableSpec *
+table_lookup (const char *name)
 {
-    EncodedPackageFile *enc;
+    const TableSpec *table;
 
-    enc = g_new0 (EncodedPackageFile, 1);
-    enc->files = g_string_sized_new (ENCODED_PACKAGE_FILE_FILES);
-    enc->types = g_string_sized_new (ENCODED_PACKAGE_FILE_TYPES);
+    table = table_find (primary_tables, name);
+    if (!table)
+        table = table_find (filelist_tables, name);
+    if (!table)
+        table = table_find (other_tables, name);
 
-    return enc;
+    return table;
 }
 
-static void
-encoded_package_file_free (EncodedPackageFile *file)
+static ColumnEncoding
+column_encoding (const TableColumn *column, guint layout)
 {
-    g_string_free (file->files, TRUE);
-    g_string_free (file->types, TRUE);
-    g_free (file);
+    if (layout & YUM_DB_LAYOUT_TYPED) {
+        if (column->flags & COLUMN_FLAGS)
+            return ENCODING_FLAGS;
+        if (column->flags & COLUMN_BOOL)
+            return ENCODING_BOOL;
+        if (column->flags & COLUMN_HEX)
+            return ENCODING_HEX;
+    }
+
+    if ((column->flags & COLUMN_ZSTD) && (layout & YUM_DB_LAYOUT_COMPRESSED))
+        return ENCODING_ZSTD;
+
+    if (layout & YUM_DB_LAYOUT_DIRNAMES) {
+        if (column->flags & COLUMN_DIR)
+            return ENCODING_DIRNAME;
+        if (column->flags & COLUMN_PATH)
+            return ENCODING_PATH;
+    }
+
+    if ((column->flags & COLUMN_DICT) && (layout & YUM_DB_LAYOUT_DICT))
+        return ENCODING_STRINGS;
+
+    return ENCODING_PLAIN;
 }
 
-static GHashTable *
-package_files_to_hash (GSList *files)
+static gboolean
+column_is_encoded (const TableColumn *column, guint layout)
 {
-    GHashTable *hash;
-    GSList *iter;
-    PackageFile *file;
-    EncodedPackageFile *enc;
-    char *dir;
-    char *name;
+    return column_encoding (column, layout) != ENCODING_PLAIN;
+}
 
-    hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                  (GDestroyNotify) g_free,
-                                  (GDestroyNotify) encoded_package_file_free);
+/* Descriptive columns only a few queries need are kept apart, so that
+   scanning the rest touches fewer pages */
+static gboolean
+column_is_cold (const TableColumn *column, guint layout)
+{
+    return (column->flags & COLUMN_COLD) && (layout & YUM_DB_LAYOUT_SPLIT);
+}
 
-    for (iter = files; iter; iter = iter->next) {
-        file = (PackageFile *) iter->data;
+static gboolean
+table_is_split (const TableSpec *table, guint layout)
+{
+    const TableColumn *column;
 
-        dir = g_path_get_dirname (file->name);
-        name = g_path_get_basename (file->name);
+    for (column = table->columns; column->name; column++) {
+        if (column_is_cold (column, layout))
+            return TRUE;
+    }
 
-        enc = (EncodedPackageFile *) g_hash_table_lookup (hash, dir);
-        if (!enc) {
-            enc = encoded_package_file_new ();
-            g_hash_table_insert (hash, dir, enc);
-        } else
-            g_free (dir);
+    return FALSE;
+}
 
-        if (enc->files->len)
-            g_string_append_c (enc->files, '/');
-        g_string_append (enc->files, name);
-        g_free (name);
+/* A shared table stores the rows of a set once under its setKey,
+   package_<table>s maps the packages to their set */
+static gboolean
+table_is_shared (const TableSpec *table, guint layout)
+{
+    return (table->flags & TABLE_SHARED) &&
+        (layout & YUM_DB_LAYOUT_CHANGELOG_SETS);
+}
 
-        if (!strcmp (file->type, "dir"))
-            g_string_append_c (enc->types, 'd');
-        else if (!strcmp (file->type, "file"))
-            g_string_append_c (enc->types, 'f');
-        else if (!strcmp (file->type, "ghost"))
-            g_string_append_c (enc->types, 'g');
+static const char *
+column_storage (const TableSpec *table, const TableColumn *column,
+                guint layout)
+{
+    if (table_is_shared (table, layout) && !strcmp (column->name, "pkgKey"))
+        return "setKey";
+
+    return column->name;
+}
+
+/* requires_providers points at requires rows by this key, an INTEGER
+   PRIMARY KEY that VACUUM leaves alone. It is the last column, copies
+   leave it NULL to have it assigned. */
+static const char *
+table_row_key (const TableSpec *table, guint layout)
+{
+    if ((table->flags & TABLE_RESOLVED) &&
+        (layout & YUM_DB_LAYOUT_PROVIDERS))
+        return "requireKey";
+
+    return NULL;
+}
+
+static gboolean
+table_is_encoded (const TableSpec *table, guint layout)
+{
+    const TableColumn *column;
+
+    if (table_is_shared (table, layout) || table_is_split (table, layout))
+        return TRUE;
+
+    for (column = table->columns; column->name; column++) {
+        if (column_is_encoded (column, layout))
+            return TRUE;
     }
 
-    return hash;
+    return FALSE;
 }
 
-char *
-yum_db_filename (const char *prefix)
+static gboolean
+tables_use_encoding (const TableSpec *tables, guint layout,
+                     ColumnEncoding encoding)
 {
-    char *filename;
+    const TableColumn *column;
 
-    filename = g_strconcat (prefix, ".sqlite", NULL);
-    return filename;
+    for (; tables->name; tables++) {
+        for (column = tables->columns; column->name; column++) {
+            if (column_encoding (column, layout) == encoding)
+                return TRUE;
+        }
+    }
+
+    return FALSE;
 }
 
-typedef enum {
-    DB_STATUS_OK,
-    DB_STATUS_VERSION_MISMATCH,
-    DB_STATUS_CHECKSUM_MISMATCH,
-    DB_STATUS_ERROR
-} DBStatus;
+/* The dictionaries the columns of an encoding are interned into */
 
-static DBStatus
-dbinfo_status (sqlite3 *db, const char *checksum)
+typedef struct {
+    const char *table;
+    const char *column;
+    const char *index;
+    const char *function;
+} Dictionary;
+
+static const Dictionary dictionaries[YUM_DB_DICTS] = {
+    { "strings",  "string", "stringvalues", "intern_strings" },
+    { "dirnames", "path",   "dirnamepaths", "intern_dirnames" }
+};
+
+static gboolean
+encoding_uses_dictionary (ColumnEncoding encoding, YumDbDictionary dictionary)
 {
-    const char *query;
-    int rc;
-    sqlite3_stmt *handle = NULL;
-    DBStatus status = DB_STATUS_ERROR;
+    switch (encoding) {
+    case ENCODING_STRINGS:
+        return dictionary == YUM_DB_DICT_STRINGS;
+    case ENCODING_DIRNAME:
+    case ENCODING_PATH:
+        return dictionary == YUM_DB_DICT_DIRNAMES;
+    default:
+        return FALSE;
+    }
+}
 
-    query = "SELECT dbversion, checksum FROM db_info";
-    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
-    if (rc != SQLITE_OK)
-        goto cleanup;
+static gboolean
+tables_use_dictionary (const TableSpec *tables, guint layout,
+                       YumDbDictionary dictionary)
+{
+    const TableColumn *column;
 
-    while ((rc = sqlite3_step (handle)) == SQLITE_ROW) {
-        int dbversion;
-        const char *dbchecksum;
+    for (; tables->name; tables++) {
+        for (column = tables->columns; column->name; column++) {
+            if (encoding_uses_dictionary (column_encoding (column, layout),
+                                          dictionary))
+                return TRUE;
+        }
+    }
 
-        dbversion  = sqlite3_column_int  (handle, 0);
-        dbchecksum = (const char *) sqlite3_column_text (handle, 1);
+    return FALSE;
+}
 
-        if (dbversion != YUM_SQLITE_CACHE_DBVERSION) {
-            g_message ("Warning: cache file is version %d, we need %d, will regenerate",
-                       dbversion, YUM_SQLITE_CACHE_DBVERSION);
-            status = DB_STATUS_VERSION_MISMATCH;
-        } else if (strcmp (checksum, dbchecksum)) {
-            g_message ("sqlite cache needs updating, reading in metadata");
-            status = DB_STATUS_CHECKSUM_MISMATCH;
-        } else
-            status = DB_STATUS_OK;
+static gboolean
+table_is_packed (const TableSpec *table, guint layout)
+{
+    return (table->flags & TABLE_DEPENDENCY) &&
+        (layout & YUM_DB_LAYOUT_PACKED_DEPS);
+}
 
-        break;
+static gboolean
+tables_use_packed_deps (const TableSpec *tables, guint layout)
+{
+    for (; tables->name; tables++) {
+        if (table_is_packed (tables, layout))
+            return TRUE;
     }
 
- cleanup:
-    if (handle)
-        sqlite3_finalize (handle);
+    return FALSE;
+}
 
-    return status;
+/* NULL if the table has no storage of its own in this layout */
+static const char *
+table_storage (const TableSpec *table, guint layout)
+{
+    if (table_is_packed (table, layout))
+        return NULL;
+
+    return table_is_encoded (table, layout) ? table->data_name : table->name;
+}
+
+const char *
+yum_db_table_storage (const char *table, guint layout)
+{
+    const TableSpec *spec = table_lookup (table);
+
+    return spec ? table_storage (spec, layout) : table;
 }
 
 static void
-yum_db_create_dbinfo_table (sqlite3 *db, GError **err)
+table_create_columns_sql (GString *sql, const TableSpec *table, guint layout,
+                          gboolean cold)
 {
-    int rc;
-    const char *sql;
+    const TableColumn *column;
+    const char *type;
+    gboolean first = TRUE;
+
+    for (column = table->columns; column->name; column++) {
+        if (column_is_cold (column, layout) != cold)
+            continue;
+
+        if (!first)
+            g_string_append_c (sql, ',');
+        first = FALSE;
+
+        switch (column_encoding (column, layout)) {
+        case ENCODING_PLAIN:
+            type = column->type;
+            break;
+        case ENCODING_HEX:
+        case ENCODING_ZSTD:
+            type = "BLOB";
+            break;
+        case ENCODING_PATH:
+            /* The directory id and what follows it */
+            g_string_append (sql, "  dirname INTEGER,");
+            type = column->type;
+            break;
+        default:
+            type = "INTEGER";
+            break;
+        }
 
-    sql = "CREATE TABLE db_info (dbversion INTEGER, checksum TEXT)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create db_info table: %s",
-                     sqlite3_errmsg (db));
+        g_string_append_printf (sql, "  %s %s",
+                                column_storage (table, column, layout), type);
     }
 }
 
-sqlite3 *
-yum_db_open (const char *path,
-             const char *checksum,
-             CreateTablesFn create_tables,
-             GError **err)
+static char *
+table_create_sql (const TableSpec *table, guint layout)
 {
-    int rc;
-    sqlite3 *db = NULL;
-    gboolean db_existed;
+    GString *sql;
+
+    sql = g_string_new (NULL);
+    g_string_printf (sql, "CREATE TABLE %s (", table_storage (table, layout));
+    table_create_columns_sql (sql, table, layout, FALSE);
+    if (table_row_key (table, layout))
+        g_string_append_printf (sql, ",  %s INTEGER PRIMARY KEY",
+                                table_row_key (table, layout));
+    g_string_append_c (sql, ')');
+
+    if (table_is_split (table, layout)) {
+        g_string_append_printf (sql, ";CREATE TABLE %s_detail ("
+                                "  pkgKey INTEGER PRIMARY KEY,", table->name);
+        table_create_columns_sql (sql, table, layout, TRUE);
+        g_string_append_c (sql, ')');
+    }
 
-    db_existed = g_file_test (path, G_FILE_TEST_EXISTS);
+    return g_string_free (sql, FALSE);
+}
 
-    rc = sqlite3_open (path, &db);
-    if (rc == SQLITE_OK) {
-        if (db_existed) {
-            DBStatus status = dbinfo_status (db, checksum);
+static char *
+table_view_sql (const TableSpec *table, guint layout)
+{
+    GString *sql;
+    GString *joins;
+    const TableColumn *column;
+    int n = 0;
+    int i;
 
-            switch (status) {
-            case DB_STATUS_OK:
-                /* Everything is up-to-date */
-                sqlite3_close (db);
-                return NULL;
-                break;
-            case DB_STATUS_CHECKSUM_MISMATCH:
-                if (YMP_CONFIG_UPDATE_DB) {
-                    sqlite3_exec (db, "PRAGMA synchronous = 0", NULL,NULL,NULL);
-                    sqlite3_exec (db, "DELETE FROM db_info", NULL, NULL, NULL);
-                    return db;
-                    break;
-                }
-                /* FALL THROUGH */
-            case DB_STATUS_VERSION_MISMATCH:
-            case DB_STATUS_ERROR:
-                sqlite3_close (db);
-                db = NULL;
-                unlink (path);
+    sql = g_string_new (NULL);
+    joins = g_string_new (NULL);
+    g_string_printf (sql, "CREATE VIEW %s AS SELECT", table->name);
+
+    for (column = table->columns; column->name; column++) {
+        const char *alias = column_is_cold (column, layout) ? "c" : "d";
+
+        if (column != table->columns)
+            g_string_append_c (sql, ',');
+
+        switch (column_encoding (column, layout)) {
+        case ENCODING_PLAIN:
+            if (table_is_shared (table, layout) &&
+                !strcmp (column->name, "pkgKey"))
+                g_string_append (sql, " p.pkgKey");
+            else
+                g_string_append_printf (sql, " %s.%s", alias, column->name);
+            break;
+        case ENCODING_STRINGS:
+            n++;
+            g_string_append_printf (sql, " s%d.string AS %s",
+                                    n, column->name);
+            g_string_append_printf (joins,
+                                    " %sJOIN strings s%d ON s%d.id = %s.%s",
+                                    column->flags & COLUMN_KEY ? "" : "LEFT ",
+                                    n, n, alias, column->name);
+            break;
+        case ENCODING_DIRNAME:
+            n++;
+            g_string_append_printf (sql, " s%d.path AS %s", n, column->name);
+            g_string_append_printf (joins,
+                                    " %sJOIN dirnames s%d ON s%d.id = d.%s",
+                                    column->flags & COLUMN_KEY ? "" : "LEFT ",
+                                    n, n, column->name);
+            break;
+        case ENCODING_PATH:
+            /* Read through file_paths, which can look a path up */
+            g_string_printf (sql, "CREATE VIEW %s AS SELECT", table->name);
+            for (column = table->columns; column->name; column++)
+                g_string_append_printf (sql, "%s %s",
+                                        column == table->columns ? "" : ",",
+                                        column->name);
+            g_string_append (sql, " FROM file_paths");
+            g_string_free (joins, TRUE);
+            return g_string_free (sql, FALSE);
+        case ENCODING_FLAGS:
+            g_string_append_printf (sql, " CASE d.%s", column->name);
+            for (i = 0; dependency_flags[i]; i++)
+                g_string_append_printf (sql, " WHEN %d THEN '%s'",
+                                        i + 1, dependency_flags[i]);
+            g_string_append_printf (sql, " ELSE d.%s END AS %s",
+                                    column->name, column->name);
+            break;
+        case ENCODING_BOOL:
+            g_string_append_printf (sql, " CASE d.%s WHEN 1 THEN 'TRUE'"
+                                    " WHEN 0 THEN 'FALSE' ELSE d.%s END AS %s",
+                                    column->name, column->name, column->name);
+            break;
+        case ENCODING_ZSTD:
+            g_string_append_printf (sql, " changelog_text(d.%s) AS %s",
+                                    column->name, column->name);
+            break;
+        case ENCODING_HEX:
+            g_string_append_printf (sql, " CASE typeof(d.%s)"
+                                    " WHEN 'blob' THEN lower(hex(d.%s))"
+                                    " ELSE d.%s END AS %s",
+                                    column->name, column->name,
+                                    column->name, column->name);
+            break;
+        }
+    }
+
+    if (table_row_key (table, layout))
+        g_string_append_printf (sql, ", d.%s", table_row_key (table, layout));
+
+    /* sqlite leaves out the detail join when no cold column is read */
+    if (table_is_shared (table, layout))
+        g_string_append_printf (sql, " FROM package_%ss p JOIN %s d"
+                                " ON d.setKey = p.setKey%s", table->name,
+                                table->data_name, joins->str);
+    else if (table_is_split (table, layout))
+        g_string_append_printf (sql, " FROM %s d LEFT JOIN %s_detail c"
+                                " ON c.pkgKey = d.pkgKey%s", table->data_name,
+                                table->name, joins->str);
+    else
+        g_string_append_printf (sql, " FROM %s d%s", table->data_name,
+                                joins->str);
+    g_string_free (joins, TRUE);
+
+    return g_string_free (sql, FALSE);
+}
+
+/* Values are bound in the order of the columns list. Flags and booleans
+   are bound as text and converted here, typed hex digests must be bound
+   as blobs by the caller. With cold set the insertion is the one into
+   the detail table of a split table. */
+static char *
+table_insert_sql (const TableSpec *table, guint layout, gboolean cold,
+                  const char **columns)
+{
+    GString *sql;
+    GString *values;
+    gboolean first = TRUE;
+    int i, j;
+
+    sql = g_string_new (NULL);
+    values = g_string_new (NULL);
+    if (cold)
+        g_string_printf (sql, "INSERT INTO %s_detail (", table->name);
+    else
+        g_string_printf (sql, "INSERT INTO %s (",
+                         table_storage (table, layout));
+
+    for (i = 0; columns[i]; i++) {
+        const TableColumn *column;
+
+        for (column = table->columns; column->name; column++) {
+            if (!strcmp (column->name, columns[i]))
                 break;
-            }
         }
-    } else {
-        /* Let's try to delete it and try again,
-           maybe it's a sqlite3 version mismatch. */
-        sqlite3_close (db);
-        db = NULL;
-        unlink (path);
+
+        g_assert (column->name != NULL);
+
+        /* The detail table gets the cold columns and the pkgKey, the
+           numbering stays the same in both */
+        if (column_is_cold (column, layout) != cold &&
+            !(cold && !strcmp (column->name, "pkgKey")))
+            continue;
+
+        if (!first) {
+            g_string_append (sql, ", ");
+            g_string_append (values, ", ");
+        }
+        first = FALSE;
+
+        switch (column_encoding (column, layout)) {
+        case ENCODING_PATH:
+            g_string_append (sql, "dirname, ");
+            g_string_append_printf (values, "intern_dirnames(path_dirname(?%d)),"
+                                    " path_suffix(?%d)", i + 1, i + 1);
+            break;
+        case ENCODING_DIRNAME:
+            g_string_append_printf (values, "intern_dirnames(?%d)", i + 1);
+            break;
+        case ENCODING_STRINGS:
+            g_string_append_printf (values, "intern_strings(?%d)", i + 1);
+            break;
+        case ENCODING_FLAGS:
+            g_string_append_printf (values, "CASE ?%d", i + 1);
+            for (j = 0; dependency_flags[j]; j++)
+                g_string_append_printf (values, " WHEN '%s' THEN %d",
+                                        dependency_flags[j], j + 1);
+            g_string_append_printf (values, " ELSE ?%d END", i + 1);
+            break;
+        case ENCODING_BOOL:
+            g_string_append_printf (values, "CASE ?%d WHEN 'TRUE' THEN 1"
+                                    " WHEN 'FALSE' THEN 0 ELSE ?%d END",
+                                    i + 1, i + 1);
+            break;
+        default:
+            g_string_append_printf (values, "?%d", i + 1);
+            break;
+        }
+
+        g_string_append (sql, column_storage (table, column, layout));
+    }
+
+    g_string_append_printf (sql, ") VALUES (%s)", values->str);
+    g_string_free (values, TRUE);
+
+    return g_string_free (sql, FALSE);
+}
+
+static void
+create_tables (sqlite3 *db, const TableSpec *tables, guint layout,
+               GError **err)
+{
+    const TableSpec *table;
+    int rc;
+    char *sql;
+    int i;
+
+    for (i = 0; i < YUM_DB_DICTS; i++) {
+        const Dictionary *dict = &dictionaries[i];
+
+        if (!tables_use_dictionary (tables, layout, i))
+            continue;
+
+        sql = g_strdup_printf ("CREATE TABLE %s (id INTEGER PRIMARY KEY, "
+                               "%s TEXT)", dict->table, dict->column);
+        rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+        g_free (sql);
+
+        if (rc != SQLITE_OK) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not create %s table: %s",
+                         dict->table, sqlite3_errmsg (db));
+            return;
+        }
     }
 
-    if (!db) {
-        rc = sqlite3_open (path, &db);
+    if (tables_use_encoding (tables, layout, ENCODING_ZSTD)) {
+        sql = "CREATE TABLE changelog_dicts (id INTEGER PRIMARY KEY, "
+            "dict BLOB)";
+        rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
         if (rc != SQLITE_OK) {
             g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                         "Can not open SQL database: %s",
+                         "Can not create changelog_dicts table: %s",
                          sqlite3_errmsg (db));
-            goto cleanup;
+            return;
         }
     }
 
-    yum_db_create_dbinfo_table (db, err);
-    if (*err)
-        goto cleanup;
+    if (tables_use_packed_deps (tables, layout)) {
+        sql =
+            "CREATE TABLE package_deps ("
+            "  pkgKey INTEGER PRIMARY KEY,"
+            "  requires BLOB,"
+            "  provides BLOB,"
+            "  conflicts BLOB,"
+            "  obsoletes BLOB);"
+            "CREATE TABLE dep_names ("
+            "  name TEXT,"
+            "  kind TEXT,"
+            "  pkgKeys BLOB)";
+        rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not create package_deps table: %s",
+                         sqlite3_errmsg (db));
+            return;
+        }
+    }
 
-    create_tables (db, err);
-    if (*err)
-        goto cleanup;
+    for (table = tables; table->name; table++) {
+        if (table_is_shared (table, layout)) {
+            sql = g_strdup_printf
+                ("CREATE TABLE %s_sets ("
+                 "  setKey INTEGER PRIMARY KEY,"
+                 "  hash BLOB UNIQUE);"
+                 "CREATE TABLE package_%ss ("
+                 "  pkgKey INTEGER PRIMARY KEY,"
+                 "  setKey INTEGER)", table->name, table->name);
+            rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+            g_free (sql);
 
-    sqlite3_exec (db, "PRAGMA synchronous = 0", NULL, NULL, NULL);
+            if (rc != SQLITE_OK) {
+                g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                             "Can not create %s sets table: %s",
+                             table->name, sqlite3_errmsg (db));
+                return;
+            }
+        }
 
- cleanup:
-    if (*err && db) {
-        sqlite3_close (db);
-        db = NULL;
+        if (table_is_packed (table, layout)) {
+            sql = g_strdup_printf
+                ("CREATE VIEW %s AS SELECT name, flags, epoch, version, "
+                 "release, pkgKey%s FROM deps WHERE kind = '%s'",
+                 table->name, table->columns == requires_columns ? ", pre" : "",
+                 table->name);
+            rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+            g_free (sql);
+
+            if (rc != SQLITE_OK) {
+                g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                             "Can not create %s view: %s",
+                             table->name, sqlite3_errmsg (db));
+                return;
+            }
+
+            continue;
+        }
+
+        sql = table_create_sql (table, layout);
+        rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+        g_free (sql);
+
+        if (rc == SQLITE_OK && table_is_encoded (table, layout)) {
+            sql = table_view_sql (table, layout);
+            rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+            g_free (sql);
+        }
+
+        if (rc != SQLITE_OK) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not create %s table: %s",
+                         table->name, sqlite3_errmsg (db));
+            return;
+        }
+    }
+}
+
+/* Deleting a package removes its rows from all the other tables */
+static void
+create_removal_trigger (sqlite3 *db, const TableSpec *tables,
+                        const char *name, guint layout, GError **err)
+{
+    const TableSpec *table;
+    GString *sql;
+    int rc;
+
+    sql = g_string_new (NULL);
+    g_string_printf (sql, "CREATE TRIGGER %s AFTER DELETE ON %s"
+                     "  BEGIN", name, table_storage (tables, layout));
+
+    for (table = tables + 1; table->name; table++) {
+        const char *storage = table_storage (table, layout);
+
+        if (table_is_shared (table, layout))
+            g_string_append_printf (sql, "    DELETE FROM package_%ss"
+                                    " WHERE pkgKey = old.pkgKey;",
+                                    table->name);
+        else if (storage)
+            g_string_append_printf (sql, "    DELETE FROM %s"
+                                    " WHERE pkgKey = old.pkgKey;", storage);
+    }
+
+    if (tables_use_packed_deps (tables, layout))
+        g_string_append (sql, "    DELETE FROM package_deps"
+                         " WHERE pkgKey = old.pkgKey;");
+
+    if (table_is_split (tables, layout))
+        g_string_append_printf (sql, "    DELETE FROM %s_detail"
+                                " WHERE pkgKey = old.pkgKey;", tables->name);
+
+    /* Both as the requiring and as the providing package */
+    for (table = tables + 1; table->name; table++) {
+        if (table_row_key (table, layout))
+            g_string_append (sql, "    DELETE FROM requires_providers"
+                             " WHERE pkgKey = old.pkgKey"
+                             " OR provider = old.pkgKey;");
+    }
+
+    g_string_append (sql, "  END;");
+
+    /* A set goes away with the last package using it */
+    for (table = tables + 1; table->name; table++) {
+        if (!table_is_shared (table, layout))
+            continue;
+
+        g_string_append_printf (sql,
+                                "CREATE TRIGGER %s_%s AFTER DELETE"
+                                "  ON package_%ss WHEN NOT EXISTS"
+                                "  (SELECT 1 FROM package_%ss"
+                                "   WHERE setKey = old.setKey)"
+                                "  BEGIN"
+                                "    DELETE FROM %s WHERE setKey = old.setKey;"
+                                "    DELETE FROM %s_sets"
+                                "    WHERE setKey = old.setKey;"
+                                "  END;", name, table->name, table->name,
+                                table->name, table_storage (table, layout),
+                                table->name);
+    }
+
+    if (table_is_encoded (tables, layout))
+        g_string_append_printf (sql,
+                                "CREATE TRIGGER %s_view INSTEAD OF DELETE ON %s"
+                                "  BEGIN"
+                                "    DELETE FROM %s WHERE pkgKey = old.pkgKey;"
+                                "  END;", name, tables->name, tables->data_name);
+
+    rc = sqlite3_exec (db, sql->str, NULL, NULL, NULL);
+    g_string_free (sql, TRUE);
+
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not create %s trigger: %s",
+                     name, sqlite3_errmsg (db));
+    }
+}
+
+static void
+create_index (sqlite3 *db,
+              const char *index,
+              const TableSpec *table,
+              const char *columns,
+              guint layout,
+              GError **err)
+{
+    int rc;
+    char *sql;
+
+    /* Packed tables are looked up through dep_names */
+    if (!table_storage (table, layout))
+        return;
+
+    sql = g_strdup_printf ("CREATE INDEX IF NOT EXISTS %s ON %s (%s)",
+                           index, table_storage (table, layout), columns);
+    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    g_free (sql);
+
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not create %s index: %s",
+                     index, sqlite3_errmsg (db));
+    }
+}
+
+static void
+create_dictionary_indexes (sqlite3 *db, const TableSpec *tables,
+                           guint layout, GError **err)
+{
+    int rc;
+    char *sql;
+    int i;
+
+    for (i = 0; i < YUM_DB_DICTS; i++) {
+        const Dictionary *dict = &dictionaries[i];
+
+        if (!tables_use_dictionary (tables, layout, i))
+            continue;
+
+        sql = g_strdup_printf ("CREATE UNIQUE INDEX IF NOT EXISTS %s "
+                               "ON %s (%s)", dict->index, dict->table,
+                               dict->column);
+        rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+        g_free (sql);
+
+        if (rc != SQLITE_OK) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not create %s index: %s",
+                         dict->index, sqlite3_errmsg (db));
+            return;
+        }
+    }
+}
+
+/* Removed packages leave values behind which no row uses any more,
+   they are deleted after the removals. Their ids are not reused. */
+static void
+prune_dictionaries (sqlite3 *db, const TableSpec *tables, guint layout,
+                    GError **err)
+{
+    const TableSpec *table;
+    const TableColumn *column;
+    ColumnEncoding encoding;
+    GString *sql;
+    int rc;
+    int i;
+
+    for (i = 0; i < YUM_DB_DICTS && !*err; i++) {
+        const Dictionary *dict = &dictionaries[i];
+        gboolean first = TRUE;
+
+        if (!tables_use_dictionary (tables, layout, i))
+            continue;
+
+        sql = g_string_new (NULL);
+        g_string_printf (sql, "DELETE FROM %s WHERE id NOT IN (", dict->table);
+
+        for (table = tables; table->name; table++) {
+            if (!table_storage (table, layout))
+                continue;
+
+            for (column = table->columns; column->name; column++) {
+                const char *name = column->name;
+
+                encoding = column_encoding (column, layout);
+                if (!encoding_uses_dictionary (encoding, i))
+                    continue;
+
+                /* Paths keep the id in their dirname column */
+                if (encoding == ENCODING_PATH)
+                    name = "dirname";
+
+                g_string_append_printf (sql, "%s SELECT %s FROM ",
+                                        first ? "" : " UNION ALL", name);
+                if (column_is_cold (column, layout))
+                    g_string_append_printf (sql, "%s_detail", table->name);
+                else
+                    g_string_append (sql, table_storage (table, layout));
+                g_string_append_printf (sql, " WHERE %s IS NOT NULL", name);
+                first = FALSE;
+            }
+        }
+
+        g_string_append_c (sql, ')');
+
+        rc = first ? SQLITE_OK : sqlite3_exec (db, sql->str, NULL, NULL, NULL);
+        g_string_free (sql, TRUE);
+
+        if (rc != SQLITE_OK)
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not prune %s: %s",
+                         dict->table, sqlite3_errmsg (db));
+    }
+}
+
+/* A dictionary is filled in memory while loading, its intern_*() SQL
+   function hands out the ids. It is shared by the writer threads, hence
+   the lock. */
+
+struct _YumDbStrings {
+    const Dictionary *dict;
+    GMutex lock;
+    GHashTable *ids;
+    GPtrArray *values;
+    GStringChunk *chunk;
+    guint written;      /* Values already in the strings table */
+};
+
+YumDbStrings *
+yum_db_strings_new (YumDbDictionary dictionary)
+{
+    YumDbStrings *strings;
+
+    strings = g_new0 (YumDbStrings, 1);
+    strings->dict = &dictionaries[dictionary];
+    g_mutex_init (&strings->lock);
+    strings->ids = g_hash_table_new (g_str_hash, g_str_equal);
+    strings->values = g_ptr_array_new ();
+    strings->chunk = g_string_chunk_new (PACKAGE_STRINGS_CHUNK);
+
+    return strings;
+}
+
+void
+yum_db_strings_free (YumDbStrings *strings)
+{
+    g_hash_table_destroy (strings->ids);
+    g_ptr_array_free (strings->values, TRUE);
+    g_string_chunk_free (strings->chunk);
+    g_mutex_clear (&strings->lock);
+    g_free (strings);
+}
+
+static void
+strings_add (YumDbStrings *strings, const char *value)
+{
+    char *copy = g_string_chunk_insert (strings->chunk, value);
+
+    g_ptr_array_add (strings->values, copy);
+    g_hash_table_insert (strings->ids, copy,
+                         GUINT_TO_POINTER (strings->values->len));
+}
+
+/* Picks up the strings of a cache being updated. The ids pruned values
+   had stay gaps, new values are numbered after the last one. */
+static void
+strings_load (YumDbStrings *strings, sqlite3 *db)
+{
+    sqlite3_stmt *handle = NULL;
+    char *query;
+    gint64 id;
+
+    query = g_strdup_printf ("SELECT id, %s FROM %s ORDER BY id",
+                             strings->dict->column, strings->dict->table);
+    if (sqlite3_prepare (db, query, -1, &handle, NULL) == SQLITE_OK) {
+        while (sqlite3_step (handle) == SQLITE_ROW) {
+            id = sqlite3_column_int64 (handle, 0);
+            if (id <= strings->values->len)
+                continue;
+
+            g_ptr_array_set_size (strings->values, id - 1);
+            strings_add (strings,
+                         (const char *) sqlite3_column_text (handle, 1));
+        }
+    }
+
+    sqlite3_finalize (handle);
+    g_free (query);
+    strings->written = strings->values->len;
+}
+
+static void
+intern_strings (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    YumDbStrings *strings = (YumDbStrings *) sqlite3_user_data (ctx);
+    const char *value;
+    gpointer id;
+
+    if (sqlite3_value_type (argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null (ctx);
+        return;
+    }
+
+    value = (const char *) sqlite3_value_text (argv[0]);
+
+    g_mutex_lock (&strings->lock);
+
+    id = g_hash_table_lookup (strings->ids, value);
+    if (!id) {
+        strings_add (strings, value);
+        id = GUINT_TO_POINTER (strings->values->len);
+    }
+
+    g_mutex_unlock (&strings->lock);
+
+    sqlite3_result_int64 (ctx, GPOINTER_TO_UINT (id));
+}
+
+void
+yum_db_strings_attach (YumDbStrings *strings, sqlite3 *db, GError **err)
+{
+    int rc;
+
+    if (strings->values->len == 0)
+        strings_load (strings, db);
+
+    rc = sqlite3_create_function (db, strings->dict->function, 1,
+                                  SQLITE_UTF8, strings, intern_strings,
+                                  NULL, NULL);
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not register %s: %s",
+                     strings->dict->function, sqlite3_errmsg (db));
+}
+
+void
+yum_db_strings_write (YumDbStrings *strings, sqlite3 *db, GError **err)
+{
+    int rc;
+    guint i;
+    sqlite3_stmt *handle = NULL;
+    char *query;
+
+    if (strings->written == strings->values->len)
+        return;
+
+    query = g_strdup_printf ("INSERT INTO %s (id, %s) VALUES (?, ?)",
+                             strings->dict->table, strings->dict->column);
+    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    g_free (query);
+
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not prepare %s insertion: %s",
+                     strings->dict->table, sqlite3_errmsg (db));
+        return;
+    }
+
+    /* A savepoint, the build may already be in a transaction that a
+       checkpoint has to be able to roll back */
+    sqlite3_exec (db, "SAVEPOINT strings", NULL, NULL, NULL);
+
+    for (i = strings->written; i < strings->values->len; i++) {
+        /* A gap, see strings_load() */
+        if (!g_ptr_array_index (strings->values, i))
+            continue;
+
+        sqlite3_bind_int64 (handle, 1, i + 1);
+        sqlite3_bind_text (handle, 2, g_ptr_array_index (strings->values, i),
+                           -1, SQLITE_STATIC);
+
+        rc = sqlite3_step (handle);
+        sqlite3_reset (handle);
+
+        if (rc != SQLITE_DONE) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Error adding string to SQL: %s",
+                         sqlite3_errmsg (db));
+            break;
+        }
+    }
+
+    if (*err)
+        sqlite3_exec (db, "ROLLBACK TO strings", NULL, NULL, NULL);
+    sqlite3_exec (db, "RELEASE strings", NULL, NULL, NULL);
+    sqlite3_finalize (handle);
+
+    if (!*err)
+        strings->written = i;
+}
+
+/* Starts an empty dictionary with the ids the same dictionary of db
+   gave, so both databases use one id per value. The values are written
+   to this database with the new ones. */
+void
+yum_db_strings_share (YumDbStrings *strings, sqlite3 *db)
+{
+    if (strings->values->len > 0)
+        return;
+
+    strings_load (strings, db);
+    strings->written = 0;
+}
+
+/* Compressed changelogs are zstd frames made with a dictionary trained
+   from the changelogs of the repository, stored in changelog_dicts under
+   its dictionary id. A changelog which does not shrink stays text. */
+
+#define CHANGELOG_DICT_SIZE (112 * 1024)
+#define CHANGELOG_SAMPLE_SIZE (100 * CHANGELOG_DICT_SIZE)
+/* Short texts gain little from the slow levels, a mid one compresses a
+   repository's changelogs in half the time of level 19 */
+#define CHANGELOG_ZSTD_LEVEL 9
+
+struct _YumDbCompressor {
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+    ZSTD_CDict *cdict;
+#endif
+    GString *buf;
+};
+
+YumDbCompressor *
+yum_db_compressor_new (void)
+{
+    YumDbCompressor *compressor;
+
+    compressor = g_new0 (YumDbCompressor, 1);
+    compressor->buf = g_string_sized_new (4096);
+
+    return compressor;
+}
+
+void
+yum_db_compressor_free (YumDbCompressor *compressor)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx (compressor->cctx);
+    ZSTD_freeCDict (compressor->cdict);
+#endif
+    g_string_free (compressor->buf, TRUE);
+    g_free (compressor);
+}
+
+#ifdef HAVE_ZSTD
+
+static void
+compress_changelog (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    YumDbCompressor *compressor = sqlite3_user_data (ctx);
+    const void *text = sqlite3_value_text (argv[0]);
+    int len = sqlite3_value_bytes (argv[0]);
+    size_t size;
+
+    if (sqlite3_value_type (argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_value (ctx, argv[0]);
+        return;
+    }
+
+    g_string_set_size (compressor->buf, ZSTD_compressBound (len));
+
+    if (compressor->cdict)
+        size = ZSTD_compress_usingCDict (compressor->cctx,
+                                         compressor->buf->str,
+                                         compressor->buf->len, text, len,
+                                         compressor->cdict);
+    else
+        size = ZSTD_compressCCtx (compressor->cctx, compressor->buf->str,
+                                  compressor->buf->len, text, len,
+                                  CHANGELOG_ZSTD_LEVEL);
+
+    if (ZSTD_isError (size) || size >= (size_t) len)
+        sqlite3_result_value (ctx, argv[0]);
+    else
+        sqlite3_result_blob (ctx, compressor->buf->str, size,
+                             SQLITE_TRANSIENT);
+}
+
+/* Samples are spread over the whole table, up to CHANGELOG_SAMPLE_SIZE */
+static gboolean
+compressor_train (YumDbCompressor *compressor, sqlite3 *db,
+                  const char *storage, const char *column, GError **err)
+{
+    sqlite3_stmt *handle = NULL;
+    GString *samples;
+    GArray *sizes;
+    char *query;
+    gint64 total = 0;
+    gint64 step;
+    void *dict;
+    size_t dict_size;
+    int rc;
+
+    query = g_strdup_printf ("SELECT total(length(%s)) FROM temp.%s",
+                             column, storage);
+    if (sqlite3_prepare (db, query, -1, &handle, NULL) == SQLITE_OK &&
+        sqlite3_step (handle) == SQLITE_ROW)
+        total = sqlite3_column_int64 (handle, 0);
+    sqlite3_finalize (handle);
+    g_free (query);
+
+    step = total / CHANGELOG_SAMPLE_SIZE + 1;
+
+    query = g_strdup_printf ("SELECT %s FROM temp.%s WHERE rowid %% %"
+                             G_GINT64_FORMAT " = 0 AND %s IS NOT NULL",
+                             column, storage, step, column);
+    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    g_free (query);
+
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not prepare changelog sampling: %s",
+                     sqlite3_errmsg (db));
+        sqlite3_finalize (handle);
+        return FALSE;
+    }
+
+    samples = g_string_new (NULL);
+    sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+
+    while (sqlite3_step (handle) == SQLITE_ROW) {
+        size_t len = sqlite3_column_bytes (handle, 0);
+
+        g_string_append_len (samples,
+                             (const char *) sqlite3_column_text (handle, 0),
+                             len);
+        g_array_append_val (sizes, len);
+    }
+
+    sqlite3_finalize (handle);
+
+    dict = g_malloc (CHANGELOG_DICT_SIZE);
+    dict_size = ZDICT_trainFromBuffer (dict, CHANGELOG_DICT_SIZE,
+                                       samples->str,
+                                       (size_t *) sizes->data, sizes->len);
+
+    g_string_free (samples, TRUE);
+    g_array_free (sizes, TRUE);
+
+    /* Too little to train on, plain zstd will do */
+    if (ZDICT_isError (dict_size)) {
+        g_free (dict);
+        return FALSE;
+    }
+
+    query = "INSERT INTO changelog_dicts (id, dict) VALUES (?, ?)";
+    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64 (handle, 1, ZDICT_getDictID (dict, dict_size));
+        sqlite3_bind_blob (handle, 2, dict, dict_size, SQLITE_STATIC);
+        rc = sqlite3_step (handle);
+    }
+    sqlite3_finalize (handle);
+
+    if (rc != SQLITE_DONE) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not store changelog dictionary: %s",
+                     sqlite3_errmsg (db));
+        g_free (dict);
+        return FALSE;
+    }
+
+    compressor->cdict = ZSTD_createCDict (dict, dict_size,
+                                          CHANGELOG_ZSTD_LEVEL);
+    g_free (dict);
+
+    return TRUE;
+}
+
+#endif
+
+/* A cache being updated keeps the dictionary it was built with */
+void
+yum_db_compressor_train (YumDbCompressor *compressor,
+                         sqlite3 *db,
+                         const char *table,
+                         guint layout,
+                         GError **err)
+{
+#ifdef HAVE_ZSTD
+    const TableSpec *spec = table_lookup (table);
+    const TableColumn *column;
+    sqlite3_stmt *handle = NULL;
+    const char *query;
+    int rc;
+
+    for (column = spec->columns; column->name; column++) {
+        if (column_encoding (column, layout) == ENCODING_ZSTD)
+            break;
+    }
+
+    g_assert (column->name != NULL);
+
+    compressor->cctx = ZSTD_createCCtx ();
+
+    query = "SELECT dict FROM changelog_dicts LIMIT 1";
+    if (sqlite3_prepare (db, query, -1, &handle, NULL) == SQLITE_OK &&
+        sqlite3_step (handle) == SQLITE_ROW)
+        compressor->cdict =
+            ZSTD_createCDict (sqlite3_column_blob (handle, 0),
+                              sqlite3_column_bytes (handle, 0),
+                              CHANGELOG_ZSTD_LEVEL);
+    sqlite3_finalize (handle);
+
+    if (!compressor->cdict) {
+        compressor_train (compressor, db, table_storage (spec, layout),
+                          column->name, err);
+        if (*err)
+            return;
+    }
+
+    rc = sqlite3_create_function (db, "compress_changelog", 1, SQLITE_UTF8,
+                                  compressor, compress_changelog, NULL, NULL);
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not register compress_changelog: %s",
+                     sqlite3_errmsg (db));
+#else
+    g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                 "Can not compress changelogs: built without zstd");
+#endif
+}
+
+/* Packed dependencies keep every dependency list of a package in one
+   blob per kind in package_deps. An entry is five strings (name, flags,
+   epoch, version, release), each a varint of its length plus one (0 is
+   NULL) followed by the bytes, and a pre byte. dep_names maps a name to
+   the delta coded pkgKeys using it, the deps virtual table reads both. */
+
+static const char *dependency_kinds[] = {
+    "requires", "provides", "conflicts", "obsoletes", NULL
+};
+
+#define DEPENDENCY_KINDS 4
+#define DEPENDENCY_FIELDS 5
+
+static void
+varint_put (GString *buf, guint64 value)
+{
+    while (value >= 0x80) {
+        g_string_append_c (buf, (value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+
+    g_string_append_c (buf, value);
+}
+
+static gboolean
+varint_get (const guchar **pos, const guchar *end, guint64 *value)
+{
+    const guchar *p = *pos;
+    int shift = 0;
+
+    *value = 0;
+    while (p < end && shift < 64) {
+        *value |= (guint64) (*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *pos = p;
+            return TRUE;
+        }
+        shift += 7;
+    }
+
+    return FALSE;
+}
+
+static void
+packed_string_put (GString *buf, const char *str)
+{
+    gsize len;
+
+    if (!str) {
+        varint_put (buf, 0);
+        return;
+    }
+
+    len = strlen (str);
+    varint_put (buf, len + 1);
+    g_string_append_len (buf, str, len);
+}
+
+static void
+packed_deps_put (GString *buf, GSList *deps)
+{
+    GSList *iter;
+
+    for (iter = deps; iter; iter = iter->next) {
+        Dependency *dep = (Dependency *) iter->data;
+
+        packed_string_put (buf, dep->name);
+        packed_string_put (buf, dep->flags);
+        packed_string_put (buf, dep->epoch);
+        packed_string_put (buf, dep->version);
+        packed_string_put (buf, dep->release);
+        g_string_append_c (buf, dep->pre ? 1 : 0);
+    }
+}
+
+typedef struct {
+    const char *str;
+    gsize len;
+} PackedString;
+
+typedef struct {
+    PackedString fields[DEPENDENCY_FIELDS];
+    gboolean pre;
+} PackedDependency;
+
+static gboolean
+packed_deps_get (const guchar **pos, const guchar *end, PackedDependency *dep)
+{
+    guint64 len;
+    int i;
+
+    for (i = 0; i < DEPENDENCY_FIELDS; i++) {
+        if (!varint_get (pos, end, &len) || (guint64) (end - *pos) < len)
+            return FALSE;
+
+        if (len == 0) {
+            dep->fields[i].str = NULL;
+        } else {
+            dep->fields[i].str = (const char *) *pos;
+            dep->fields[i].len = len - 1;
+            *pos += len - 1;
+        }
+    }
+
+    if (*pos >= end)
+        return FALSE;
+
+    dep->pre = *(*pos)++ != 0;
+
+    return TRUE;
+}
+
+sqlite3_stmt *
+yum_db_package_deps_prepare (sqlite3 *db, GError **err)
+{
+    int rc;
+    sqlite3_stmt *handle = NULL;
+    const char *query;
+
+    query =
+        "INSERT INTO package_deps (pkgKey, requires, provides, conflicts, "
+        "  obsoletes) VALUES (?, ?, ?, ?, ?)";
+
+    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not prepare package_deps insertion: %s",
+                     sqlite3_errmsg (db));
+        sqlite3_finalize (handle);
+        handle = NULL;
+    }
+
+    return handle;
+}
+
+void
+yum_db_package_deps_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
+{
+    GString *buf;
+    GSList *lists[DEPENDENCY_KINDS];
+    gsize offsets[DEPENDENCY_KINDS + 1];
+    int i, rc;
+
+    lists[0] = p->requires;
+    lists[1] = p->provides;
+    lists[2] = p->conflicts;
+    lists[3] = p->obsoletes;
+
+    /* All four lists go into one buffer, bound as slices of it */
+    buf = g_string_sized_new (1024);
+    for (i = 0; i < DEPENDENCY_KINDS; i++) {
+        offsets[i] = buf->len;
+        packed_deps_put (buf, lists[i]);
+    }
+    offsets[i] = buf->len;
+
+    sqlite3_bind_int64 (handle, 1, p->pkgKey);
+    for (i = 0; i < DEPENDENCY_KINDS; i++) {
+        if (offsets[i + 1] > offsets[i])
+            sqlite3_bind_blob (handle, i + 2, buf->str + offsets[i],
+                               offsets[i + 1] - offsets[i], SQLITE_STATIC);
+        else
+            sqlite3_bind_null (handle, i + 2);
+    }
+
+    rc = sqlite3_step (handle);
+    sqlite3_reset (handle);
+    g_string_free (buf, TRUE);
+
+    if (rc != SQLITE_DONE)
+        g_critical ("Error adding dependencies to SQL: %s",
+                    sqlite3_errmsg (db));
+}
+
+/* pack_keys(pkgKey) aggregate: the sorted, distinct keys, delta coded */
+
+static gint
+compare_keys (gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *) a;
+    gint64 y = *(const gint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+pack_keys_step (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    GArray **keys = sqlite3_aggregate_context (ctx, sizeof (GArray *));
+    gint64 key;
+
+    if (!keys)
+        return;
+
+    if (!*keys)
+        *keys = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    key = sqlite3_value_int64 (argv[0]);
+    g_array_append_val (*keys, key);
+}
+
+static void
+pack_keys_final (sqlite3_context *ctx)
+{
+    GArray **keys = sqlite3_aggregate_context (ctx, 0);
+    GString *buf;
+    gint64 last = 0;
+    guint i;
+
+    if (!keys || !*keys) {
+        sqlite3_result_null (ctx);
+        return;
+    }
+
+    g_array_sort (*keys, compare_keys);
+
+    buf = g_string_new (NULL);
+    for (i = 0; i < (*keys)->len; i++) {
+        gint64 key = g_array_index (*keys, gint64, i);
+
+        if (i > 0 && key == last)
+            continue;
+
+        varint_put (buf, key - last);
+        last = key;
+    }
+
+    sqlite3_result_blob (ctx, buf->str, buf->len, SQLITE_TRANSIENT);
+    g_string_free (buf, TRUE);
+    g_array_free (*keys, TRUE);
+}
+
+/* The deps virtual table, also usable as deps(pkgKey, kind). Lookups by
+   pkgKey read one package_deps row, lookups by name go through dep_names,
+   anything else scans package_deps. */
+
+enum {
+    DEPS_NAME,
+    DEPS_FLAGS,
+    DEPS_EPOCH,
+    DEPS_VERSION,
+    DEPS_RELEASE,
+    DEPS_PRE,
+    DEPS_PKGKEY,
+    DEPS_KIND
+};
+
+#define DEPS_BY_PKGKEY (1 << 0)
+#define DEPS_BY_KIND   (1 << 1)
+#define DEPS_BY_NAME   (1 << 2)
+
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+} DepsTable;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3 *db;
+
+    sqlite3_stmt *packages;
+    sqlite3_stmt *names;
+
+    /* Keys of the current dep_names row, and its kind */
+    const guchar *keys;
+    const guchar *keys_end;
+    gint64 key;
+    int names_kind;
+
+    int kind;                   /* -1 for all of them */
+    char *name;
+
+    gboolean have_row;
+    int current_kind;
+    const guchar *pos;
+    const guchar *end;
+
+    gint64 pkgKey;
+    PackedDependency dep;
+    sqlite3_int64 rowid;
+    gboolean eof;
+} DepsCursor;
+
+static int
+deps_connect (sqlite3 *db, void *aux, int argc, const char *const *argv,
+              sqlite3_vtab **vtab, char **errmsg)
+{
+    DepsTable *table;
+    int rc;
+
+    rc = sqlite3_declare_vtab (db,
+                               "CREATE TABLE x (name TEXT, flags TEXT, "
+                               "epoch TEXT, version TEXT, release TEXT, "
+                               "pre BOOLEAN, pkgKey INTEGER HIDDEN, "
+                               "kind TEXT HIDDEN)");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    table = g_new0 (DepsTable, 1);
+    table->db = db;
+    *vtab = &table->base;
+
+    return SQLITE_OK;
+}
+
+static int
+deps_disconnect (sqlite3_vtab *vtab)
+{
+    g_free (vtab);
+
+    return SQLITE_OK;
+}
+
+static int
+deps_best_index (sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+    int slots[3] = { -1, -1, -1 };
+    int i, n = 0;
+
+    for (i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+
+        if (!c->usable || c->op != SQLITE_INDEX_CONSTRAINT_EQ)
+            continue;
+
+        if (c->iColumn == DEPS_PKGKEY)
+            slots[0] = i;
+        else if (c->iColumn == DEPS_KIND)
+            slots[1] = i;
+        else if (c->iColumn == DEPS_NAME)
+            slots[2] = i;
+    }
+
+    /* Arguments come in pkgKey, kind, name order */
+    info->idxNum = 0;
+    for (i = 0; i < 3; i++) {
+        if (slots[i] < 0)
+            continue;
+
+        info->idxNum |= 1 << i;
+        info->aConstraintUsage[slots[i]].argvIndex = ++n;
+        info->aConstraintUsage[slots[i]].omit = 1;
+    }
+
+    if (info->idxNum & DEPS_BY_PKGKEY)
+        info->estimatedCost = 10;
+    else if (info->idxNum & DEPS_BY_NAME)
+        info->estimatedCost = 1000;
+    else if (info->idxNum & DEPS_BY_KIND)
+        info->estimatedCost = 500000;
+    else
+        info->estimatedCost = 1000000;
+
+    return SQLITE_OK;
+}
+
+/* Position in dependency_kinds, -1 if it is none of them */
+static int
+dependency_kind_find (const char *kind)
+{
+    int k;
+
+    for (k = 0; kind && dependency_kinds[k]; k++) {
+        if (!strcmp (kind, dependency_kinds[k]))
+            return k;
+    }
+
+    return -1;
+}
+
+static int
+deps_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor)
+{
+    DepsCursor *cur;
+
+    cur = g_new0 (DepsCursor, 1);
+    cur->db = ((DepsTable *) vtab)->db;
+    *cursor = &cur->base;
+
+    return SQLITE_OK;
+}
+
+static void
+deps_cursor_reset (DepsCursor *cur)
+{
+    sqlite3_finalize (cur->packages);
+    sqlite3_finalize (cur->names);
+    cur->packages = NULL;
+    cur->names = NULL;
+    cur->keys = cur->keys_end = NULL;
+    cur->key = 0;
+    g_free (cur->name);
+    cur->name = NULL;
+    cur->have_row = FALSE;
+    cur->pos = cur->end = NULL;
+    cur->eof = TRUE;
+}
+
+static int
+deps_close (sqlite3_vtab_cursor *cursor)
+{
+    DepsCursor *cur = (DepsCursor *) cursor;
+
+    deps_cursor_reset (cur);
+    g_free (cur);
+
+    return SQLITE_OK;
+}
+
+/* Positions packages on the next package_deps row to read */
+static gboolean
+deps_next_package (DepsCursor *cur)
+{
+    guint64 delta;
+
+    if (!cur->names)
+        return sqlite3_step (cur->packages) == SQLITE_ROW;
+
+    for (;;) {
+        if (cur->keys < cur->keys_end &&
+            varint_get (&cur->keys, cur->keys_end, &delta)) {
+            cur->key += delta;
+            sqlite3_reset (cur->packages);
+            sqlite3_bind_int64 (cur->packages, 1, cur->key);
+            if (sqlite3_step (cur->packages) == SQLITE_ROW)
+                return TRUE;
+            continue;
+        }
+
+        if (sqlite3_step (cur->names) != SQLITE_ROW)
+            return FALSE;
+
+        cur->keys = sqlite3_column_blob (cur->names, 0);
+        cur->keys_end = cur->keys + sqlite3_column_bytes (cur->names, 0);
+        cur->key = 0;
+        cur->names_kind = cur->kind < 0 ?
+            dependency_kind_find ((const char *)
+                                  sqlite3_column_text (cur->names, 1)) :
+            cur->kind;
+        if (cur->names_kind < 0)
+            cur->keys = cur->keys_end;
+    }
+}
+
+static int
+deps_next (sqlite3_vtab_cursor *cursor)
+{
+    DepsCursor *cur = (DepsCursor *) cursor;
+
+    for (;;) {
+        if (cur->pos < cur->end) {
+            if (!packed_deps_get (&cur->pos, cur->end, &cur->dep)) {
+                cur->pos = cur->end;
+                continue;
+            }
+
+            if (cur->name &&
+                (!cur->dep.fields[0].str ||
+                 cur->dep.fields[0].len != strlen (cur->name) ||
+                 memcmp (cur->dep.fields[0].str, cur->name,
+                         cur->dep.fields[0].len)))
+                continue;
+
+            cur->rowid++;
+            return SQLITE_OK;
+        }
+
+        /* Next blob of the current row, or the next row. A dep_names row
+           is for one kind, the package is read for that one only. */
+        if (cur->have_row && cur->kind < 0 && !cur->names &&
+            cur->current_kind + 1 < DEPENDENCY_KINDS) {
+            cur->current_kind++;
+        } else {
+            if (!deps_next_package (cur)) {
+                cur->eof = TRUE;
+                return SQLITE_OK;
+            }
+
+            cur->have_row = TRUE;
+            if (cur->names)
+                cur->current_kind = cur->names_kind;
+            else
+                cur->current_kind = cur->kind < 0 ? 0 : cur->kind;
+            cur->pkgKey = sqlite3_column_int64 (cur->packages, 0);
+        }
+
+        cur->pos = sqlite3_column_blob (cur->packages, cur->current_kind + 1);
+        cur->end = cur->pos +
+            sqlite3_column_bytes (cur->packages, cur->current_kind + 1);
+    }
+}
+
+static int
+deps_filter (sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr,
+             int argc, sqlite3_value **argv)
+{
+    DepsCursor *cur = (DepsCursor *) cursor;
+    sqlite3_value *key = NULL;
+    const char *query;
+    int i = 0;
+    int rc;
+
+    deps_cursor_reset (cur);
+    cur->eof = FALSE;
+    cur->kind = -1;
+    cur->rowid = 0;
+
+    if (idxNum & DEPS_BY_PKGKEY)
+        key = argv[i++];
+
+    if (idxNum & DEPS_BY_KIND) {
+        cur->kind = dependency_kind_find ((const char *)
+                                          sqlite3_value_text (argv[i++]));
+
+        /* No such kind, no rows */
+        if (cur->kind < 0) {
+            cur->eof = TRUE;
+            return SQLITE_OK;
+        }
+    }
+
+    if (idxNum & DEPS_BY_NAME) {
+        const char *name = (const char *) sqlite3_value_text (argv[i++]);
+
+        if (!name) {
+            cur->eof = TRUE;
+            return SQLITE_OK;
+        }
+
+        cur->name = g_strdup (name);
+    }
+
+    if (key || cur->name)
+        query = "SELECT pkgKey, requires, provides, conflicts, obsoletes "
+            "FROM package_deps WHERE pkgKey = ?";
+    else
+        query = "SELECT pkgKey, requires, provides, conflicts, obsoletes "
+            "FROM package_deps";
+
+    rc = sqlite3_prepare_v2 (cur->db, query, -1, &cur->packages, NULL);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    if (key) {
+        sqlite3_bind_value (cur->packages, 1, key);
+    } else if (cur->name) {
+        if (cur->kind < 0)
+            query = "SELECT pkgKeys, kind FROM dep_names WHERE name = ?";
+        else
+            query = "SELECT pkgKeys FROM dep_names WHERE name = ? AND kind = ?";
+
+        rc = sqlite3_prepare_v2 (cur->db, query, -1, &cur->names, NULL);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        sqlite3_bind_text (cur->names, 1, cur->name, -1, SQLITE_STATIC);
+        if (cur->kind >= 0)
+            sqlite3_bind_text (cur->names, 2, dependency_kinds[cur->kind], -1,
+                               SQLITE_STATIC);
+    }
+
+    return deps_next (cursor);
+}
+
+static int
+deps_eof (sqlite3_vtab_cursor *cursor)
+{
+    return ((DepsCursor *) cursor)->eof;
+}
+
+static int
+deps_column (sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int column)
+{
+    DepsCursor *cur = (DepsCursor *) cursor;
+    PackedString *field;
+
+    switch (column) {
+    case DEPS_PRE:
+        sqlite3_result_text (ctx, cur->dep.pre ? "TRUE" : "FALSE", -1,
+                             SQLITE_STATIC);
+        break;
+    case DEPS_PKGKEY:
+        sqlite3_result_int64 (ctx, cur->pkgKey);
+        break;
+    case DEPS_KIND:
+        sqlite3_result_text (ctx, dependency_kinds[cur->current_kind], -1,
+                             SQLITE_STATIC);
+        break;
+    default:
+        field = &cur->dep.fields[column];
+        if (field->str)
+            sqlite3_result_text (ctx, field->str, field->len,
+                                 SQLITE_TRANSIENT);
+        else
+            sqlite3_result_null (ctx);
+        break;
+    }
+
+    return SQLITE_OK;
+}
+
+static int
+deps_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+    DepsCursor *cur = (DepsCursor *) cursor;
+
+    *rowid = cur->rowid;
+
+    return SQLITE_OK;
+}
+
+static sqlite3_module deps_module = {
+    0,                  /* iVersion */
+    NULL,               /* xCreate, eponymous only */
+    deps_connect,
+    deps_best_index,
+    deps_disconnect,
+    NULL,               /* xDestroy */
+    deps_open,
+    deps_close,
+    deps_filter,
+    deps_next,
+    deps_eof,
+    deps_column,
+    deps_rowid,
+};
+
+/* In the dirnames layout a path is stored as the id of its directory
+   and the rest of it, "/usr/bin/ls" as "/usr/bin" and "/ls". The two
+   parts always concatenate back to the path. */
+
+static void
+path_split (const char *path, int len, int *dir_len, const char **suffix)
+{
+    const char *slash = memrchr (path, '/', len);
+
+    if (!slash) {
+        *dir_len = -1;
+        *suffix = path;
+    } else if (slash == path) {
+        *dir_len = 1;
+        *suffix = path + 1;
+    } else {
+        *dir_len = slash - path;
+        *suffix = slash;
+    }
+}
+
+static void
+path_dirname (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const char *path = (const char *) sqlite3_value_text (argv[0]);
+    const char *suffix;
+    int dir_len;
+
+    if (!path) {
+        sqlite3_result_null (ctx);
+        return;
+    }
+
+    path_split (path, sqlite3_value_bytes (argv[0]), &dir_len, &suffix);
+    if (dir_len < 0)
+        sqlite3_result_null (ctx);
+    else
+        sqlite3_result_text (ctx, path, dir_len, SQLITE_TRANSIENT);
+}
+
+static void
+path_suffix (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const char *path = (const char *) sqlite3_value_text (argv[0]);
+    const char *suffix;
+    int len = sqlite3_value_bytes (argv[0]);
+    int dir_len;
+
+    if (!path) {
+        sqlite3_result_null (ctx);
+        return;
+    }
+
+    path_split (path, len, &dir_len, &suffix);
+    sqlite3_result_text (ctx, suffix, len - (suffix - path), SQLITE_TRANSIENT);
+}
+
+/* rpmvercmp(a, b) in SQL, -1, 0 or 1 */
+static void
+sql_rpmvercmp (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const char *a = (const char *) sqlite3_value_text (argv[0]);
+    const char *b = (const char *) sqlite3_value_text (argv[1]);
+
+    if (!a || !b) {
+        sqlite3_result_null (ctx);
+        return;
+    }
+
+    sqlite3_result_int (ctx, yum_evr_compare (a, sqlite3_value_bytes (argv[0]),
+                                              b, sqlite3_value_bytes (argv[1])));
+}
+
+static int
+collate_rpmvercmp (void *data, int a_len, const void *a,
+                   int b_len, const void *b)
+{
+    return yum_evr_compare (a, a_len, b, b_len);
+}
+
+/* evr_key(epoch, version, release), what packages.evr holds */
+static void
+sql_evr_key (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    GString *key;
+
+    key = g_string_sized_new (32);
+    yum_evr_key (key,
+                 (const char *) sqlite3_value_text (argv[0]),
+                 (const char *) sqlite3_value_text (argv[1]),
+                 (const char *) sqlite3_value_text (argv[2]));
+    sqlite3_result_blob (ctx, key->str, key->len, SQLITE_TRANSIENT);
+    g_string_free (key, TRUE);
+}
+
+/* The file_paths virtual table reads files_data with the paths joined
+   back. A path lookup becomes an index lookup on (dirname, name), a
+   pkgKey lookup uses pkgfiles, anything else is a scan. */
+
+enum {
+    FILE_PATHS_NAME,
+    FILE_PATHS_TYPE,
+    FILE_PATHS_PKGKEY
+};
+
+#define FILE_PATHS_QUERY \
+    "SELECT coalesce(dn.path, '') || d.name, d.type, d.pkgKey " \
+    "FROM files_data d LEFT JOIN dirnames dn ON dn.id = d.dirname"
+
+typedef enum {
+    FILE_PATHS_SCAN,
+    FILE_PATHS_BY_NAME,
+    FILE_PATHS_BY_PKGKEY,
+    FILE_PATHS_BY_BASENAME,     /* Name without a directory */
+    FILE_PATHS_QUERIES
+} FilePathsQuery;
+
+static const char *file_paths_queries[FILE_PATHS_QUERIES] = {
+    FILE_PATHS_QUERY,
+    FILE_PATHS_QUERY
+    " WHERE d.dirname = (SELECT id FROM dirnames WHERE path = ?1)"
+    " AND d.name = ?2",
+    FILE_PATHS_QUERY " WHERE d.pkgKey = ?1",
+    FILE_PATHS_QUERY " WHERE d.dirname IS NULL AND d.name = ?2"
+};
+
+/* Lookups come one after the other, the statements are kept around */
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    sqlite3_stmt *cached[FILE_PATHS_QUERIES];
+} FilePathsTable;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    FilePathsTable *table;
+    FilePathsQuery query;
+    sqlite3_stmt *handle;
+    sqlite3_int64 rowid;
+    gboolean eof;
+} FilePathsCursor;
+
+static int
+file_paths_connect (sqlite3 *db, void *aux, int argc, const char *const *argv,
+                    sqlite3_vtab **vtab, char **errmsg)
+{
+    FilePathsTable *table;
+    int rc;
+
+    rc = sqlite3_declare_vtab (db, "CREATE TABLE x (name TEXT, type TEXT, "
+                               "pkgKey INTEGER)");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    table = g_new0 (FilePathsTable, 1);
+    table->db = db;
+    *vtab = &table->base;
+
+    return SQLITE_OK;
+}
+
+static int
+file_paths_disconnect (sqlite3_vtab *vtab)
+{
+    FilePathsTable *table = (FilePathsTable *) vtab;
+    int i;
+
+    for (i = 0; i < FILE_PATHS_QUERIES; i++)
+        sqlite3_finalize (table->cached[i]);
+    g_free (table);
+
+    return SQLITE_OK;
+}
+
+static int
+file_paths_best_index (sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+    int name = -1, pkgKey = -1;
+    int i;
+
+    for (i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+
+        if (!c->usable || c->op != SQLITE_INDEX_CONSTRAINT_EQ)
+            continue;
+
+        if (c->iColumn == FILE_PATHS_NAME)
+            name = i;
+        else if (c->iColumn == FILE_PATHS_PKGKEY)
+            pkgKey = i;
+    }
+
+    /* A path is more selective than a package */
+    if (name >= 0) {
+        info->idxNum = FILE_PATHS_BY_NAME;
+        info->aConstraintUsage[name].argvIndex = 1;
+        info->aConstraintUsage[name].omit = 1;
+        info->estimatedCost = 10;
+    } else if (pkgKey >= 0) {
+        info->idxNum = FILE_PATHS_BY_PKGKEY;
+        info->aConstraintUsage[pkgKey].argvIndex = 1;
+        info->aConstraintUsage[pkgKey].omit = 1;
+        info->estimatedCost = 100;
+    } else {
+        info->idxNum = FILE_PATHS_SCAN;
+        info->estimatedCost = 1000000;
+    }
+
+    return SQLITE_OK;
+}
+
+static int
+file_paths_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor)
+{
+    FilePathsCursor *cur;
+
+    cur = g_new0 (FilePathsCursor, 1);
+    cur->table = (FilePathsTable *) vtab;
+    *cursor = &cur->base;
+
+    return SQLITE_OK;
+}
+
+/* Hands the statement back to the table, unless it already has one */
+static void
+file_paths_release (FilePathsCursor *cur)
+{
+    sqlite3_stmt **cached = &cur->table->cached[cur->query];
+
+    if (!cur->handle)
+        return;
+
+    if (*cached) {
+        sqlite3_finalize (cur->handle);
+    } else {
+        sqlite3_reset (cur->handle);
+        sqlite3_clear_bindings (cur->handle);
+        *cached = cur->handle;
+    }
+
+    cur->handle = NULL;
+}
+
+static int
+file_paths_close (sqlite3_vtab_cursor *cursor)
+{
+    FilePathsCursor *cur = (FilePathsCursor *) cursor;
+
+    file_paths_release (cur);
+    g_free (cur);
+
+    return SQLITE_OK;
+}
+
+static int
+file_paths_next (sqlite3_vtab_cursor *cursor)
+{
+    FilePathsCursor *cur = (FilePathsCursor *) cursor;
+    int rc;
+
+    rc = sqlite3_step (cur->handle);
+    if (rc == SQLITE_ROW) {
+        cur->rowid++;
+        return SQLITE_OK;
+    }
+
+    cur->eof = TRUE;
+
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int
+file_paths_filter (sqlite3_vtab_cursor *cursor, int idxNum,
+                   const char *idxStr, int argc, sqlite3_value **argv)
+{
+    FilePathsCursor *cur = (FilePathsCursor *) cursor;
+    sqlite3_stmt **cached;
+    const char *path = NULL;
+    const char *suffix = NULL;
+    int len = 0;
+    int dir_len = -1;
+    int rc;
+
+    file_paths_release (cur);
+    cur->query = idxNum;
+    cur->rowid = 0;
+    cur->eof = FALSE;
+
+    if (idxNum == FILE_PATHS_BY_NAME) {
+        path = (const char *) sqlite3_value_text (argv[0]);
+        if (!path) {
+            cur->eof = TRUE;
+            return SQLITE_OK;
+        }
+
+        len = sqlite3_value_bytes (argv[0]);
+        path_split (path, len, &dir_len, &suffix);
+
+        if (dir_len < 0)
+            cur->query = FILE_PATHS_BY_BASENAME;
+    }
+
+    cached = &cur->table->cached[cur->query];
+    if (*cached) {
+        cur->handle = *cached;
+        *cached = NULL;
+    } else {
+        rc = sqlite3_prepare_v2 (cur->table->db,
+                                 file_paths_queries[cur->query], -1,
+                                 &cur->handle, NULL);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    if (path) {
+        if (dir_len >= 0)
+            sqlite3_bind_text (cur->handle, 1, path, dir_len,
+                               SQLITE_TRANSIENT);
+        sqlite3_bind_text (cur->handle, 2, suffix, len - (suffix - path),
+                           SQLITE_TRANSIENT);
+    } else if (cur->query == FILE_PATHS_BY_PKGKEY)
+        sqlite3_bind_value (cur->handle, 1, argv[0]);
+
+    return file_paths_next (cursor);
+}
+
+static int
+file_paths_eof (sqlite3_vtab_cursor *cursor)
+{
+    return ((FilePathsCursor *) cursor)->eof;
+}
+
+static int
+file_paths_column (sqlite3_vtab_cursor *cursor, sqlite3_context *ctx,
+                   int column)
+{
+    FilePathsCursor *cur = (FilePathsCursor *) cursor;
+
+    sqlite3_result_value (ctx, sqlite3_column_value (cur->handle, column));
+
+    return SQLITE_OK;
+}
+
+static int
+file_paths_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+    *rowid = ((FilePathsCursor *) cursor)->rowid;
+
+    return SQLITE_OK;
+}
+
+static sqlite3_module file_paths_module = {
+    0,                  /* iVersion */
+    NULL,               /* xCreate, eponymous only */
+    file_paths_connect,
+    file_paths_best_index,
+    file_paths_disconnect,
+    NULL,               /* xDestroy */
+    file_paths_open,
+    file_paths_close,
+    file_paths_filter,
+    file_paths_next,
+    file_paths_eof,
+    file_paths_column,
+    file_paths_rowid,
+};
+
+#ifdef HAVE_ZSTD
+
+/* Decompression state of a connection, dictionaries are loaded from
+   changelog_dicts the first time a frame asks for them */
+typedef struct {
+    ZSTD_DCtx *dctx;
+    GHashTable *ddicts;
+} ChangelogReader;
+
+static void
+changelog_reader_free (void *data)
+{
+    ChangelogReader *reader = data;
+
+    ZSTD_freeDCtx (reader->dctx);
+    g_hash_table_destroy (reader->ddicts);
+    g_free (reader);
+}
+
+static ZSTD_DDict *
+changelog_reader_ddict (ChangelogReader *reader, sqlite3 *db, guint id)
+{
+    ZSTD_DDict *ddict;
+    sqlite3_stmt *handle = NULL;
+    const char *query;
+
+    ddict = g_hash_table_lookup (reader->ddicts, GUINT_TO_POINTER (id));
+    if (ddict)
+        return ddict;
+
+    query = "SELECT dict FROM changelog_dicts WHERE id = ?";
+    if (sqlite3_prepare_v2 (db, query, -1, &handle, NULL) == SQLITE_OK) {
+        sqlite3_bind_int64 (handle, 1, id);
+        if (sqlite3_step (handle) == SQLITE_ROW)
+            ddict = ZSTD_createDDict (sqlite3_column_blob (handle, 0),
+                                      sqlite3_column_bytes (handle, 0));
+    }
+    sqlite3_finalize (handle);
+
+    if (ddict)
+        g_hash_table_insert (reader->ddicts, GUINT_TO_POINTER (id), ddict);
+
+    return ddict;
+}
+
+static void
+changelog_text (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    ChangelogReader *reader = sqlite3_user_data (ctx);
+    const void *frame;
+    int frame_len;
+    unsigned long long len;
+    ZSTD_DDict *ddict = NULL;
+    guint id;
+    char *text;
+    size_t size;
+
+    if (sqlite3_value_type (argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value (ctx, argv[0]);
+        return;
+    }
+
+    frame = sqlite3_value_blob (argv[0]);
+    frame_len = sqlite3_value_bytes (argv[0]);
+
+    len = ZSTD_getFrameContentSize (frame, frame_len);
+    if (len == ZSTD_CONTENTSIZE_ERROR || len == ZSTD_CONTENTSIZE_UNKNOWN ||
+        len > G_MAXINT) {
+        sqlite3_result_error (ctx, "Invalid compressed changelog", -1);
+        return;
+    }
+
+    id = ZSTD_getDictID_fromFrame (frame, frame_len);
+    if (id) {
+        ddict = changelog_reader_ddict (reader,
+                                        sqlite3_context_db_handle (ctx), id);
+        if (!ddict) {
+            sqlite3_result_error (ctx, "Missing changelog dictionary", -1);
+            return;
+        }
+    }
+
+    text = sqlite3_malloc (len + 1);
+    if (!text) {
+        sqlite3_result_error_nomem (ctx);
+        return;
+    }
+
+    if (ddict)
+        size = ZSTD_decompress_usingDDict (reader->dctx, text, len,
+                                           frame, frame_len, ddict);
+    else
+        size = ZSTD_decompressDCtx (reader->dctx, text, len, frame, frame_len);
+
+    if (ZSTD_isError (size)) {
+        sqlite3_free (text);
+        sqlite3_result_error (ctx, ZSTD_getErrorName (size), -1);
+        return;
+    }
+
+    sqlite3_result_text (ctx, text, size, sqlite3_free);
+}
+
+static int
+changelog_reader_register (sqlite3 *db)
+{
+    ChangelogReader *reader;
+
+    reader = g_new0 (ChangelogReader, 1);
+    reader->dctx = ZSTD_createDCtx ();
+    reader->ddicts = g_hash_table_new_full (NULL, NULL, NULL,
+                                            (GDestroyNotify) ZSTD_freeDDict);
+
+    return sqlite3_create_function_v2 (db, "changelog_text", 1, SQLITE_UTF8,
+                                       reader, changelog_text, NULL, NULL,
+                                       changelog_reader_free);
+}
+
+#endif
+
+/* Registers what readers need for the packed, dirnames and compressed
+   layouts on a connection, and the version comparison */
+int
+yum_db_register_functions (sqlite3 *db)
+{
+    int rc;
+
+    rc = sqlite3_create_module (db, "deps", &deps_module, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function (db, "pack_keys", 1, SQLITE_UTF8, NULL,
+                                      NULL, pack_keys_step, pack_keys_final);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_module (db, "file_paths", &file_paths_module,
+                                    NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function (db, "path_dirname", 1,
+                                      SQLITE_UTF8, NULL,
+                                      path_dirname, NULL, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function (db, "path_suffix", 1,
+                                      SQLITE_UTF8, NULL,
+                                      path_suffix, NULL, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function (db, "rpmvercmp", 2,
+                                      SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                      NULL, sql_rpmvercmp, NULL, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_collation (db, "rpmvercmp", SQLITE_UTF8, NULL,
+                                       collate_rpmvercmp);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function (db, "evr_key", 3,
+                                      SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                      NULL, sql_evr_key, NULL, NULL);
+#ifdef HAVE_ZSTD
+    if (rc == SQLITE_OK)
+        rc = changelog_reader_register (db);
+#endif
+
+    return rc;
+}
+
+static void
+index_packed_deps (sqlite3 *db, GError **err)
+{
+    int rc;
+    const char *sql;
+
+    /* Rebuilt as a whole, it is small next to the dependencies */
+    sql =
+        "DELETE FROM dep_names;"
+        "INSERT INTO dep_names (name, kind, pkgKeys)"
+        "  SELECT name, kind, pack_keys(pkgKey) FROM deps"
+        "  WHERE name IS NOT NULL GROUP BY name, kind;"
+        "CREATE INDEX IF NOT EXISTS depnames ON dep_names (name, kind)";
+
+    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not create dep_names index: %s",
+                     sqlite3_errmsg (db));
+    }
+}
+
+typedef enum {
+    DB_STATUS_OK,
+    DB_STATUS_VERSION_MISMATCH,
+    DB_STATUS_REVISION_MISMATCH,
+    DB_STATUS_LAYOUT_MISMATCH,
+    DB_STATUS_CHECKSUM_MISMATCH,
+    DB_STATUS_PRIMARY_MISMATCH,
+    DB_STATUS_ERROR
+} DBStatus;
+
+/* Columns are looked up by name, older caches lack the later ones */
+static DBStatus
+dbinfo_status (sqlite3 *db, const char *checksum, guint layout,
+               const char *primary_checksum, int *revision)
+{
+    const char *query;
+    int rc;
+    sqlite3_stmt *handle = NULL;
+    DBStatus status = DB_STATUS_ERROR;
+
+    query = "SELECT * FROM db_info";
+    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    if (rc != SQLITE_OK)
+        goto cleanup;
+
+    while ((rc = sqlite3_step (handle)) == SQLITE_ROW) {
+        int dbversion = 0;
+        const char *dbchecksum = NULL;
+        guint dblayout = 0;
+        const char *dbprimary = NULL;
+        int i;
+
+        *revision = 0;
+
+        for (i = 0; i < sqlite3_column_count (handle); i++) {
+            const char *name = sqlite3_column_name (handle, i);
+
+            if (!strcmp (name, "dbversion"))
+                dbversion = sqlite3_column_int (handle, i);
+            else if (!strcmp (name, "checksum"))
+                dbchecksum = (const char *) sqlite3_column_text (handle, i);
+            else if (!strcmp (name, "layout"))
+                dblayout = sqlite3_column_int (handle, i);
+            else if (!strcmp (name, "primary_checksum"))
+                dbprimary = (const char *) sqlite3_column_text (handle, i);
+            else if (!strcmp (name, "revision"))
+                *revision = sqlite3_column_int (handle, i);
+        }
+
+        if (dbversion != YUM_SQLITE_CACHE_DBVERSION) {
+            g_message ("Warning: cache file is version %d, we need %d, will regenerate",
+                       dbversion, YUM_SQLITE_CACHE_DBVERSION);
+            status = DB_STATUS_VERSION_MISMATCH;
+        } else if (*revision > YUM_SQLITE_CACHE_REVISION) {
+            g_message ("Warning: cache file is revision %d, we know %d, will regenerate",
+                       *revision, YUM_SQLITE_CACHE_REVISION);
+            status = DB_STATUS_REVISION_MISMATCH;
+        } else if (dblayout != layout) {
+            g_message ("Warning: cache file has layout %u, we need %u, will regenerate",
+                       dblayout, layout);
+            status = DB_STATUS_LAYOUT_MISMATCH;
+        } else if (g_strcmp0 (primary_checksum, dbprimary)) {
+            /* The pkgKeys came from another primary, none can be kept */
+            g_message ("Warning: cache file keys follow another primary, will regenerate");
+            status = DB_STATUS_PRIMARY_MISMATCH;
+        } else if (!dbchecksum || strcmp (checksum, dbchecksum)) {
+            g_message ("sqlite cache needs updating, reading in metadata");
+            status = DB_STATUS_CHECKSUM_MISMATCH;
+        } else
+            status = DB_STATUS_OK;
+
+        break;
+    }
+
+ cleanup:
+    if (handle)
+        sqlite3_finalize (handle);
+
+    return status;
+}
+
+/* Upgrades from one revision to the next. Only additive changes belong
+   here: new indexes, derived columns or views that can be made from the
+   data already in the cache. Anything else bumps the DBVERSION. */
+typedef void (*MigrateFn) (sqlite3 *db, guint layout,
+                           IndexTablesFn index_tables, GError **err);
+
+typedef struct {
+    int revision;       /* Revision the step upgrades to */
+    const char *sql;    /* Run first, may be NULL */
+    MigrateFn migrate;  /* Run next, may be NULL */
+    gboolean reindex;   /* Run the index function of the database */
+} DbMigration;
+
+/* Adds packages.evr to a primary database which lacks it, filled from
+   the epoch, version and release. In encoded layouts packages is a
+   view, it is made again with its triggers. */
+static void
+add_evr_column (sqlite3 *db, guint layout, IndexTablesFn index_tables,
+                GError **err)
+{
+    const TableSpec *packages = table_find (primary_tables, "packages");
+    const char *storage = table_storage (packages, layout);
+    sqlite3_stmt *handle = NULL;
+    GPtrArray *triggers;
+    GString *sql;
+    char *view;
+    guint i;
+    int rc;
+
+    if (index_tables != yum_db_index_primary_tables)
+        return;
+
+    sql = g_string_new (NULL);
+    g_string_printf (sql, "SELECT evr FROM %s", storage);
+    rc = sqlite3_prepare (db, sql->str, -1, &handle, NULL);
+    sqlite3_finalize (handle);
+    if (rc == SQLITE_OK) {
+        g_string_free (sql, TRUE);
+        return;
+    }
+
+    triggers = g_ptr_array_new_with_free_func (g_free);
+    if (table_is_encoded (packages, layout)) {
+        sqlite3_prepare (db, "SELECT sql FROM sqlite_master WHERE "
+                         "type = 'trigger' AND tbl_name = 'packages'",
+                         -1, &handle, NULL);
+        while (sqlite3_step (handle) == SQLITE_ROW)
+            g_ptr_array_add (triggers,
+                             g_strdup ((const char *)
+                                       sqlite3_column_text (handle, 0)));
+        sqlite3_finalize (handle);
+    }
+
+    g_string_printf (sql, "ALTER TABLE %s ADD COLUMN evr BLOB;"
+                     "UPDATE %s SET evr = evr_key(epoch, version, release)",
+                     storage, storage);
+    rc = sqlite3_exec (db, sql->str, NULL, NULL, NULL);
+
+    if (rc == SQLITE_OK && table_is_encoded (packages, layout)) {
+        view = table_view_sql (packages, layout);
+        g_string_printf (sql, "DROP VIEW packages;%s", view);
+        g_free (view);
+        rc = sqlite3_exec (db, sql->str, NULL, NULL, NULL);
+    }
+
+    for (i = 0; rc == SQLITE_OK && i < triggers->len; i++)
+        rc = sqlite3_exec (db, g_ptr_array_index (triggers, i),
+                           NULL, NULL, NULL);
+
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not add evr column: %s", sqlite3_errmsg (db));
+
+    g_ptr_array_free (triggers, TRUE);
+    g_string_free (sql, TRUE);
+}
+
+static const DbMigration db_migrations[] = {
+    /* db_info learned the layout and where pkgKeys come from */
+    { 1,
+      "ALTER TABLE db_info ADD COLUMN layout INTEGER;"
+      "ALTER TABLE db_info ADD COLUMN primary_checksum TEXT;"
+      "ALTER TABLE db_info ADD COLUMN revision INTEGER",
+      NULL, TRUE },
+    /* packages.evr sorts like rpm, indexed with name and arch */
+    { 2, NULL, add_evr_column, TRUE },
+    { 0, NULL, NULL, FALSE }
+};
+
+static void
+migrate (sqlite3 *db, int revision, guint layout,
+         IndexTablesFn index_tables, GError **err)
+{
+    const DbMigration *m;
+    gboolean reindex = FALSE;
+    char *sql;
+    int rc;
+
+    g_message ("Upgrading cache file from revision %d to %d",
+               revision, YUM_SQLITE_CACHE_REVISION);
+
+    sqlite3_exec (db, "BEGIN", NULL, NULL, NULL);
+
+    for (m = db_migrations; m->revision; m++) {
+        if (m->revision <= revision)
+            continue;
+
+        if (m->sql && sqlite3_exec (db, m->sql, NULL, NULL, NULL) != SQLITE_OK) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not upgrade to revision %d: %s",
+                         m->revision, sqlite3_errmsg (db));
+            goto cleanup;
+        }
+
+        if (m->migrate) {
+            m->migrate (db, layout, index_tables, err);
+            if (*err)
+                goto cleanup;
+        }
+
+        reindex |= m->reindex;
+    }
+
+    if (reindex && index_tables) {
+        index_tables (db, layout, err);
+        if (*err)
+            goto cleanup;
+    }
+
+    sql = g_strdup_printf ("UPDATE db_info SET revision = %d",
+                           YUM_SQLITE_CACHE_REVISION);
+    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    g_free (sql);
+
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not update dbinfo table: %s",
+                     sqlite3_errmsg (db));
+
+ cleanup:
+    sqlite3_exec (db, *err ? "ROLLBACK" : "COMMIT", NULL, NULL, NULL);
+}
+
+/* Packages committed by an interrupted build of the same input, 0 if
+   there was none */
+static guint32
+checkpoint_status (sqlite3 *db, const char *checksum, guint layout,
+                   const char *primary_checksum)
+{
+    const char *query;
+    sqlite3_stmt *handle = NULL;
+    guint32 packages = 0;
+
+    query = "SELECT checksum, layout, primary_checksum, packages "
+        "FROM db_checkpoint";
+    if (sqlite3_prepare (db, query, -1, &handle, NULL) != SQLITE_OK)
+        goto cleanup;
+
+    if (sqlite3_step (handle) == SQLITE_ROW &&
+        !g_strcmp0 (checksum,
+                    (const char *) sqlite3_column_text (handle, 0)) &&
+        (guint) sqlite3_column_int (handle, 1) == layout &&
+        !g_strcmp0 (primary_checksum,
+                    (const char *) sqlite3_column_text (handle, 2)))
+        packages = sqlite3_column_int (handle, 3);
+
+ cleanup:
+    if (handle)
+        sqlite3_finalize (handle);
+
+    return packages;
+}
+
+static void
+yum_db_create_dbinfo_table (sqlite3 *db, GError **err)
+{
+    int rc;
+    const char *sql;
+
+    sql = "CREATE TABLE db_info (dbversion INTEGER, checksum TEXT, "
+        "layout INTEGER, primary_checksum TEXT, revision INTEGER)";
+    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not create db_info table: %s",
+                     sqlite3_errmsg (db));
+    }
+}
+
+char *
+yum_db_partial_filename (const char *path)
+{
+    return g_strconcat (path, ".partial", NULL);
+}
+
+/* Copies a cache with the backup API, dest is replaced */
+void
+yum_db_copy (const char *src, const char *dest, GError **err)
+{
+    sqlite3 *from = NULL;
+    sqlite3 *to = NULL;
+    sqlite3_backup *backup;
+    int rc;
+
+    unlink (dest);
+
+    rc = sqlite3_open_v2 (src, &from, SQLITE_OPEN_READONLY, NULL);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not open %s: %s", src, sqlite3_errmsg (from));
+        goto cleanup;
+    }
+
+    rc = sqlite3_open (dest, &to);
+    if (rc == SQLITE_OK) {
+        backup = sqlite3_backup_init (to, "main", from, "main");
+        if (backup) {
+            sqlite3_backup_step (backup, -1);
+            rc = sqlite3_backup_finish (backup);
+        } else
+            rc = sqlite3_errcode (to);
+    }
+
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not copy %s: %s", src, sqlite3_errmsg (to));
+        unlink (dest);
+    }
+
+ cleanup:
+    sqlite3_close (from);
+    sqlite3_close (to);
+}
+
+/* Brings a cache that is kept up to date in its partial copy, NULL if
+   it has to be regenerated after all */
+static sqlite3 *
+open_kept (const char *path, const char *partial, int revision, guint layout,
+           IndexTablesFn index_tables)
+{
+    sqlite3 *db = NULL;
+    GError *err = NULL;
+
+    yum_db_copy (path, partial, &err);
+    if (!err && sqlite3_open (partial, &db) != SQLITE_OK)
+        g_set_error (&err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not open SQL database: %s", sqlite3_errmsg (db));
+
+    if (!err && revision < YUM_SQLITE_CACHE_REVISION)
+        migrate (db, revision, layout, index_tables, &err);
+
+    if (err) {
+        g_message ("Warning: %s, will regenerate", err->message);
+        g_error_free (err);
+        sqlite3_close (db);
+        db = NULL;
+    }
+
+    return db;
+}
+
+/* Caches are never changed in place, readers may have them open
+   immutable. They are built, upgraded or updated in a partial copy
+   (yum_db_partial_filename()) which replaces them by rename: a build
+   gets the partial database and the caller renames it when it is
+   complete, an upgraded cache that is otherwise current is renamed here
+   and NULL returned as for an up to date one. */
+sqlite3 *
+yum_db_open (const char *path,
+             const char *checksum,
+             guint layout,
+             const char *primary_checksum,
+             CreateTablesFn create_tables,
+             IndexTablesFn index_tables,
+             GError **err)
+{
+    int rc;
+    sqlite3 *db = NULL;
+    char *partial;
+    int revision = 0;
+    DBStatus status = DB_STATUS_ERROR;
+
+    partial = yum_db_partial_filename (path);
+
+    if (g_file_test (path, G_FILE_TEST_EXISTS)) {
+        if (sqlite3_open_v2 (path, &db, SQLITE_OPEN_READONLY,
+                             NULL) == SQLITE_OK)
+            status = dbinfo_status (db, checksum, layout, primary_checksum,
+                                    &revision);
+        sqlite3_close (db);
+        db = NULL;
+
+        /* Everything is up-to-date */
+        if (status == DB_STATUS_OK && revision == YUM_SQLITE_CACHE_REVISION)
+            goto cleanup;
+
+        if (status == DB_STATUS_OK ||
+            (status == DB_STATUS_CHECKSUM_MISMATCH && YMP_CONFIG_UPDATE_DB)) {
+            db = open_kept (path, partial, revision, layout, index_tables);
+
+            if (db && status == DB_STATUS_OK) {
+                sqlite3_close (db);
+                db = NULL;
+
+                if (rename (partial, path) != 0)
+                    g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                                 "Can not rename %s: %s", partial,
+                                 g_strerror (errno));
+                goto cleanup;
+            }
+
+            if (db) {
+                sqlite3_exec (db, "PRAGMA synchronous = 0", NULL,NULL,NULL);
+                sqlite3_exec (db, "DELETE FROM db_info", NULL, NULL, NULL);
+                goto cleanup;
+            }
+        }
+    }
+
+    /* Picks up an interrupted build after its last checkpoint */
+    if (g_file_test (partial, G_FILE_TEST_EXISTS)) {
+        if (sqlite3_open (partial, &db) == SQLITE_OK) {
+            guint32 packages = checkpoint_status (db, checksum, layout,
+                                                  primary_checksum);
+
+            if (packages > 0) {
+                g_message ("Resuming cache build after %u packages",
+                           packages);
+                sqlite3_exec (db, "PRAGMA synchronous = 0", NULL,NULL,NULL);
+                goto cleanup;
+            }
+        }
+
+        sqlite3_close (db);
+        db = NULL;
+        unlink (partial);
+    }
+
+    rc = sqlite3_open (partial, &db);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not open SQL database: %s",
+                     sqlite3_errmsg (db));
+        goto cleanup;
+    }
+
+    yum_db_create_dbinfo_table (db, err);
+    if (*err)
+        goto cleanup;
+
+    create_tables (db, layout, err);
+    if (*err)
+        goto cleanup;
+
+    sqlite3_exec (db, "PRAGMA synchronous = 0", NULL, NULL, NULL);
+
+ cleanup:
+    if (*err && db) {
+        sqlite3_close (db);
+        db = NULL;
+    }
+    g_free (partial);
+
+    return db;
+}
+
+void
+yum_db_dbinfo_update (sqlite3 *db,
+                      const char *checksum,
+                      guint layout,
+                      const char *primary_checksum,
+                      GError **err)
+{
+    int rc;
+    char *sql;
+
+    sql = sqlite3_mprintf
+        ("INSERT INTO db_info (dbversion, checksum, layout, primary_checksum, "
+         "revision) VALUES (%d, %Q, %u, %Q, %d)",
+         YUM_SQLITE_CACHE_DBVERSION, checksum, layout, primary_checksum,
+         YUM_SQLITE_CACHE_REVISION);
+
+    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not update dbinfo table: %s",
+                     sqlite3_errmsg (db));
+
+    sqlite3_free (sql);
+
+    /* A finished build needs no checkpoint */
+    if (rc == SQLITE_OK)
+        sqlite3_exec (db, "DROP TABLE IF EXISTS db_checkpoint",
+                      NULL, NULL, NULL);
+}
+
+/* The table holding the package rows of a cache. The layout alone does
+   not tell: a packages view in primary is a plain table in filelists
+   and other. */
+static const char *
+packages_storage (sqlite3 *db, const char *schema)
+{
+    sqlite3_stmt *handle = NULL;
+    const char *storage = "packages";
+    char *sql;
+
+    sql = g_strdup_printf ("SELECT 1 FROM %s.sqlite_master WHERE "
+                           "type = 'table' AND name = 'packages_data'",
+                           schema);
+    if (sqlite3_prepare (db, sql, -1, &handle, NULL) == SQLITE_OK &&
+        sqlite3_step (handle) == SQLITE_ROW)
+        storage = "packages_data";
+    sqlite3_finalize (handle);
+    g_free (sql);
+
+    return storage;
+}
+
+/* The checkpoint of a build being resumed is kept until the next one
+   replaces it */
+void
+yum_db_checkpoint_create (sqlite3 *db, GError **err)
+{
+    int rc;
+
+    rc = sqlite3_exec (db, "CREATE TABLE IF NOT EXISTS db_checkpoint "
+                       "(checksum TEXT, layout INTEGER, "
+                       "primary_checksum TEXT, packages INTEGER)",
+                       NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not create checkpoint table: %s",
+                     sqlite3_errmsg (db));
+}
+
+/* Records how far a build got. It is written in the transaction holding
+   the packages, a later build of the same input resumes from there. The
+   packages count is that of the cache, earlier runs of a resumed build
+   included. */
+void
+yum_db_checkpoint (sqlite3 *db,
+                   const char *checksum,
+                   guint layout,
+                   const char *primary_checksum,
+                   GError **err)
+{
+    int rc;
+    char *sql;
+
+    sql = sqlite3_mprintf
+        ("DELETE FROM db_checkpoint;"
+         "INSERT INTO db_checkpoint SELECT %Q, %u, %Q, count(*) FROM %s",
+         checksum, layout, primary_checksum, packages_storage (db, "main"));
+
+    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not write checkpoint: %s",
+                     sqlite3_errmsg (db));
+
+    sqlite3_free (sql);
+}
+
+/* Deterministic builds: the finished cache is copied into a fresh file
+   with a fixed page size and no free pages, so its bytes depend on the
+   rows alone and not on the transactions or dropped tables behind them.
+   The schema cookie is carried over by VACUUM INTO and counts schema
+   changes, it is reset on the copy no connection has seen yet; writing
+   it needs defensive mode off, a cookie that did not take fails the
+   build rather than giving a different file. sqlite
+   before 3.27 lacks VACUUM INTO and vacuums in place instead. */
+void
+yum_db_rewrite (const char *path, GError **err)
+{
+    sqlite3 *db = NULL;
+    char *tmp_path;
+    char *sql;
+    int rc;
+
+    tmp_path = g_strconcat (path, ".rewrite", NULL);
+    unlink (tmp_path);
+
+    rc = sqlite3_open (path, &db);
+    if (rc == SQLITE_OK) {
+#if SQLITE_VERSION_NUMBER >= 3027000
+        sql = sqlite3_mprintf ("PRAGMA page_size = %d; VACUUM INTO %Q",
+                               YUM_DB_PAGE_SIZE, tmp_path);
+#else
+        sql = sqlite3_mprintf ("PRAGMA page_size = %d; VACUUM",
+                               YUM_DB_PAGE_SIZE);
+#endif
+        rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+        sqlite3_free (sql);
+    }
+
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not rewrite database: %s", sqlite3_errmsg (db));
+    sqlite3_close (db);
+
+#if SQLITE_VERSION_NUMBER >= 3027000
+    if (!*err) {
+        sqlite3_stmt *handle = NULL;
+
+        rc = sqlite3_open (tmp_path, &db);
+        /* Defensive mode ignores schema_version writes without failing,
+           so it is turned off and the cookie read back */
+        if (rc == SQLITE_OK)
+            rc = sqlite3_db_config (db, SQLITE_DBCONFIG_DEFENSIVE, 0, NULL);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_exec (db, "PRAGMA schema_version = 1",
+                               NULL, NULL, NULL);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_prepare (db, "PRAGMA schema_version", -1,
+                                  &handle, NULL);
+        if (rc == SQLITE_OK &&
+            (sqlite3_step (handle) != SQLITE_ROW ||
+             sqlite3_column_int (handle, 0) != 1))
+            rc = SQLITE_MISUSE;
+        sqlite3_finalize (handle);
+
+        if (rc == SQLITE_MISUSE)
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not reset the schema cookie of %s", tmp_path);
+        else if (rc != SQLITE_OK)
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not rewrite database: %s", sqlite3_errmsg (db));
+        sqlite3_close (db);
+    }
+
+    if (!*err && rename (tmp_path, path) != 0)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not rename %s: %s", tmp_path, g_strerror (errno));
+    if (*err)
+        unlink (tmp_path);
+#endif
+
+    g_free (tmp_path);
+}
+
+/* The checksum a cache was built from, NULL if it has none */
+char *
+yum_db_dbinfo_checksum (sqlite3 *db, GError **err)
+{
+    const char *query;
+    int rc;
+    char *checksum = NULL;
+    sqlite3_stmt *handle = NULL;
+
+    query = "SELECT checksum FROM db_info";
+    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not read db_info: %s",
+                     sqlite3_errmsg (db));
+        return NULL;
+    }
+
+    if (sqlite3_step (handle) == SQLITE_ROW)
+        checksum = g_strdup ((const char *) sqlite3_column_text (handle, 0));
+
+    sqlite3_finalize (handle);
+
+    return checksum;
+}
+
+/* Upstream databases: repositories publish primary_db and friends built
+   by createrepo, which are the plain layout of the same dbversion. */
+
+gboolean
+yum_db_current (const char *path, const char *checksum, guint layout,
+                const char *primary_checksum)
+{
+    sqlite3 *db = NULL;
+    int revision = 0;
+    gboolean current = FALSE;
+
+    if (!g_file_test (path, G_FILE_TEST_EXISTS))
+        return FALSE;
+
+    if (sqlite3_open_v2 (path, &db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK)
+        current = dbinfo_status (db, checksum, layout, primary_checksum,
+                                 &revision) == DB_STATUS_OK &&
+            revision == YUM_SQLITE_CACHE_REVISION;
+
+    sqlite3_close (db);
+
+    return current;
+}
+
+static gint64
+import_query_int64 (sqlite3 *db, const char *sql, gint64 def)
+{
+    sqlite3_stmt *handle = NULL;
+    gint64 value = def;
+
+    if (sqlite3_prepare (db, sql, -1, &handle, NULL) == SQLITE_OK &&
+        sqlite3_step (handle) == SQLITE_ROW)
+        value = sqlite3_column_int64 (handle, 0);
+
+    sqlite3_finalize (handle);
+
+    return value;
+}
+
+static int
+import_query_int (sqlite3 *db, const char *sql, int def)
+{
+    return (int) import_query_int64 (db, sql, def);
+}
+
+static GHashTable *
+import_table_columns (sqlite3 *db, const char *table)
+{
+    GHashTable *columns;
+    sqlite3_stmt *handle = NULL;
+    char *sql;
+
+    columns = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    sql = g_strdup_printf ("PRAGMA table_info (%s)", table);
+    if (sqlite3_prepare (db, sql, -1, &handle, NULL) == SQLITE_OK) {
+        while (sqlite3_step (handle) == SQLITE_ROW)
+            g_hash_table_insert (columns,
+                                 g_strdup ((const char *)
+                                           sqlite3_column_text (handle, 1)),
+                                 GINT_TO_POINTER (1));
+    }
+
+    sqlite3_finalize (handle);
+    g_free (sql);
+
+    return columns;
+}
+
+/* Every table and column we create must be there, extra ones are fine.
+   Missing triggers are added. */
+static void
+import_check_schema (sqlite3 *db, sqlite3 *reference, GError **err)
+{
+    const char *query;
+    sqlite3_stmt *handle = NULL;
+
+    query = "SELECT type, name, sql FROM sqlite_master "
+        "WHERE type IN ('table', 'trigger')";
+    if (sqlite3_prepare (reference, query, -1, &handle, NULL) != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not read reference schema: %s",
+                     sqlite3_errmsg (reference));
+        return;
+    }
+
+    while (!*err && sqlite3_step (handle) == SQLITE_ROW) {
+        const char *type = (const char *) sqlite3_column_text (handle, 0);
+        const char *name = (const char *) sqlite3_column_text (handle, 1);
+        const char *sql = (const char *) sqlite3_column_text (handle, 2);
+        GHashTable *want, *have;
+        GHashTableIter iter;
+        gpointer column;
+
+        if (!strcmp (type, "trigger")) {
+            char *exists;
+
+            exists = g_strdup_printf ("SELECT 1 FROM sqlite_master "
+                                      "WHERE type = 'trigger' AND name = '%s'",
+                                      name);
+            if (!import_query_int (db, exists, 0) &&
+                sqlite3_exec (db, sql, NULL, NULL, NULL) != SQLITE_OK)
+                g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                             "Can not create %s trigger: %s",
+                             name, sqlite3_errmsg (db));
+            g_free (exists);
+            continue;
+        }
+
+        want = import_table_columns (reference, name);
+        have = import_table_columns (db, name);
+
+        g_hash_table_iter_init (&iter, want);
+        while (g_hash_table_iter_next (&iter, &column, NULL)) {
+            if (!g_hash_table_lookup (have, column)) {
+                g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                             "Upstream database lacks %s.%s",
+                             name, (const char *) column);
+                break;
+            }
+        }
+
+        g_hash_table_destroy (want);
+        g_hash_table_destroy (have);
+    }
+
+    sqlite3_finalize (handle);
+}
+
+/* Rows must belong to a package, packages must have distinct ids */
+static void
+import_check_rows (sqlite3 *db, sqlite3 *reference, GError **err)
+{
+    const char *query;
+    sqlite3_stmt *handle = NULL;
+
+    if (import_query_int (db, "SELECT 1 FROM packages WHERE pkgId IS NULL "
+                          "OR pkgId IN (SELECT pkgId FROM packages "
+                          "GROUP BY pkgId HAVING count(*) > 1) LIMIT 1", 0)) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Upstream database has missing or duplicate pkgIds");
+        return;
+    }
+
+    query = "SELECT name FROM sqlite_master "
+        "WHERE type = 'table' AND name != 'packages'";
+    sqlite3_prepare (reference, query, -1, &handle, NULL);
+
+    while (!*err && sqlite3_step (handle) == SQLITE_ROW) {
+        const char *name = (const char *) sqlite3_column_text (handle, 0);
+        char *sql;
+
+        sql = g_strdup_printf ("SELECT 1 FROM %s WHERE pkgKey IS NULL "
+                               "OR pkgKey NOT IN (SELECT pkgKey FROM packages) "
+                               "LIMIT 1", name);
+        if (import_query_int (db, sql, 0))
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Upstream database has %s rows of unknown packages",
+                         name);
+        g_free (sql);
+    }
+
+    sqlite3_finalize (handle);
+}
+
+/* Checks an upstream database at path against the tables create_tables
+   makes, adds what yum needs and stamps db_info with checksum */
+void
+yum_db_import (const char *path,
+               const char *checksum,
+               CreateTablesFn create_tables,
+               IndexTablesFn index_tables,
+               GError **err)
+{
+    sqlite3 *db = NULL;
+    sqlite3 *reference = NULL;
+    int dbversion;
+
+    if (sqlite3_open_v2 (path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not open SQL database: %s", sqlite3_errmsg (db));
+        goto cleanup;
+    }
+
+    dbversion = import_query_int (db, "SELECT dbversion FROM db_info", -1);
+    if (dbversion != YUM_SQLITE_CACHE_DBVERSION) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Upstream database is version %d, we need %d",
+                     dbversion, YUM_SQLITE_CACHE_DBVERSION);
+        goto cleanup;
+    }
+
+    sqlite3_open (":memory:", &reference);
+    create_tables (reference, 0, err);
+    if (*err)
+        goto cleanup;
+
+    sqlite3_exec (db, "PRAGMA synchronous = 0", NULL, NULL, NULL);
+    sqlite3_exec (db, "BEGIN", NULL, NULL, NULL);
+
+    /* Derived from the other columns, upstream has no such thing */
+    add_evr_column (db, 0, index_tables, err);
+    if (*err)
+        goto cleanup;
+
+    import_check_schema (db, reference, err);
+    if (*err)
+        goto cleanup;
+
+    /* The pkgId index makes the duplicate check cheap */
+    index_tables (db, 0, err);
+    if (*err)
+        goto cleanup;
+
+    import_check_rows (db, reference, err);
+    if (*err)
+        goto cleanup;
+
+    sqlite3_exec (db, "DROP TABLE db_info", NULL, NULL, NULL);
+    yum_db_create_dbinfo_table (db, err);
+    if (*err)
+        goto cleanup;
+
+    yum_db_dbinfo_update (db, checksum, 0, NULL, err);
+
+ cleanup:
+    if (db) {
+        sqlite3_exec (db, *err ? "ROLLBACK" : "COMMIT", NULL, NULL, NULL);
+        sqlite3_close (db);
+    }
+    if (reference)
+        sqlite3_close (reference);
+}
+
+/* Deltas carry the rows of the packages added between two generations of
+   a cache and the pkgIds of those removed, in a small sqlite database of
+   their own. pkgKeys are renumbered by every build, so rows are matched
+   by pkgId and added packages get a free pkgKey where the delta is
+   applied. Layouts with shared tables (strings, dirnames, sets, packed
+   deps, compression dictionaries) are not covered. */
+
+#define DELTA_LAYOUTS (YUM_DB_LAYOUT_TYPED | YUM_DB_LAYOUT_SPLIT | \
+                       YUM_DB_LAYOUT_STABLE_KEYS)
+
+#define DELTA_PAGE_SIZE 512
+
+typedef struct {
+    int dbversion;
+    int revision;
+    guint layout;
+    char *checksum;
+    char *primary_checksum;
+
+    /* delta_info only */
+    char *from_checksum;
+    gint64 packages;
+    char *digest;
+} DeltaStamp;
+
+static void
+delta_stamp_clear (DeltaStamp *stamp)
+{
+    g_free (stamp->checksum);
+    g_free (stamp->primary_checksum);
+    g_free (stamp->from_checksum);
+    g_free (stamp->digest);
+    memset (stamp, 0, sizeof (DeltaStamp));
+}
+
+/* Reads db_info or delta_info, FALSE if it has no row */
+static gboolean
+delta_read_stamp (sqlite3 *db, const char *table, DeltaStamp *stamp)
+{
+    sqlite3_stmt *handle = NULL;
+    gboolean found = FALSE;
+    char *sql;
+    int i;
+
+    memset (stamp, 0, sizeof (DeltaStamp));
+
+    sql = g_strdup_printf ("SELECT * FROM %s", table);
+    if (sqlite3_prepare (db, sql, -1, &handle, NULL) == SQLITE_OK &&
+        sqlite3_step (handle) == SQLITE_ROW) {
+        found = TRUE;
+
+        for (i = 0; i < sqlite3_column_count (handle); i++) {
+            const char *name = sqlite3_column_name (handle, i);
+            const char *text = (const char *) sqlite3_column_text (handle, i);
+
+            if (!strcmp (name, "dbversion"))
+                stamp->dbversion = sqlite3_column_int (handle, i);
+            else if (!strcmp (name, "revision"))
+                stamp->revision = sqlite3_column_int (handle, i);
+            else if (!strcmp (name, "layout"))
+                stamp->layout = sqlite3_column_int (handle, i);
+            else if (!strcmp (name, "checksum"))
+                stamp->checksum = g_strdup (text);
+            else if (!strcmp (name, "primary_checksum"))
+                stamp->primary_checksum = g_strdup (text);
+            else if (!strcmp (name, "from_checksum"))
+                stamp->from_checksum = g_strdup (text);
+            else if (!strcmp (name, "packages"))
+                stamp->packages = sqlite3_column_int64 (handle, i);
+            else if (!strcmp (name, "digest"))
+                stamp->digest = g_strdup (text);
+        }
+    }
+
+    sqlite3_finalize (handle);
+    g_free (sql);
+
+    return found;
+}
+
+/* SHA-256 over the sorted pkgIds, what a cache holds after a delta */
+static char *
+delta_digest (sqlite3 *db, const char *packages, gint64 *count)
+{
+    sqlite3_stmt *handle = NULL;
+    GChecksum *checksum;
+    char *digest = NULL;
+    char *sql;
+
+    *count = 0;
+    checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+    sql = g_strdup_printf ("SELECT pkgId FROM %s ORDER BY pkgId", packages);
+    if (sqlite3_prepare (db, sql, -1, &handle, NULL) == SQLITE_OK) {
+        while (sqlite3_step (handle) == SQLITE_ROW) {
+            g_checksum_update (checksum, sqlite3_column_blob (handle, 0),
+                               sqlite3_column_bytes (handle, 0));
+            g_checksum_update (checksum, (const guchar *) "", 1);
+            (*count)++;
+        }
+
+        digest = g_strdup (g_checksum_get_string (checksum));
+    }
+
+    sqlite3_finalize (handle);
+    g_checksum_free (checksum);
+    g_free (sql);
+
+    return digest;
+}
+
+static gboolean
+delta_attach (sqlite3 *db, const char *path, const char *name, GError **err)
+{
+    sqlite3_stmt *handle = NULL;
+    char *sql;
+    int rc;
+
+    sql = g_strdup_printf ("ATTACH DATABASE ? AS %s", name);
+    rc = sqlite3_prepare (db, sql, -1, &handle, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text (handle, 1, path, -1, SQLITE_STATIC);
+        rc = sqlite3_step (handle);
+    }
+    sqlite3_finalize (handle);
+    g_free (sql);
+
+    if (rc != SQLITE_DONE) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not attach %s: %s", path, sqlite3_errmsg (db));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+delta_exec (sqlite3 *db, const char *sql, const char *what, GError **err)
+{
+    if (*err)
+        return;
+
+    if (sqlite3_exec (db, sql, NULL, NULL, NULL) != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not %s: %s", what, sqlite3_errmsg (db));
+}
+
+/* The tables of a cache holding package rows, all keyed by pkgKey */
+static GPtrArray *
+delta_tables (sqlite3 *db, const char *schema, GError **err)
+{
+    sqlite3_stmt *handle = NULL;
+    GPtrArray *tables;
+    char *sql;
+
+    tables = g_ptr_array_new_with_free_func (g_free);
+
+    sql = g_strdup_printf ("SELECT name FROM %s.sqlite_master "
+                           "WHERE type = 'table' AND name NOT LIKE 'sqlite_%%' "
+                           "AND name NOT IN ('db_info', 'db_checkpoint', "
+                           "'delta_info', 'delta_removed')", schema);
+    sqlite3_prepare (db, sql, -1, &handle, NULL);
+    g_free (sql);
+
+    while (!*err && sqlite3_step (handle) == SQLITE_ROW) {
+        const char *name = (const char *) sqlite3_column_text (handle, 0);
+        sqlite3_stmt *check = NULL;
+
+        sql = g_strdup_printf ("SELECT pkgKey FROM %s.%s", schema, name);
+        if (sqlite3_prepare (db, sql, -1, &check, NULL) == SQLITE_OK)
+            g_ptr_array_add (tables, g_strdup (name));
+        else
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Table %s is not keyed by package", name);
+        sqlite3_finalize (check);
+        g_free (sql);
+    }
+
+    sqlite3_finalize (handle);
+
+    return tables;
+}
+
+void
+yum_db_delta_write (const char *old_path,
+                    const char *new_path,
+                    const char *delta_path,
+                    GError **err)
+{
+    sqlite3 *db = NULL;
+    GPtrArray *tables = NULL;
+    DeltaStamp from, to;
+    const char *packages;
+    gint64 count = 0;
+    char *digest = NULL;
+    char *sql;
+    guint i;
+
+    memset (&from, 0, sizeof (DeltaStamp));
+    memset (&to, 0, sizeof (DeltaStamp));
+
+    if (sqlite3_open (new_path, &db) != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not open SQL database: %s", sqlite3_errmsg (db));
+        goto cleanup;
+    }
+
+    unlink (delta_path);
+    if (!delta_attach (db, old_path, "old", err) ||
+        !delta_attach (db, delta_path, "delta", err))
+        goto cleanup;
+
+    if (!delta_read_stamp (db, "main.db_info", &to) ||
+        !delta_read_stamp (db, "old.db_info", &from)) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Deltas need two complete caches");
+        goto cleanup;
+    }
+
+    if (to.layout & ~DELTA_LAYOUTS) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Deltas are not supported for layout %u", to.layout);
+        goto cleanup;
+    }
+
+    if (from.dbversion != to.dbversion || from.revision != to.revision ||
+        from.layout != to.layout) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Deltas need caches of the same version and layout");
+        goto cleanup;
+    }
+
+    tables = delta_tables (db, "main", err);
+    if (*err)
+        goto cleanup;
+
+    packages = packages_storage (db, "main");
+    sql = g_strdup_printf ("main.%s", packages);
+    digest = delta_digest (db, sql, &count);
+    g_free (sql);
+
+    sql = g_strdup_printf ("PRAGMA delta.page_size = %d", DELTA_PAGE_SIZE);
+    delta_exec (db, sql, "create delta", err);
+    g_free (sql);
+
+    delta_exec (db, "BEGIN", "create delta", err);
+    delta_exec (db,
+                "CREATE TABLE delta.delta_info (dbversion INTEGER, "
+                "checksum TEXT, layout INTEGER, primary_checksum TEXT, "
+                "revision INTEGER, from_checksum TEXT, packages INTEGER, "
+                "digest TEXT)", "create delta_info", err);
+
+    sql = sqlite3_mprintf ("INSERT INTO delta.delta_info VALUES "
+                           "(%d, %Q, %u, %Q, %d, %Q, %lld, %Q)",
+                           to.dbversion, to.checksum, to.layout,
+                           to.primary_checksum, to.revision, from.checksum,
+                           (long long) count, digest);
+    delta_exec (db, sql, "write delta_info", err);
+    sqlite3_free (sql);
+
+    sql = g_strdup_printf ("CREATE TABLE delta.delta_removed AS "
+                           "SELECT pkgId FROM old.%s WHERE pkgId NOT IN "
+                           "(SELECT pkgId FROM main.%s)", packages, packages);
+    delta_exec (db, sql, "list removed packages", err);
+    g_free (sql);
+
+    sql = g_strdup_printf ("CREATE TEMP TABLE delta_added AS "
+                           "SELECT pkgKey FROM main.%s WHERE pkgId NOT IN "
+                           "(SELECT pkgId FROM old.%s)", packages, packages);
+    delta_exec (db, sql, "list added packages", err);
+    g_free (sql);
+
+    for (i = 0; i < tables->len && !*err; i++) {
+        const char *table = g_ptr_array_index (tables, i);
+
+        sql = g_strdup_printf ("CREATE TABLE delta.%s AS SELECT * FROM main.%s "
+                               "WHERE pkgKey IN "
+                               "(SELECT pkgKey FROM temp.delta_added)",
+                               table, table);
+        delta_exec (db, sql, "copy added rows", err);
+        g_free (sql);
+    }
+
+    if (!*err) {
+        sql = g_strdup_printf ("SELECT count(*) FROM delta.%s", packages);
+        g_message ("Delta adds %d packages and removes %d",
+                   import_query_int (db, sql, 0),
+                   import_query_int (db, "SELECT count(*) "
+                                     "FROM delta.delta_removed", 0));
+        g_free (sql);
+    }
+
+    delta_exec (db, "COMMIT", "write delta", err);
+
+ cleanup:
+    if (db) {
+        if (*err)
+            sqlite3_exec (db, "ROLLBACK", NULL, NULL, NULL);
+        sqlite3_close (db);
+    }
+    if (*err)
+        unlink (delta_path);
+    if (tables)
+        g_ptr_array_free (tables, TRUE);
+    delta_stamp_clear (&from);
+    delta_stamp_clear (&to);
+    g_free (digest);
+}
+
+/* Keeps the pkgKey a package had in the new cache unless it is taken */
+static void
+delta_assign_keys (sqlite3 *db, const char *packages, GError **err)
+{
+    sqlite3_stmt *taken = NULL;
+    sqlite3_stmt *update = NULL;
+    gint64 next;
+    char *sql;
+
+    sql = g_strdup_printf ("CREATE TEMP TABLE delta_keys "
+                           "(src INTEGER PRIMARY KEY, dst INTEGER);"
+                           "INSERT INTO delta_keys "
+                           "SELECT pkgKey, pkgKey FROM delta.%s",
+                           packages);
+    delta_exec (db, sql, "map package keys", err);
+    g_free (sql);
+    if (*err)
+        return;
+
+    sql = g_strdup_printf ("SELECT max(ifnull((SELECT max(pkgKey) FROM main.%s),"
+                           " 0), ifnull((SELECT max(src) FROM delta_keys), 0))",
+                           packages);
+    /* Stable keys do not fit an int */
+    next = import_query_int64 (db, sql, 0);
+    g_free (sql);
+
+    sql = g_strdup_printf ("SELECT src FROM delta_keys WHERE src IN "
+                           "(SELECT pkgKey FROM main.%s)", packages);
+    sqlite3_prepare (db, sql, -1, &taken, NULL);
+    g_free (sql);
+    sqlite3_prepare (db, "UPDATE delta_keys SET dst = ? WHERE src = ?",
+                     -1, &update, NULL);
+
+    while (sqlite3_step (taken) == SQLITE_ROW) {
+        sqlite3_bind_int64 (update, 1, ++next);
+        sqlite3_bind_int64 (update, 2, sqlite3_column_int64 (taken, 0));
+        if (sqlite3_step (update) != SQLITE_DONE) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not map package keys: %s", sqlite3_errmsg (db));
+            break;
+        }
+        sqlite3_reset (update);
+    }
+
+    sqlite3_finalize (taken);
+    sqlite3_finalize (update);
+}
+
+/* Copies the rows of a delta table, pkgKey mapped through delta_keys */
+static void
+delta_insert_rows (sqlite3 *db, const char *table, GError **err)
+{
+    sqlite3_stmt *handle = NULL;
+    GString *columns;
+    GString *values;
+    char *sql;
+    int i;
+
+    sql = g_strdup_printf ("SELECT * FROM delta.%s LIMIT 0", table);
+    if (sqlite3_prepare (db, sql, -1, &handle, NULL) != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not read delta table %s: %s",
+                     table, sqlite3_errmsg (db));
+        g_free (sql);
+        return;
+    }
+    g_free (sql);
+
+    columns = g_string_new (NULL);
+    values = g_string_new (NULL);
+
+    for (i = 0; i < sqlite3_column_count (handle); i++) {
+        const char *name = sqlite3_column_name (handle, i);
+
+        if (i > 0) {
+            g_string_append_c (columns, ',');
+            g_string_append_c (values, ',');
+        }
+
+        g_string_append (columns, name);
+        if (!strcmp (name, "pkgKey"))
+            g_string_append (values, "(SELECT dst FROM delta_keys "
+                             "WHERE src = pkgKey)");
+        else
+            g_string_append (values, name);
+    }
+    sqlite3_finalize (handle);
+
+    sql = g_strdup_printf ("INSERT INTO main.%s (%s) SELECT %s FROM delta.%s",
+                           table, columns->str, values->str, table);
+    if (sqlite3_exec (db, sql, NULL, NULL, NULL) != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not apply delta to %s: %s",
+                     table, sqlite3_errmsg (db));
+    g_free (sql);
+
+    g_string_free (columns, TRUE);
+    g_string_free (values, TRUE);
+}
+
+void
+yum_db_delta_apply (const char *path, const char *delta_path, GError **err)
+{
+    sqlite3 *db = NULL;
+    GPtrArray *tables = NULL;
+    DeltaStamp cache, delta;
+    const char *packages;
+    gint64 count = 0;
+    char *digest = NULL;
+    char *partial;
+    char *sql;
+    guint i;
+
+    memset (&cache, 0, sizeof (DeltaStamp));
+    memset (&delta, 0, sizeof (DeltaStamp));
+
+    /* Applied to a copy which replaces the cache, see yum_db_open() */
+    partial = yum_db_partial_filename (path);
+    yum_db_copy (path, partial, err);
+    if (*err)
+        goto cleanup;
+
+    if (sqlite3_open_v2 (partial, &db, SQLITE_OPEN_READWRITE,
+                         NULL) != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not open SQL database: %s", sqlite3_errmsg (db));
+        goto cleanup;
+    }
+
+    if (!delta_attach (db, delta_path, "delta", err))
+        goto cleanup;
+
+    if (!delta_read_stamp (db, "delta.delta_info", &delta)) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "%s is not a cache delta", delta_path);
+        goto cleanup;
+    }
+
+    if (!delta_read_stamp (db, "main.db_info", &cache) ||
+        cache.dbversion != delta.dbversion ||
+        cache.revision != delta.revision || cache.layout != delta.layout ||
+        g_strcmp0 (cache.checksum, delta.from_checksum)) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Delta applies to %s, not to this cache",
+                     delta.from_checksum);
+        goto cleanup;
+    }
+
+    tables = delta_tables (db, "delta", err);
+    if (*err)
+        goto cleanup;
+
+    packages = packages_storage (db, "main");
+
+    sqlite3_exec (db, "PRAGMA synchronous = 0", NULL, NULL, NULL);
+    delta_exec (db, "BEGIN", "apply delta", err);
+
+    /* The removal triggers take the rows of the other tables along */
+    sql = g_strdup_printf ("DELETE FROM main.%s WHERE pkgId IN "
+                           "(SELECT pkgId FROM delta.delta_removed)",
+                           packages);
+    delta_exec (db, sql, "remove packages", err);
+    g_free (sql);
+
+    if (!*err)
+        delta_assign_keys (db, packages, err);
+
+    for (i = 0; i < tables->len && !*err; i++)
+        delta_insert_rows (db, g_ptr_array_index (tables, i), err);
+
+    if (*err)
+        goto cleanup;
+
+    sql = g_strdup_printf ("main.%s", packages);
+    digest = delta_digest (db, sql, &count);
+    g_free (sql);
+
+    if (count != delta.packages || g_strcmp0 (digest, delta.digest)) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Cache does not match %s after the delta",
+                     delta.checksum);
+        goto cleanup;
+    }
+
+    delta_exec (db, "DELETE FROM db_info", "update db_info", err);
+    if (!*err)
+        yum_db_dbinfo_update (db, delta.checksum, delta.layout,
+                              delta.primary_checksum, err);
+
+ cleanup:
+    if (db) {
+        sqlite3_exec (db, *err ? "ROLLBACK" : "COMMIT", NULL, NULL, NULL);
+        sqlite3_exec (db, "DROP TABLE IF EXISTS temp.delta_keys",
+                      NULL, NULL, NULL);
+        sqlite3_close (db);
+    }
+    if (!*err && rename (partial, path) != 0)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not rename %s: %s", partial, g_strerror (errno));
+    if (*err)
+        unlink (partial);
+    g_free (partial);
+    if (tables)
+        g_ptr_array_free (tables, TRUE);
+    delta_stamp_clear (&cache);
+    delta_stamp_clear (&delta);
+    g_free (digest);
+}
+
+PackageIdSet *
+yum_db_read_package_ids (sqlite3 *db, GError **err)
+{
+    const char *query;
+    int rc;
+    PackageIdSet *set = NULL;
+    sqlite3_stmt *handle = NULL;
+
+    query = "SELECT pkgId, pkgKey FROM packages";
+    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not prepare SQL clause: %s",
+                     sqlite3_errmsg (db));
+        goto cleanup;
+    }
+
+    set = package_id_set_new ();
+
+    while ((rc = sqlite3_step (handle)) == SQLITE_ROW) {
+        package_id_set_insert (set,
+                               (const char *) sqlite3_column_text (handle, 0),
+                               sqlite3_column_bytes (handle, 0),
+                               sqlite3_column_int64 (handle, 1));
+    }
+
+    if (rc != SQLITE_DONE)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Error reading from SQL: %s",
+                     sqlite3_errmsg (db));
+
+ cleanup:
+    if (handle)
+        sqlite3_finalize (handle);
+
+    return set;
+}
+
+void
+yum_db_merge_shard (sqlite3 *db,
+                    const char *shard_path,
+                    const char *table,
+                    guint layout,
+                    GError **err)
+{
+    int rc;
+    sqlite3_stmt *handle = NULL;
+    const char *storage;
+    char *sql;
+
+    rc = sqlite3_prepare (db, "ATTACH DATABASE ? AS shard", -1, &handle, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text (handle, 1, shard_path, -1, SQLITE_STATIC);
+        rc = sqlite3_step (handle);
+    }
+    sqlite3_finalize (handle);
+
+    if (rc != SQLITE_DONE) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not attach %s shard: %s",
+                     table, sqlite3_errmsg (db));
+        return;
+    }
+
+    /* Unqualified, so it lands in the staging table when clustering */
+    storage = yum_db_table_storage (table, layout);
+    if (!storage) {
+        sqlite3_exec (db, "DETACH DATABASE shard", NULL, NULL, NULL);
+        return;
     }
 
-    return db;
+    /* Shards are made without the row key, it is assigned here */
+    sql = g_strdup_printf ("INSERT INTO %s SELECT *%s FROM shard.%s",
+                           storage,
+                           table_row_key (table_lookup (table), layout) ?
+                           ", NULL" : "", storage);
+    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    g_free (sql);
+
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not merge %s shard: %s",
+                     table, sqlite3_errmsg (db));
+
+    sqlite3_exec (db, "DETACH DATABASE shard", NULL, NULL, NULL);
 }
 
+/* Clustered builds insert rows into a TEMP table shadowing the real one
+   and copy them over sorted by their lookup key at the end, sqlite spills
+   the staging tables and the sort to disk as needed. Compressed changelogs
+   are staged the same way, without a key. */
+
 void
-yum_db_dbinfo_update (sqlite3 *db, const char *checksum, GError **err)
+yum_db_stage_table (sqlite3 *db, const char *table, guint layout,
+                    GError **err)
 {
     int rc;
+    const char *storage;
     char *sql;
 
-    sql = g_strdup_printf
-        ("INSERT INTO db_info (dbversion, checksum) VALUES (%d, '%s')",
-         YUM_SQLITE_CACHE_DBVERSION, checksum);
+    storage = yum_db_table_storage (table, layout);
+    if (!storage)
+        return;
+
+    sqlite3_exec (db, "PRAGMA temp_store = FILE", NULL, NULL, NULL);
 
+    sql = g_strdup_printf ("CREATE TEMP TABLE %s AS SELECT * FROM main.%s "
+                           "WHERE 0", storage, storage);
     rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    g_free (sql);
+
     if (rc != SQLITE_OK)
         g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not update dbinfo table: %s",
-                     sqlite3_errmsg (db));
-
-    g_free (sql);
+                     "Can not create staging table for %s: %s",
+                     table, sqlite3_errmsg (db));
 }
 
-GHashTable *
-yum_db_read_package_ids (sqlite3 *db, GError **err)
+void
+yum_db_cluster_table (sqlite3 *db,
+                      const char *table,
+                      const char *key,
+                      guint layout,
+                      GError **err)
 {
-    const char *query;
     int rc;
-    GHashTable *hash = NULL;
-    sqlite3_stmt *handle = NULL;
+    const TableSpec *spec = table_lookup (table);
+    const TableColumn *column;
+    const char *storage;
+    GString *copy;
+    char *sql;
 
-    query = "SELECT pkgId, pkgKey FROM packages";
-    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not prepare SQL clause: %s",
-                     sqlite3_errmsg (db));
-        goto cleanup;
-    }
+    storage = table_storage (spec, layout);
+    if (!storage)
+        return;
 
-    hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                  (GDestroyNotify) g_free, NULL);
+    /* Staged changelogs are compressed on the way */
+    copy = g_string_new (NULL);
+    g_string_printf (copy, "INSERT INTO main.%s SELECT", storage);
+    for (column = spec->columns; column->name; column++) {
+        if (column != spec->columns)
+            g_string_append_c (copy, ',');
+
+        switch (column_encoding (column, layout)) {
+        case ENCODING_PATH:
+            g_string_append_printf (copy, " dirname, %s", column->name);
+            break;
+        case ENCODING_ZSTD:
+            g_string_append_printf (copy, " compress_changelog(%s)",
+                                    column->name);
+            break;
+        default:
+            g_string_append_printf (copy, " %s",
+                                    column_storage (spec, column, layout));
+            break;
+        }
+    }
 
-    while ((rc = sqlite3_step (handle)) == SQLITE_ROW) {
-        char *pkgId;
-        gint pkgKey;
+    if (table_row_key (spec, layout))
+        g_string_append (copy, ", NULL");
 
-        pkgId  = g_strdup ((char *) sqlite3_column_text  (handle, 0));
-        pkgKey = sqlite3_column_int (handle, 1);
+    g_string_append_printf (copy, " FROM temp.%s ORDER BY", storage);
+    if (key)
+        g_string_append_printf (copy, " %s, %s,", key,
+                                table_is_shared (spec, layout) ?
+                                "setKey" : "pkgKey");
+    g_string_append (copy, " rowid");
 
-        g_hash_table_insert (hash, pkgId, GINT_TO_POINTER (pkgKey));
-    }
+    rc = sqlite3_exec (db, copy->str, NULL, NULL, NULL);
+    g_string_free (copy, TRUE);
 
-    if (rc != SQLITE_DONE)
+    if (rc != SQLITE_OK) {
         g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Error reading from SQL: %s",
-                     sqlite3_errmsg (db));
-
- cleanup:
-    if (handle)
-        sqlite3_finalize (handle);
+                     "Can not copy clustered %s rows: %s",
+                     table, sqlite3_errmsg (db));
+        return;
+    }
 
-    return hash;
+    sql = g_strdup_printf ("DROP TABLE temp.%s", storage);
+    sqlite3_exec (db, sql, NULL, NULL, NULL);
+    g_free (sql);
 }
 
-void
-yum_db_create_primary_tables (sqlite3 *db, GError **err)
+static sqlite3_stmt *
+table_insert_prepare (sqlite3 *db,
+                      const TableSpec *tables,
+                      const char *table,
+                      guint layout,
+                      const char **columns,
+                      const char *what,
+                      GError **err)
 {
     int rc;
-    const char *sql;
+    sqlite3_stmt *handle = NULL;
+    char *query;
 
-    sql =
-        "CREATE TABLE packages ("
-        "  pkgKey INTEGER PRIMARY KEY,"
-        "  pkgId TEXT,"
-        "  name TEXT,"
-        "  arch TEXT,"
-        "  version TEXT,"
-        "  epoch TEXT,"
-        "  release TEXT,"
-        "  summary TEXT,"
-        "  description TEXT,"
-        "  url TEXT,"
-        "  time_file INTEGER,"
-        "  time_build INTEGER,"
-        "  rpm_license TEXT,"
-        "  rpm_vendor TEXT,"
-        "  rpm_group TEXT,"
-        "  rpm_buildhost TEXT,"
-        "  rpm_sourcerpm TEXT,"
-        "  rpm_header_start INTEGER,"
-        "  rpm_header_end INTEGER,"
-        "  rpm_packager TEXT,"
-        "  size_package INTEGER,"
-        "  size_installed INTEGER,"
-        "  size_archive INTEGER,"
-        "  location_href TEXT,"
-        "  location_base TEXT,"
-        "  checksum_type TEXT)";
+    query = table_insert_sql (table_find (tables, table), layout, FALSE,
+                              columns);
+    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    g_free (query);
 
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
         g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create packages table: %s",
-                     sqlite3_errmsg (db));
-        return;
+                     "Can not prepare %s insertion: %s",
+                     what, sqlite3_errmsg (db));
+        sqlite3_finalize (handle);
+        handle = NULL;
     }
 
-    sql =
-        "CREATE TABLE files ("
-        "  name TEXT,"
-        "  type TEXT,"
-        "  pkgKey INTEGER)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
+    return handle;
+}
+
+void
+yum_db_create_primary_tables (sqlite3 *db, guint layout, GError **err)
+{
+    create_tables (db, primary_tables, layout, err);
+    if (*err)
+        return;
+
+    /* Filled by yum_db_resolve_requires(), here for the trigger */
+    if (layout & YUM_DB_LAYOUT_PROVIDERS &&
+        sqlite3_exec (db, "CREATE TABLE requires_providers ("
+                      "  requires INTEGER,"
+                      "  pkgKey INTEGER,"
+                      "  provider INTEGER)",
+                      NULL, NULL, NULL) != SQLITE_OK) {
         g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create files table: %s",
+                     "Can not create requires_providers table: %s",
                      sqlite3_errmsg (db));
         return;
     }
 
-    sql =
-        "CREATE TABLE %s ("
-        "  name TEXT,"
-        "  flags TEXT,"
-        "  epoch TEXT,"
-        "  version TEXT,"
-        "  release TEXT,"
-        "  pkgKey INTEGER %s)";
+    create_removal_trigger (db, primary_tables, "removals", layout, err);
+}
+
+void
+yum_db_prune_primary_tables (sqlite3 *db, guint layout, GError **err)
+{
+    prune_dictionaries (db, primary_tables, layout, err);
+}
 
+void
+yum_db_index_primary_tables (sqlite3 *db, guint layout, GError **err)
+{
+    const TableSpec *packages = table_find (primary_tables, "packages");
+    const TableSpec *files = table_find (primary_tables, "files");
     const char *deps[] = { "requires", "provides", "conflicts", "obsoletes", NULL };
     int i;
 
-    for (i = 0; deps[i]; i++) {
-        const char *prereq;
-        char *query;
+    create_dictionary_indexes (db, primary_tables, layout, err);
+    if (*err)
+        return;
 
-        if (!strcmp(deps[i], "requires")) {
-            prereq = ", pre BOOLEAN DEFAULT FALSE";
-        } else
-            prereq = "";
+    if (tables_use_packed_deps (primary_tables, layout)) {
+        index_packed_deps (db, err);
+        if (*err)
+            return;
+    }
 
-        query = g_strdup_printf (sql, deps[i], prereq);
-        rc = sqlite3_exec (db, query, NULL, NULL, NULL);
-        g_free (query);
+    create_index (db, "packagename", packages, "name", layout, err);
+    if (*err)
+        return;
 
-        if (rc != SQLITE_OK) {
-            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                         "Can not create %s table: %s",
-                         deps[i], sqlite3_errmsg (db));
+    create_index (db, "packageId", packages, "pkgId", layout, err);
+    if (*err)
+        return;
+
+    create_index (db, "packageevr", packages, "name, arch, evr", layout, err);
+    if (*err)
+        return;
+
+    /* Paths are looked up by directory id and the rest of the path */
+    create_index (db, "filenames", files,
+                  layout & YUM_DB_LAYOUT_DIRNAMES ? "dirname, name" : "name",
+                  layout, err);
+    if (*err)
+        return;
+
+    create_index (db, "pkgfiles", files, "pkgKey", layout, err);
+    if (*err)
+        return;
+
+    for (i = 0; deps[i]; i++) {
+        const TableSpec *table = table_find (primary_tables, deps[i]);
+        char *index;
+
+        index = g_strdup_printf ("pkg%s", deps[i]);
+        create_index (db, index, table, "pkgKey", layout, err);
+        g_free (index);
+        if (*err)
             return;
+
+        if (i < 2) {
+            index = g_strdup_printf ("%sname", deps[i]);
+            create_index (db, index, table, "name", layout, err);
+            g_free (index);
+            if (*err)
+                return;
         }
     }
+}
 
-    sql =
-        "CREATE TRIGGER removals AFTER DELETE ON packages"
-        "  BEGIN"
-        "    DELETE FROM files WHERE pkgKey = old.pkgKey;"
-        "    DELETE FROM requires WHERE pkgKey = old.pkgKey;"
-        "    DELETE FROM provides WHERE pkgKey = old.pkgKey;"
-        "    DELETE FROM conflicts WHERE pkgKey = old.pkgKey;"
-        "    DELETE FROM obsoletes WHERE pkgKey = old.pkgKey;"
-        "  END;";
+/* requires_providers maps each requires row, by its requireKey, to the
+   packages satisfying it: provides of the same name whose range overlaps
+   the required one, and for paths the packages listing the file in
+   primary. Unresolved requirements have no rows. */
 
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create removals trigger: %s",
-                     sqlite3_errmsg (db));
+#define SENSE_LESS    (1 << 0)
+#define SENSE_GREATER (1 << 1)
+#define SENSE_EQUAL   (1 << 2)
+
+static guint
+dep_sense (sqlite3_value *value)
+{
+    static const guint senses[] = {
+        SENSE_LESS, SENSE_GREATER, SENSE_EQUAL,
+        SENSE_LESS | SENSE_EQUAL, SENSE_GREATER | SENSE_EQUAL
+    };
+    const char *flags;
+    int i;
+
+    /* Typed layouts store the position in dependency_flags plus one */
+    if (sqlite3_value_type (value) == SQLITE_INTEGER) {
+        i = sqlite3_value_int (value);
+        return i >= 1 && i <= (int) G_N_ELEMENTS (senses) ? senses[i - 1] : 0;
+    }
+
+    flags = (const char *) sqlite3_value_text (value);
+    for (i = 0; flags && dependency_flags[i]; i++) {
+        if (!strcmp (flags, dependency_flags[i]))
+            return senses[i];
+    }
+
+    return 0;
+}
+
+static gboolean
+text_is_set (const char *text)
+{
+    return text && *text;
+}
+
+/* rpm's rpmdsCompare(): whether the ranges of two dependencies overlap.
+   Arguments are the flags, epoch, version and release of each. */
+static void
+dep_overlap (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    guint f1 = dep_sense (argv[0]);
+    guint f2 = dep_sense (argv[4]);
+    const char *e1 = (const char *) sqlite3_value_text (argv[1]);
+    const char *v1 = (const char *) sqlite3_value_text (argv[2]);
+    const char *r1 = (const char *) sqlite3_value_text (argv[3]);
+    const char *e2 = (const char *) sqlite3_value_text (argv[5]);
+    const char *v2 = (const char *) sqlite3_value_text (argv[6]);
+    const char *r2 = (const char *) sqlite3_value_text (argv[7]);
+    int sense = 0;
+    gboolean result;
+
+    /* Anything without a version matches */
+    if (!f1 || !f2 || !text_is_set (v1) || !text_is_set (v2)) {
+        sqlite3_result_int (ctx, 1);
         return;
     }
+
+    if (text_is_set (e1) && text_is_set (e2))
+        sense = yum_evr_compare (e1, -1, e2, -1);
+    else if (text_is_set (e1) && atol (e1) > 0)
+        sense = 1;
+    else if (text_is_set (e2) && atol (e2) > 0)
+        sense = -1;
+
+    if (sense == 0) {
+        sense = yum_evr_compare (v1, -1, v2, -1);
+        if (sense == 0) {
+            if (text_is_set (r1) && text_is_set (r2))
+                sense = yum_evr_compare (r1, -1, r2, -1);
+            else if ((text_is_set (r1) && (f2 & SENSE_EQUAL)) ||
+                     (text_is_set (r2) && (f1 & SENSE_EQUAL))) {
+                /* The side without a release takes any */
+                sqlite3_result_int (ctx, 1);
+                return;
+            }
+        }
+    }
+
+    if (sense < 0)
+        result = (f1 & SENSE_GREATER) || (f2 & SENSE_LESS);
+    else if (sense > 0)
+        result = (f1 & SENSE_LESS) || (f2 & SENSE_GREATER);
+    else
+        result = (f1 & f2) != 0;
+
+    sqlite3_result_int (ctx, result);
+}
+
+/* dict_strings without typed_columns interns the flags too */
+static char *
+dep_flags_sql (const TableSpec *table, const char *alias, guint layout)
+{
+    const TableColumn *flags = &table->columns[1];
+
+    if (column_encoding (flags, layout) == ENCODING_STRINGS)
+        return g_strdup_printf ("(SELECT string FROM strings WHERE id = %s.%s)",
+                                alias, flags->name);
+
+    return g_strdup_printf ("%s.%s", alias, flags->name);
 }
 
 void
-yum_db_index_primary_tables (sqlite3 *db, GError **err)
+yum_db_resolve_requires (sqlite3 *db, guint layout, GError **err)
 {
+    const TableSpec *requires = table_find (primary_tables, "requires");
+    const TableSpec *provides = table_find (primary_tables, "provides");
+    const TableSpec *files = table_find (primary_tables, "files");
+    const char *req = table_storage (requires, layout);
+    const char *prov = table_storage (provides, layout);
+    const char *key = table_row_key (requires, layout);
+    const char *name;
+    char *req_flags;
+    char *prov_flags;
+    GString *sql;
     int rc;
-    const char *sql;
 
-    sql = "CREATE INDEX IF NOT EXISTS packagename ON packages (name)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create packagename index: %s",
-                     sqlite3_errmsg (db));
+    if (!key || !req)
         return;
-    }
-    
-    sql = "CREATE INDEX IF NOT EXISTS packageId ON packages (pkgId)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+
+    rc = sqlite3_create_function (db, "dep_overlap", 8,
+                                  SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                  dep_overlap, NULL, NULL);
     if (rc != SQLITE_OK) {
         g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create packageId index: %s",
+                     "Can not create dep_overlap function: %s",
                      sqlite3_errmsg (db));
         return;
     }
 
-    sql = "CREATE INDEX IF NOT EXISTS filenames ON files (name)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create filenames index: %s",
-                     sqlite3_errmsg (db));
-        return;
+    req_flags = dep_flags_sql (requires, "r", layout);
+    prov_flags = dep_flags_sql (provides, "p", layout);
+
+    /* Rebuilt whole, the indexes after the rows */
+    sql = g_string_new (NULL);
+    g_string_printf (sql,
+                     "DROP INDEX IF EXISTS requiresproviders;"
+                     "DROP INDEX IF EXISTS pkgrequiresproviders;"
+                     "DROP INDEX IF EXISTS providerrequires;"
+                     "DELETE FROM requires_providers;"
+                     "INSERT INTO requires_providers"
+                     "  SELECT r.%s, r.pkgKey, p.pkgKey"
+                     "  FROM %s r JOIN %s p ON p.name = r.name"
+                     "  WHERE dep_overlap(%s, r.epoch, r.version, r.release,"
+                     "                    %s, p.epoch, p.version, p.release)"
+                     "  UNION"
+                     "  SELECT r.%s, r.pkgKey, f.pkgKey", key, req, prov,
+                     req_flags, prov_flags, key);
+    g_free (req_flags);
+    g_free (prov_flags);
+
+    /* Path requirements are a range of the requiresname index, or of the
+       strings index with dict_strings; '0' follows '/' */
+    if (column_encoding (&requires->columns[0], layout) == ENCODING_STRINGS) {
+        g_string_append_printf (sql, "  FROM strings s"
+                                "  JOIN %s r ON r.name = s.id", req);
+        name = "s.string";
+    } else {
+        g_string_append_printf (sql, "  FROM %s r", req);
+        name = "r.name";
     }
 
-    sql = "CREATE INDEX IF NOT EXISTS pkgfiles ON files (pkgKey)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    /* The files view reads file_paths with dirnames, which has no index
+       on the path; files_data has one on the directory id and the rest */
+    if (column_encoding (&files->columns[0], layout) == ENCODING_PATH)
+        g_string_append_printf (sql,
+                                "  JOIN dirnames d ON d.path = path_dirname(%s)"
+                                "  JOIN %s f ON f.dirname = d.id"
+                                "  AND f.name = path_suffix(%s)",
+                                name, table_storage (files, layout), name);
+    else
+        g_string_append_printf (sql, "  JOIN files f ON f.name = %s", name);
+
+    g_string_append_printf (sql,
+                            "  WHERE %s >= '/' AND %s < '0';"
+                            "CREATE INDEX requiresproviders"
+                            "  ON requires_providers (requires);"
+                            "CREATE INDEX pkgrequiresproviders"
+                            "  ON requires_providers (pkgKey);"
+                            "CREATE INDEX providerrequires"
+                            "  ON requires_providers (provider)", name, name);
+
+    rc = sqlite3_exec (db, sql->str, NULL, NULL, NULL);
+    g_string_free (sql, TRUE);
+
     if (rc != SQLITE_OK) {
         g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create index on files table: %s",
-                     sqlite3_errmsg (db));
-        return;
+                     "Can not resolve requires: %s", sqlite3_errmsg (db));
     }
+}
 
-    const char *deps[] = { "requires", "provides", "conflicts", "obsoletes", NULL };
-    int i;
-
-    const char *pkgindexsql = "CREATE INDEX IF NOT EXISTS pkg%s on %s (pkgKey)";
-    const char *nameindexsql = "CREATE INDEX IF NOT EXISTS %sname ON %s (name)";
-
-    for (i = 0; deps[i]; i++) {
-        char *query;
-
-        query = g_strdup_printf(pkgindexsql, deps[i], deps[i]);
-        rc = sqlite3_exec (db, query, NULL, NULL, NULL);
-        g_free (query);
-
-        if (rc != SQLITE_OK) {
-            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                         "Can not create index on %s table: %s",
-                         deps[i], sqlite3_errmsg (db));
-            return;
-        }
+static const char *package_insert_columns[] = {
+    "pkgId", "name", "arch", "version", "epoch", "release", "summary",
+    "description", "url", "time_file", "time_build", "rpm_license",
+    "rpm_vendor", "rpm_group", "rpm_buildhost", "rpm_sourcerpm",
+    "rpm_header_start", "rpm_header_end", "rpm_packager", "size_package",
+    "size_installed", "size_archive", "location_href", "location_base",
+    "checksum_type", "pkgKey", "evr", NULL
+};
 
-        if (i < 2) {
-            query = g_strdup_printf(nameindexsql, deps[i], deps[i]);
-            rc = sqlite3_exec (db, query, NULL, NULL, NULL);
-            if (rc != SQLITE_OK) {
-                g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                             "Can not create %sname index: %s",
-                             deps[i], sqlite3_errmsg (db));
-                return;
-            }
-        }
-    }
+sqlite3_stmt *
+yum_db_package_prepare (sqlite3 *db, guint layout, GError **err)
+{
+    return table_insert_prepare (db, primary_tables, "packages", layout,
+                                 package_insert_columns, "packages", err);
 }
 
+/* NULL unless the layout splits the packages table */
 sqlite3_stmt *
-yum_db_package_prepare (sqlite3 *db, GError **err)
+yum_db_package_detail_prepare (sqlite3 *db, guint layout, GError **err)
 {
-    int rc;
+    const TableSpec *packages = table_find (primary_tables, "packages");
     sqlite3_stmt *handle = NULL;
-    const char *query;
+    char *query;
+    int rc;
 
-    query =
-        "INSERT INTO packages ("
-        "  pkgId, name, arch, version, epoch, release, summary, description,"
-        "  url, time_file, time_build, rpm_license, rpm_vendor, rpm_group,"
-        "  rpm_buildhost, rpm_sourcerpm, rpm_header_start, rpm_header_end,"
-        "  rpm_packager, size_package, size_installed, size_archive,"
-        "  location_href, location_base, checksum_type) "
-        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?,"
-        "  ?, ?, ?, ?, ?, ?, ?)";
+    if (!table_is_split (packages, layout))
+        return NULL;
 
+    query = table_insert_sql (packages, layout, TRUE, package_insert_columns);
     rc = sqlite3_prepare (db, query, -1, &handle, NULL);
+    g_free (query);
+
     if (rc != SQLITE_OK) {
         g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not prepare packages insertion: %s",
+                     "Can not prepare package details insertion: %s",
                      sqlite3_errmsg (db));
         sqlite3_finalize (handle);
         handle = NULL;
@@ -526,39 +4525,141 @@ yum_db_package_prepare (sqlite3 *db, GError **err)
     return handle;
 }
 
-void
-yum_db_package_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
+/* Lengths from the parser, measured here only when it had none */
+static gsize
+text_len (const char *text, gsize len)
+{
+    return len || !text ? len : strlen (text);
+}
+
+static void
+bind_text (sqlite3_stmt *handle, int index, const char *text, gsize len)
+{
+    sqlite3_bind_text (handle, index, text,
+                       text ? (int) text_len (text, len) : -1, SQLITE_STATIC);
+}
+
+/* Typed layouts store the digest decoded at parse time, a pkgId which
+   is not a lowercase hex digest stays text */
+static void
+bind_pkgid (sqlite3_stmt *handle, int index, guint layout, Package *p)
+{
+    if ((layout & YUM_DB_LAYOUT_TYPED) && p->pkgIdBinLen)
+        sqlite3_bind_blob (handle, index, p->pkgIdBin, p->pkgIdBinLen,
+                           SQLITE_STATIC);
+    else
+        bind_text (handle, index, p->pkgId, p->pkgIdLen);
+}
+
+/* Stable keys are the first bits of the pkgId, few enough to fit six
+   bytes in a record. Collisions are rare and resolved by probing the
+   next key, so a package keeps its key across rebuilds and across the
+   three databases. */
+
+#define STABLE_KEY_MASK G_GINT64_CONSTANT (0x7fffffffffff)
+
+static gint64
+package_stable_key (Package *p)
+{
+    guint64 key = 0;
+    const char *c;
+    int i;
+
+    if (p->pkgIdBinLen >= 8) {
+        for (i = 0; i < 8; i++)
+            key = key << 8 | p->pkgIdBin[i];
+    } else {
+        /* FNV-1a over a pkgId which is not a hex digest */
+        key = G_GUINT64_CONSTANT (0xcbf29ce484222325);
+        for (c = p->pkgId; *c; c++)
+            key = (key ^ (guchar) *c) * G_GUINT64_CONSTANT (0x100000001b3);
+    }
+
+    key &= STABLE_KEY_MASK;
+
+    return key ? key : 1;
+}
+
+/* A pkgKey assigned up front is kept, otherwise the layout decides it or
+   sqlite picks one */
+static int
+package_key_insert (sqlite3_stmt *handle, int index, guint layout,
+                    Package *p)
 {
+    gboolean stable = (layout & YUM_DB_LAYOUT_STABLE_KEYS) != 0;
     int rc;
 
-    sqlite3_bind_text (handle, 1,  p->pkgId, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 2,  p->name, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 3,  p->arch, -1, SQLITE_STATIC);
+    if (!p->pkgKey && stable)
+        p->pkgKey = package_stable_key (p);
+
+    for (;;) {
+        if (p->pkgKey)
+            sqlite3_bind_int64 (handle, index, p->pkgKey);
+        else
+            sqlite3_bind_null (handle, index);
+
+        /* sqlite3_prepare() statements step to SQLITE_ERROR, the reset
+           tells a taken key apart */
+        rc = sqlite3_step (handle);
+        if (rc == SQLITE_DONE)
+            sqlite3_reset (handle);
+        else
+            rc = sqlite3_reset (handle);
+
+        if (rc != SQLITE_CONSTRAINT || !stable)
+            return rc;
+
+        p->pkgKey = (p->pkgKey & STABLE_KEY_MASK) % STABLE_KEY_MASK + 1;
+    }
+}
+
+static void
+package_bind (sqlite3_stmt *handle, guint layout, Package *p)
+{
+    bind_pkgid (handle, 1, layout, p);
+    bind_text (handle, 2,  p->name, p->name_len);
+    bind_text (handle, 3,  p->arch, p->arch_len);
     sqlite3_bind_text (handle, 4,  p->version, -1, SQLITE_STATIC);
     sqlite3_bind_text (handle, 5,  p->epoch, -1, SQLITE_STATIC);
     sqlite3_bind_text (handle, 6,  p->release, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 7,  p->summary, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 8,  p->description, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 9,  p->url, -1, SQLITE_STATIC);
+    bind_text (handle, 7,  p->summary, p->summary_len);
+    bind_text (handle, 8,  p->description, p->description_len);
+    bind_text (handle, 9,  p->url, p->url_len);
     sqlite3_bind_int  (handle, 10, p->time_file);
     sqlite3_bind_int  (handle, 11, p->time_build);
-    sqlite3_bind_text (handle, 12, p->rpm_license, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 13, p->rpm_vendor, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 14, p->rpm_group, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 15, p->rpm_buildhost, -1, SQLITE_STATIC);
-    sqlite3_bind_text (handle, 16, p->rpm_sourcerpm, -1, SQLITE_STATIC);
+    bind_text (handle, 12, p->rpm_license, p->rpm_license_len);
+    bind_text (handle, 13, p->rpm_vendor, p->rpm_vendor_len);
+    bind_text (handle, 14, p->rpm_group, p->rpm_group_len);
+    bind_text (handle, 15, p->rpm_buildhost, p->rpm_buildhost_len);
+    bind_text (handle, 16, p->rpm_sourcerpm, p->rpm_sourcerpm_len);
     sqlite3_bind_int  (handle, 17, p->rpm_header_start);
     sqlite3_bind_int  (handle, 18, p->rpm_header_end);
-    sqlite3_bind_text (handle, 19, p->rpm_packager, -1, SQLITE_STATIC);
+    bind_text (handle, 19, p->rpm_packager, p->rpm_packager_len);
     sqlite3_bind_int64  (handle, 20, p->size_package);
     sqlite3_bind_int64  (handle, 21, p->size_installed);
     sqlite3_bind_int64  (handle, 22, p->size_archive);
     sqlite3_bind_text (handle, 23, p->location_href, -1, SQLITE_STATIC);
     sqlite3_bind_text (handle, 24, p->location_base, -1, SQLITE_STATIC);
     sqlite3_bind_text (handle, 25, p->checksum_type, -1, SQLITE_STATIC);
+}
 
-    rc = sqlite3_step (handle);
-    sqlite3_reset (handle);
+void
+yum_db_package_write (sqlite3 *db,
+                      sqlite3_stmt *handle,
+                      guint layout,
+                      Package *p)
+{
+    GString *evr;
+    int rc;
+
+    /* Sorts the way rpm compares versions, see evr.c */
+    evr = g_string_sized_new (32);
+    yum_evr_key (evr, p->epoch, p->version, p->release);
+    sqlite3_bind_blob (handle, 27, evr->str, evr->len, SQLITE_STATIC);
+
+    package_bind (handle, layout, p);
+    rc = package_key_insert (handle, 26, layout, p);
+    g_string_free (evr, TRUE);
 
     if (rc != SQLITE_DONE) {
         g_critical ("Error adding package to SQL: %s",
@@ -567,42 +4668,45 @@ yum_db_package_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
         p->pkgKey = sqlite3_last_insert_rowid (db);
 }
 
-sqlite3_stmt *
-yum_db_dependency_prepare (sqlite3 *db,
-                           const char *table,
-                           GError **err)
+/* Goes after yum_db_package_write(), which assigns the pkgKey */
+void
+yum_db_package_detail_write (sqlite3 *db,
+                             sqlite3_stmt *handle,
+                             guint layout,
+                             Package *p)
 {
     int rc;
-    sqlite3_stmt *handle = NULL;
-    char *query;
 
-    const char *pre_name = "";
-    const char *pre_value = "";
+    package_bind (handle, layout, p);
+    sqlite3_bind_int64 (handle, 26, p->pkgKey);
 
-    if (!strcmp (table, "requires")) {
-        pre_name = ", pre";
-        pre_value = ", ?";
-    }
+    rc = sqlite3_step (handle);
+    sqlite3_reset (handle);
 
-    query = g_strdup_printf
-        ("INSERT INTO %s (name, flags, epoch, version, release, pkgKey%s) "
-         "VALUES (?, ?, ?, ?, ?, ?%s)", table, pre_name, pre_value);
+    if (rc != SQLITE_DONE)
+        g_critical ("Error adding package details to SQL: %s",
+                    sqlite3_errmsg (db));
+}
 
-    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
-    g_free (query);
+sqlite3_stmt *
+yum_db_dependency_prepare (sqlite3 *db,
+                           const char *table,
+                           guint layout,
+                           GError **err)
+{
+    const char *columns[] = {
+        "name", "flags", "epoch", "version", "release", "pkgKey", "pre", NULL
+    };
 
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not prepare dependency insertion: %s",
-                     sqlite3_errmsg (db));
-        sqlite3_finalize (handle);
-        handle = NULL;
-    }
+    /* Only requires has the pre column */
+    if (strcmp (table, "requires"))
+        columns[6] = NULL;
 
-    return handle;
+    return table_insert_prepare (db, primary_tables, table, layout,
+                                 columns, "dependency", err);
 }
 
-void
+gboolean
 yum_db_dependency_write (sqlite3 *db,
                          sqlite3_stmt *handle,
                          gint64 pkgKey,
@@ -616,13 +4720,13 @@ yum_db_dependency_write (sqlite3 *db,
     sqlite3_bind_text (handle, 3, dep->epoch,   -1, SQLITE_STATIC);
     sqlite3_bind_text (handle, 4, dep->version, -1, SQLITE_STATIC);
     sqlite3_bind_text (handle, 5, dep->release, -1, SQLITE_STATIC);
-    sqlite3_bind_int  (handle, 6, pkgKey);
+    sqlite3_bind_int64 (handle, 6, pkgKey);
 
     if (isRequirement) {
         if (dep->pre)
-            sqlite3_bind_text (handle, 7, "TRUE", -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text (handle, 7, "TRUE", -1, SQLITE_STATIC);
         else
-            sqlite3_bind_text (handle, 7, "FALSE", -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text (handle, 7, "FALSE", -1, SQLITE_STATIC);
     }
 
     rc = sqlite3_step (handle);
@@ -631,31 +4735,20 @@ yum_db_dependency_write (sqlite3 *db,
     if (rc != SQLITE_DONE)
         g_critical ("Error adding dependency to SQL: %s",
                     sqlite3_errmsg (db));
+
+    return rc == SQLITE_DONE;
 }
 
 sqlite3_stmt *
-yum_db_file_prepare (sqlite3 *db, GError **err)
+yum_db_file_prepare (sqlite3 *db, guint layout, GError **err)
 {
-    int rc;
-    sqlite3_stmt *handle = NULL;
-    const char *query;
-
-    query = "INSERT INTO files (name, type, pkgKey) VALUES (?, ?, ?)";
-
-    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not prepare file insertion: %s",
-                     sqlite3_errmsg (db));
-        sqlite3_finalize (handle);
-        handle = NULL;
-    }
-
-    return handle;
+    const char *columns[] = { "name", "type", "pkgKey", NULL };
 
+    return table_insert_prepare (db, primary_tables, "files", layout,
+                                 columns, "file", err);
 }
 
-void
+gboolean
 yum_db_file_write (sqlite3 *db,
                    sqlite3_stmt *handle,
                    gint64 pkgKey,
@@ -663,9 +4756,9 @@ yum_db_file_write (sqlite3 *db,
 {
     int rc;
 
-    sqlite3_bind_text (handle, 1, file->name, -1, SQLITE_STATIC);
+    bind_text (handle, 1, file->name, file->name_len);
     sqlite3_bind_text (handle, 2, file->type, -1, SQLITE_STATIC);
-    sqlite3_bind_int  (handle, 3, pkgKey);
+    sqlite3_bind_int64 (handle, 3, pkgKey);
 
     rc = sqlite3_step (handle);
     sqlite3_reset (handle);
@@ -673,117 +4766,71 @@ yum_db_file_write (sqlite3 *db,
     if (rc != SQLITE_DONE)
         g_critical ("Error adding package file to SQL: %s",
                     sqlite3_errmsg (db));
+
+    return rc == SQLITE_DONE;
 }
 
 void
-yum_db_create_filelist_tables (sqlite3 *db, GError **err)
+yum_db_create_filelist_tables (sqlite3 *db, guint layout, GError **err)
 {
-    int rc;
-    const char *sql;
-
-    sql =
-        "CREATE TABLE packages ("
-        "  pkgKey INTEGER PRIMARY KEY,"
-        "  pkgId TEXT)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create packages table: %s",
-                     sqlite3_errmsg (db));
-        return;
-    }
-
-    sql =
-        "CREATE TABLE filelist ("
-        "  pkgKey INTEGER,"
-        "  dirname TEXT,"
-        "  filenames TEXT,"
-        "  filetypes TEXT)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create filelist table: %s",
-                     sqlite3_errmsg (db));
+    create_tables (db, filelist_tables, layout, err);
+    if (*err)
         return;
-    }
 
-    sql =
-        "CREATE TRIGGER remove_filelist AFTER DELETE ON packages"
-        "  BEGIN"
-        "    DELETE FROM filelist WHERE pkgKey = old.pkgKey;"
-        "  END;";
+    create_removal_trigger (db, filelist_tables, "remove_filelist",
+                            layout, err);
+}
 
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create remove_filelist trigger: %s",
-                     sqlite3_errmsg (db));
-        return;
-    }
+void
+yum_db_prune_filelist_tables (sqlite3 *db, guint layout, GError **err)
+{
+    prune_dictionaries (db, filelist_tables, layout, err);
 }
 
 void
-yum_db_index_filelist_tables (sqlite3 *db, GError **err)
+yum_db_index_filelist_tables (sqlite3 *db, guint layout, GError **err)
 {
-    int rc;
-    const char *sql;
+    const TableSpec *packages = table_find (filelist_tables, "packages");
+    const TableSpec *filelist = table_find (filelist_tables, "filelist");
 
-    sql = "CREATE INDEX IF NOT EXISTS keyfile ON filelist (pkgKey)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create keyfile index: %s",
-                     sqlite3_errmsg (db));
+    create_dictionary_indexes (db, filelist_tables, layout, err);
+    if (*err)
         return;
-    }
 
-    sql = "CREATE INDEX IF NOT EXISTS pkgId ON packages (pkgId)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create pkgId index: %s",
-                     sqlite3_errmsg (db));
+    create_index (db, "keyfile", filelist, "pkgKey", layout, err);
+    if (*err)
         return;
-    }
 
-    sql = "CREATE INDEX IF NOT EXISTS dirnames ON filelist (dirname)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create dirnames index: %s",
-                     sqlite3_errmsg (db));
+    create_index (db, "pkgId", packages, "pkgId", layout, err);
+    if (*err)
         return;
-    }
+
+    /* The dirnames layout has a dirnames table, indexes share its names */
+    create_index (db,
+                  layout & YUM_DB_LAYOUT_DIRNAMES ? "dirnameids" : "dirnames",
+                  filelist, "dirname", layout, err);
 }
 
+/* filelists.xml and other.xml only carry the package ids */
 sqlite3_stmt *
-yum_db_package_ids_prepare (sqlite3 *db, GError **err)
+yum_db_package_ids_prepare (sqlite3 *db, guint layout, GError **err)
 {
-    int rc;
-    sqlite3_stmt *handle = NULL;
-    const char *query;
-
-    query = "INSERT INTO packages (pkgId) VALUES (?)";
-    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not prepare package ids insertion: %s",
-                     sqlite3_errmsg (db));
-        sqlite3_finalize (handle);
-        handle = NULL;
-    }
+    const char *columns[] = { "pkgId", "pkgKey", NULL };
 
-    return handle;
+    return table_insert_prepare (db, filelist_tables, "packages", layout,
+                                 columns, "package ids", err);
 }
 
 void
-yum_db_package_ids_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
+yum_db_package_ids_write (sqlite3 *db,
+                          sqlite3_stmt *handle,
+                          guint layout,
+                          Package *p)
 {
     int rc;
 
-    sqlite3_bind_text (handle, 1,  p->pkgId, -1, SQLITE_STATIC);
-    rc = sqlite3_step (handle);
-    sqlite3_reset (handle);
+    bind_text (handle, 1, p->pkgId, p->pkgIdLen);
+    rc = package_key_insert (handle, 2, layout, p);
 
     if (rc != SQLITE_DONE) {
         g_critical ("Error adding package to SQL: %s",
@@ -793,179 +4840,293 @@ yum_db_package_ids_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
 }
 
 sqlite3_stmt *
-yum_db_filelists_prepare (sqlite3 *db, GError **err)
+yum_db_filelists_prepare (sqlite3 *db, guint layout, GError **err)
 {
-    int rc;
-    sqlite3_stmt *handle = NULL;
-    const char *query;
+    const char *columns[] = {
+        "pkgKey", "dirname", "filenames", "filetypes", NULL
+    };
 
-    query =
-        "INSERT INTO filelist (pkgKey, dirname, filenames, filetypes) "
-        " VALUES (?, ?, ?, ?)";
+    return table_insert_prepare (db, filelist_tables, "filelist", layout,
+                                 columns, "filelist", err);
+}
 
-    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not prepare filelist insertion: %s",
-                     sqlite3_errmsg (db));
-        sqlite3_finalize (handle);
-        handle = NULL;
-    }
+/* The filelist rows of a package are built without allocating per file:
+   paths are split in place, the entries sorted by directory and the
+   joined names and types appended to an arena which is reused for every
+   package. Splitting follows g_path_get_dirname() and
+   g_path_get_basename(). */
 
-    return handle;
-}
+typedef struct {
+    const char *dir;
+    gsize dir_len;
+    const char *name;
+    gsize name_len;
+    char type;
+    guint index;
+} FilelistEntry;
 
 typedef struct {
-    sqlite3 *db;
-    sqlite3_stmt *handle;
-    gint64 pkgKey;
-} FileWriteInfo;
+    const char *dir;
+    gsize dir_len;
+    gsize files;            /* Offsets into the arena */
+    gsize files_len;
+    gsize types;
+    gsize types_len;
+} FilelistRow;
+
+struct _YumDbFilelistEncoder {
+    GArray *entries;
+    GArray *rows;
+    GString *arena;
+};
+
+YumDbFilelistEncoder *
+yum_db_filelist_encoder_new (void)
+{
+    YumDbFilelistEncoder *enc;
+
+    enc = g_new0 (YumDbFilelistEncoder, 1);
+    enc->entries = g_array_new (FALSE, FALSE, sizeof (FilelistEntry));
+    enc->rows = g_array_new (FALSE, FALSE, sizeof (FilelistRow));
+    enc->arena = g_string_sized_new (FILELIST_ARENA_SIZE);
+
+    return enc;
+}
+
+void
+yum_db_filelist_encoder_free (YumDbFilelistEncoder *enc)
+{
+    g_array_free (enc->entries, TRUE);
+    g_array_free (enc->rows, TRUE);
+    g_string_free (enc->arena, TRUE);
+    g_free (enc);
+}
 
 static void
-write_file (gpointer key, gpointer value, gpointer user_data)
+filelist_entry_split (FilelistEntry *entry, const char *path, gsize len)
 {
-    EncodedPackageFile *file = (EncodedPackageFile *) value;
-    FileWriteInfo *info = (FileWriteInfo *) user_data;
-    int rc;
+    const char *slash;
+    gssize last;
+
+    /* Directory: everything before the last slash and the slashes
+       right in front of it */
+    slash = memrchr (path, '/', len);
+    if (!slash) {
+        entry->dir = ".";
+        entry->dir_len = 1;
+    } else {
+        while (slash > path && *slash == '/')
+            slash--;
+        entry->dir = path;
+        entry->dir_len = slash - path + 1;
+    }
 
-    sqlite3_bind_int  (info->handle, 1, info->pkgKey);
-    sqlite3_bind_text (info->handle, 2, (const char *) key, -1, SQLITE_STATIC);
-    sqlite3_bind_text (info->handle, 3, file->files->str, -1, SQLITE_STATIC);
-    sqlite3_bind_text (info->handle, 4, file->types->str, -1, SQLITE_STATIC);
+    /* Name: the last component, trailing slashes ignored */
+    if (len == 0) {
+        entry->name = ".";
+        entry->name_len = 1;
+        return;
+    }
 
-    rc = sqlite3_step (info->handle);
-    sqlite3_reset (info->handle);
+    last = len - 1;
+    while (last >= 0 && path[last] == '/')
+        last--;
 
-    if (rc != SQLITE_DONE) {
-        g_critical ("Error adding file to SQL: %s",
-                    sqlite3_errmsg (info->db));
+    if (last < 0) {
+        entry->name = "/";
+        entry->name_len = 1;
+        return;
     }
+
+    slash = memrchr (path, '/', last + 1);
+    entry->name = slash ? slash + 1 : path;
+    entry->name_len = path + last + 1 - entry->name;
+}
+
+static gint
+filelist_entry_compare (gconstpointer a, gconstpointer b)
+{
+    const FilelistEntry *x = (const FilelistEntry *) a;
+    const FilelistEntry *y = (const FilelistEntry *) b;
+    int cmp;
+
+    cmp = memcmp (x->dir, y->dir, MIN (x->dir_len, y->dir_len));
+    if (cmp)
+        return cmp;
+    if (x->dir_len != y->dir_len)
+        return x->dir_len < y->dir_len ? -1 : 1;
+
+    /* Keep the metadata order within a directory */
+    return x->index < y->index ? -1 : x->index > y->index;
 }
 
 void
-yum_db_filelists_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
+yum_db_filelist_encode (YumDbFilelistEncoder *enc, Package *p)
 {
-    GHashTable *hash;
-    FileWriteInfo info;
+    FilelistEntry *entries;
+    FilelistRow row;
+    GSList *iter;
+    guint i, j, k, n;
+
+    g_array_set_size (enc->entries, 0);
+    g_array_set_size (enc->rows, 0);
+    g_string_truncate (enc->arena, 0);
+
+    for (iter = p->files, n = 0; iter; iter = iter->next, n++) {
+        PackageFile *file = (PackageFile *) iter->data;
+        FilelistEntry entry;
+
+        filelist_entry_split (&entry, file->name,
+                              text_len (file->name, file->name_len));
+        entry.index = n;
+
+        if (!strcmp (file->type, "dir"))
+            entry.type = 'd';
+        else if (!strcmp (file->type, "file"))
+            entry.type = 'f';
+        else if (!strcmp (file->type, "ghost"))
+            entry.type = 'g';
+        else
+            entry.type = 0;
+
+        g_array_append_val (enc->entries, entry);
+    }
 
-    info.db = db;
-    info.handle = handle;
-    info.pkgKey = p->pkgKey;
+    g_array_sort (enc->entries, filelist_entry_compare);
+    entries = (FilelistEntry *) enc->entries->data;
 
-    hash = package_files_to_hash (p->files);
-    g_hash_table_foreach (hash, write_file, &info);
-    g_hash_table_destroy (hash);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && entries[j].dir_len == entries[i].dir_len &&
+                 !memcmp (entries[j].dir, entries[i].dir,
+                          entries[i].dir_len); j++)
+            ;
+
+        row.dir = entries[i].dir;
+        row.dir_len = entries[i].dir_len;
+
+        row.files = enc->arena->len;
+        for (k = i; k < j; k++) {
+            if (k > i)
+                g_string_append_c (enc->arena, '/');
+            g_string_append_len (enc->arena, entries[k].name,
+                                 entries[k].name_len);
+        }
+        row.files_len = enc->arena->len - row.files;
+
+        row.types = enc->arena->len;
+        for (k = i; k < j; k++) {
+            if (entries[k].type)
+                g_string_append_c (enc->arena, entries[k].type);
+        }
+        row.types_len = enc->arena->len - row.types;
+
+        g_array_append_val (enc->rows, row);
+    }
 }
 
+/* Writes the rows of the last encoded package */
 void
-yum_db_create_other_tables (sqlite3 *db, GError **err)
+yum_db_filelists_write (sqlite3 *db,
+                        sqlite3_stmt *handle,
+                        YumDbFilelistEncoder *enc,
+                        gint64 pkgKey)
 {
+    guint i;
     int rc;
-    const char *sql;
 
-    sql =
-        "CREATE TABLE packages ("
-        "  pkgKey INTEGER PRIMARY KEY,"
-        "  pkgId TEXT)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create packages table: %s",
-                     sqlite3_errmsg (db));
-        return;
+    for (i = 0; i < enc->rows->len; i++) {
+        FilelistRow *row = &g_array_index (enc->rows, FilelistRow, i);
+
+        sqlite3_bind_int64 (handle, 1, pkgKey);
+        sqlite3_bind_text (handle, 2, row->dir, row->dir_len, SQLITE_STATIC);
+        sqlite3_bind_text (handle, 3, enc->arena->str + row->files,
+                           row->files_len, SQLITE_STATIC);
+        sqlite3_bind_text (handle, 4, enc->arena->str + row->types,
+                           row->types_len, SQLITE_STATIC);
+
+        rc = sqlite3_step (handle);
+        sqlite3_reset (handle);
+
+        if (rc != SQLITE_DONE) {
+            g_critical ("Error adding file to SQL: %s",
+                        sqlite3_errmsg (db));
+        }
     }
+}
 
-    sql =
-        "CREATE TABLE changelog ("
-        "  pkgKey INTEGER,"
-        "  author TEXT,"
-        "  date INTEGER,"
-        "  changelog TEXT)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create changelog table: %s",
-                     sqlite3_errmsg (db));
+void
+yum_db_create_other_tables (sqlite3 *db, guint layout, GError **err)
+{
+    create_tables (db, other_tables, layout, err);
+    if (*err)
         return;
-    }
 
-    sql =
-        "CREATE TRIGGER remove_changelogs AFTER DELETE ON packages"
-        "  BEGIN"
-        "    DELETE FROM changelog WHERE pkgKey = old.pkgKey;"
-        "  END;";
+    create_removal_trigger (db, other_tables, "remove_changelogs",
+                            layout, err);
+}
 
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create remove_changelogs trigger: %s",
-                     sqlite3_errmsg (db));
-        return;
-    }
+void
+yum_db_prune_other_tables (sqlite3 *db, guint layout, GError **err)
+{
+    prune_dictionaries (db, other_tables, layout, err);
 }
 
 void
-yum_db_index_other_tables (sqlite3 *db, GError **err)
+yum_db_index_other_tables (sqlite3 *db, guint layout, GError **err)
 {
-    int rc;
-    const char *sql;
+    const TableSpec *packages = table_find (other_tables, "packages");
+    const TableSpec *changelog = table_find (other_tables, "changelog");
 
-    sql = "CREATE INDEX IF NOT EXISTS keychange ON changelog (pkgKey)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create keychange index: %s",
-                     sqlite3_errmsg (db));
+    create_dictionary_indexes (db, other_tables, layout, err);
+    if (*err)
         return;
-    }
 
-    sql = "CREATE INDEX IF NOT EXISTS pkgId ON packages (pkgId)";
-    rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not create pkgId index: %s",
-                     sqlite3_errmsg (db));
+    create_index (db, "keychange", changelog,
+                  table_is_shared (changelog, layout) ? "setKey" : "pkgKey",
+                  layout, err);
+    if (*err)
         return;
+
+    if (table_is_shared (changelog, layout)) {
+        if (sqlite3_exec (db, "CREATE INDEX IF NOT EXISTS changelogsets "
+                          "ON package_changelogs (setKey)",
+                          NULL, NULL, NULL) != SQLITE_OK) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not create changelogsets index: %s",
+                         sqlite3_errmsg (db));
+            return;
+        }
     }
+
+    create_index (db, "pkgId", packages, "pkgId", layout, err);
 }
 
 sqlite3_stmt *
-yum_db_changelog_prepare (sqlite3 *db, GError **err)
+yum_db_changelog_prepare (sqlite3 *db, guint layout, GError **err)
 {
-    int rc;
-    sqlite3_stmt *handle = NULL;
-    const char *query;
+    const char *columns[] = {
+        "pkgKey", "author", "date", "changelog", NULL
+    };
 
-    query =
-        "INSERT INTO changelog (pkgKey, author, date, changelog) "
-        " VALUES (?, ?, ?, ?)";
-
-    rc = sqlite3_prepare (db, query, -1, &handle, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not prepare changelog insertion: %s",
-                     sqlite3_errmsg (db));
-        sqlite3_finalize (handle);
-        handle = NULL;
-    }
-
-    return handle;
+    return table_insert_prepare (db, other_tables, "changelog", layout,
+                                 columns, "changelog", err);
 }
 
-void
-yum_db_changelog_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
+static void
+changelog_entries_write (sqlite3 *db, sqlite3_stmt *handle, gint64 key,
+                         GSList *changelogs)
 {
     GSList *iter;
     ChangelogEntry *entry;
     int rc;
 
-    for (iter = p->changelogs; iter; iter = iter->next) {
+    for (iter = changelogs; iter; iter = iter->next) {
         entry = (ChangelogEntry *) iter->data;
 
-        sqlite3_bind_int  (handle, 1, p->pkgKey);
+        sqlite3_bind_int64 (handle, 1, key);
         sqlite3_bind_text (handle, 2, entry->author, -1, SQLITE_STATIC);
         sqlite3_bind_int  (handle, 3, entry->date);
-        sqlite3_bind_text (handle, 4, entry->changelog, -1, SQLITE_STATIC);
+        bind_text (handle, 4, entry->changelog, entry->changelog_len);
 
         rc = sqlite3_step (handle);
         sqlite3_reset (handle);
@@ -976,3 +5137,141 @@ yum_db_changelog_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
         }
     }
 }
+
+void
+yum_db_changelog_write (sqlite3 *db, sqlite3_stmt *handle, Package *p)
+{
+    changelog_entries_write (db, handle, p->pkgKey, p->changelogs);
+}
+
+/* Subpackages of one source rpm carry the same changelog, in the sets
+   layout it is stored once and found again by the SHA-256 of its
+   entries */
+
+struct _YumDbChangelogSets {
+    sqlite3_stmt *find_handle;
+    sqlite3_stmt *add_handle;
+    sqlite3_stmt *link_handle;
+    GChecksum *checksum;
+};
+
+YumDbChangelogSets *
+yum_db_changelog_sets_new (sqlite3 *db, GError **err)
+{
+    YumDbChangelogSets *sets;
+    const char *queries[] = {
+        "SELECT setKey FROM changelog_sets WHERE hash = ?",
+        "INSERT INTO changelog_sets (hash) VALUES (?)",
+        "INSERT INTO package_changelogs (pkgKey, setKey) VALUES (?, ?)"
+    };
+    sqlite3_stmt **handles[3];
+    int i;
+
+    sets = g_new0 (YumDbChangelogSets, 1);
+    sets->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    handles[0] = &sets->find_handle;
+    handles[1] = &sets->add_handle;
+    handles[2] = &sets->link_handle;
+
+    for (i = 0; i < 3; i++) {
+        if (sqlite3_prepare (db, queries[i], -1, handles[i],
+                             NULL) != SQLITE_OK) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not prepare changelog sets: %s",
+                         sqlite3_errmsg (db));
+            yum_db_changelog_sets_free (sets);
+            return NULL;
+        }
+    }
+
+    return sets;
+}
+
+void
+yum_db_changelog_sets_free (YumDbChangelogSets *sets)
+{
+    sqlite3_finalize (sets->find_handle);
+    sqlite3_finalize (sets->add_handle);
+    sqlite3_finalize (sets->link_handle);
+    g_checksum_free (sets->checksum);
+    g_free (sets);
+}
+
+static void
+changelog_sets_hash (YumDbChangelogSets *sets, GSList *changelogs,
+                     guint8 *digest, gsize *digest_len)
+{
+    GSList *iter;
+    char date[32];
+
+    g_checksum_reset (sets->checksum);
+
+    /* Every field ends with a NUL so that fields can not run together */
+    for (iter = changelogs; iter; iter = iter->next) {
+        ChangelogEntry *entry = (ChangelogEntry *) iter->data;
+
+        g_snprintf (date, sizeof (date), "%" G_GINT64_FORMAT, entry->date);
+        g_checksum_update (sets->checksum, (const guchar *) date,
+                           strlen (date) + 1);
+        if (entry->author)
+            g_checksum_update (sets->checksum, (const guchar *) entry->author,
+                               strlen (entry->author));
+        g_checksum_update (sets->checksum, (const guchar *) "", 1);
+        if (entry->changelog)
+            g_checksum_update (sets->checksum,
+                               (const guchar *) entry->changelog,
+                               text_len (entry->changelog,
+                                         entry->changelog_len));
+        g_checksum_update (sets->checksum, (const guchar *) "", 1);
+    }
+
+    g_checksum_get_digest (sets->checksum, digest, digest_len);
+}
+
+void
+yum_db_changelog_sets_write (YumDbChangelogSets *sets,
+                             sqlite3 *db,
+                             sqlite3_stmt *handle,
+                             Package *p)
+{
+    guint8 digest[32];
+    gsize digest_len = sizeof (digest);
+    gint64 setKey = 0;
+    int rc;
+
+    if (!p->changelogs)
+        return;
+
+    changelog_sets_hash (sets, p->changelogs, digest, &digest_len);
+
+    sqlite3_bind_blob (sets->find_handle, 1, digest, digest_len,
+                       SQLITE_STATIC);
+    if (sqlite3_step (sets->find_handle) == SQLITE_ROW)
+        setKey = sqlite3_column_int64 (sets->find_handle, 0);
+    sqlite3_reset (sets->find_handle);
+
+    if (!setKey) {
+        sqlite3_bind_blob (sets->add_handle, 1, digest, digest_len,
+                           SQLITE_STATIC);
+        rc = sqlite3_step (sets->add_handle);
+        sqlite3_reset (sets->add_handle);
+
+        if (rc != SQLITE_DONE) {
+            g_critical ("Error adding changelog set to SQL: %s",
+                        sqlite3_errmsg (db));
+            return;
+        }
+
+        setKey = sqlite3_last_insert_rowid (db);
+        changelog_entries_write (db, handle, setKey, p->changelogs);
+    }
+
+    sqlite3_bind_int64 (sets->link_handle, 1, p->pkgKey);
+    sqlite3_bind_int64 (sets->link_handle, 2, setKey);
+    rc = sqlite3_step (sets->link_handle);
+    sqlite3_reset (sets->link_handle);
+
+    if (rc != SQLITE_DONE)
+        g_critical ("Error adding package changelog to SQL: %s",
+                    sqlite3_errmsg (db));
+}
@@ -24,68 +24,250 @@
 
 #define YUM_SQLITE_CACHE_DBVERSION 10
 
+/* Additive schema changes within YUM_SQLITE_CACHE_DBVERSION, which yum
+   compares against the database_version in repomd.xml. Caches of an
+   older revision are upgraded in place, see db_migrations in db.c. */
+#define YUM_SQLITE_CACHE_REVISION 2
+
+/* Page size of deterministic builds, see yum_db_rewrite() */
+#define YUM_DB_PAGE_SIZE 4096
+
 #define YUM_DB_ERROR yum_db_error_quark()
 GQuark yum_db_error_quark (void);
 
-typedef void (*CreateTablesFn) (sqlite3 *db, GError **err);
+/* Optional storage layouts, recorded in db_info. Readers see the same
+   tables and columns whichever layout a cache was built with. */
+typedef enum {
+    YUM_DB_LAYOUT_DICT  = 1 << 0,   /* Repetitive strings interned */
+    YUM_DB_LAYOUT_TYPED = 1 << 1,   /* Integer flags and pre, binary pkgId */
+    YUM_DB_LAYOUT_PACKED_DEPS = 1 << 2, /* Dependencies in one row per package */
+    YUM_DB_LAYOUT_DIRNAMES = 1 << 3, /* Directories interned into dirnames */
+    YUM_DB_LAYOUT_COMPRESSED = 1 << 4, /* Changelogs compressed with zstd */
+    YUM_DB_LAYOUT_CHANGELOG_SETS = 1 << 5, /* Identical changelogs shared */
+    YUM_DB_LAYOUT_SPLIT = 1 << 6, /* Descriptive package columns apart */
+    YUM_DB_LAYOUT_STABLE_KEYS = 1 << 7, /* pkgKey derived from the pkgId */
+    YUM_DB_LAYOUT_PROVIDERS = 1 << 8 /* Requires resolved at build time */
+} YumDbLayout;
+
+typedef void (*CreateTablesFn) (sqlite3 *db, guint layout, GError **err);
+typedef void (*IndexTablesFn) (sqlite3 *db, guint layout, GError **err);
 
 char         *yum_db_filename               (const char *prefix);
+char         *yum_db_partial_filename       (const char *path);
+void          yum_db_copy                   (const char *src,
+                                             const char *dest,
+                                             GError **err);
 sqlite3      *yum_db_open                   (const char *path,
                                              const char *checksum,
+                                             guint layout,
+                                             const char *primary_checksum,
                                              CreateTablesFn create_tables,
+                                             IndexTablesFn index_tables,
                                              GError **err);
 
 void          yum_db_dbinfo_update          (sqlite3 *db,
                                              const char *checksum,
+                                             guint layout,
+                                             const char *primary_checksum,
                                              GError **err);
+char         *yum_db_dbinfo_checksum        (sqlite3 *db, GError **err);
+void          yum_db_checkpoint_create      (sqlite3 *db, GError **err);
+void          yum_db_checkpoint             (sqlite3 *db,
+                                             const char *checksum,
+                                             guint layout,
+                                             const char *primary_checksum,
+                                             GError **err);
+void          yum_db_rewrite                (const char *path, GError **err);
 
-GHashTable   *yum_db_read_package_ids       (sqlite3 *db, GError **err);
+gboolean      yum_db_current                (const char *path,
+                                             const char *checksum,
+                                             guint layout,
+                                             const char *primary_checksum);
+void          yum_db_import                 (const char *path,
+                                             const char *checksum,
+                                             CreateTablesFn create_tables,
+                                             IndexTablesFn index_tables,
+                                             GError **err);
+
+/* Row level deltas between two generations of a cache, see db.c */
+void          yum_db_delta_write            (const char *old_path,
+                                             const char *new_path,
+                                             const char *delta_path,
+                                             GError **err);
+void          yum_db_delta_apply            (const char *path,
+                                             const char *delta_path,
+                                             GError **err);
+
+PackageIdSet *yum_db_read_package_ids       (sqlite3 *db, GError **err);
+
+const char   *yum_db_table_storage          (const char *table, guint layout);
+
+int           yum_db_register_functions     (sqlite3 *db);
+
+void          yum_db_merge_shard            (sqlite3 *db,
+                                             const char *shard_path,
+                                             const char *table,
+                                             guint layout,
+                                             GError **err);
+
+void          yum_db_stage_table            (sqlite3 *db,
+                                             const char *table,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_cluster_table          (sqlite3 *db,
+                                             const char *table,
+                                             const char *key,
+                                             guint layout,
+                                             GError **err);
+
+/* String dictionaries for YUM_DB_LAYOUT_DICT and YUM_DB_LAYOUT_DIRNAMES */
+
+typedef enum {
+    YUM_DB_DICT_STRINGS,
+    YUM_DB_DICT_DIRNAMES,
+    YUM_DB_DICTS
+} YumDbDictionary;
+
+typedef struct _YumDbStrings YumDbStrings;
+
+YumDbStrings *yum_db_strings_new            (YumDbDictionary dictionary);
+void          yum_db_strings_attach         (YumDbStrings *strings,
+                                             sqlite3 *db,
+                                             GError **err);
+void          yum_db_strings_write          (YumDbStrings *strings,
+                                             sqlite3 *db,
+                                             GError **err);
+void          yum_db_strings_share          (YumDbStrings *strings,
+                                             sqlite3 *db);
+void          yum_db_strings_free           (YumDbStrings *strings);
+
+/* Changelog compression for YUM_DB_LAYOUT_COMPRESSED. The changelogs are
+   staged, a dictionary is trained from them and they are compressed as
+   yum_db_cluster_table() copies them over. */
+
+typedef struct _YumDbCompressor YumDbCompressor;
+
+YumDbCompressor *yum_db_compressor_new      (void);
+void          yum_db_compressor_train       (YumDbCompressor *compressor,
+                                             sqlite3 *db,
+                                             const char *table,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_compressor_free        (YumDbCompressor *compressor);
 
 /* Primary */
 
-void          yum_db_create_primary_tables  (sqlite3 *db, GError **err);
-void          yum_db_index_primary_tables   (sqlite3 *db, GError **err);
-sqlite3_stmt *yum_db_package_prepare        (sqlite3 *db, GError **err);
+void          yum_db_create_primary_tables  (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_index_primary_tables   (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_prune_primary_tables   (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_resolve_requires       (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+sqlite3_stmt *yum_db_package_prepare        (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
 void          yum_db_package_write          (sqlite3 *db,
                                              sqlite3_stmt *handle,
+                                             guint layout,
+                                             Package *p);
+sqlite3_stmt *yum_db_package_detail_prepare (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_package_detail_write   (sqlite3 *db,
+                                             sqlite3_stmt *handle,
+                                             guint layout,
                                              Package *p);
 
 sqlite3_stmt *yum_db_dependency_prepare     (sqlite3 *db,
                                              const char *table,
+                                             guint layout,
                                              GError **err);
-void          yum_db_dependency_write       (sqlite3 *db,
+gboolean      yum_db_dependency_write       (sqlite3 *db,
                                              sqlite3_stmt *handle,
                                              gint64 pkgKey,
                                              Dependency *dep,
                                              gboolean isRequirement);
 
-sqlite3_stmt *yum_db_file_prepare           (sqlite3 *db, GError **err);
-void          yum_db_file_write             (sqlite3 *db,
+sqlite3_stmt *yum_db_package_deps_prepare    (sqlite3 *db, GError **err);
+void          yum_db_package_deps_write     (sqlite3 *db,
+                                             sqlite3_stmt *handle,
+                                             Package *p);
+
+sqlite3_stmt *yum_db_file_prepare           (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+gboolean      yum_db_file_write             (sqlite3 *db,
                                              sqlite3_stmt *handle,
                                              gint64 pkgKey,
                                              PackageFile *file);
 
 /* Filelists */
 
-void          yum_db_create_filelist_tables (sqlite3 *db, GError **err);
-void          yum_db_index_filelist_tables  (sqlite3 *db, GError **err);
-sqlite3_stmt *yum_db_package_ids_prepare    (sqlite3 *db, GError **err);
+void          yum_db_create_filelist_tables (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_index_filelist_tables  (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_prune_filelist_tables  (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+sqlite3_stmt *yum_db_package_ids_prepare    (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
 void          yum_db_package_ids_write      (sqlite3 *db,
                                              sqlite3_stmt *handle,
+                                             guint layout,
+                                             Package *p);
+
+typedef struct _YumDbFilelistEncoder YumDbFilelistEncoder;
+
+YumDbFilelistEncoder *yum_db_filelist_encoder_new  (void);
+void          yum_db_filelist_encoder_free  (YumDbFilelistEncoder *enc);
+void          yum_db_filelist_encode        (YumDbFilelistEncoder *enc,
                                              Package *p);
 
-sqlite3_stmt *yum_db_filelists_prepare      (sqlite3 *db, GError **err);
+sqlite3_stmt *yum_db_filelists_prepare      (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
 void          yum_db_filelists_write        (sqlite3 *db,
                                              sqlite3_stmt *handle,
-                                             Package *p);
+                                             YumDbFilelistEncoder *enc,
+                                             gint64 pkgKey);
 
 /* Other */
-void          yum_db_create_other_tables    (sqlite3 *db, GError **err);
-void          yum_db_index_other_tables     (sqlite3 *db, GError **err);
-sqlite3_stmt *yum_db_changelog_prepare      (sqlite3 *db, GError **err);
+void          yum_db_create_other_tables    (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_index_other_tables     (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+void          yum_db_prune_other_tables     (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
+sqlite3_stmt *yum_db_changelog_prepare      (sqlite3 *db,
+                                             guint layout,
+                                             GError **err);
 void          yum_db_changelog_write        (sqlite3 *db,
                                              sqlite3_stmt *handle,
                                              Package *p);
 
+/* Changelog sets for YUM_DB_LAYOUT_CHANGELOG_SETS */
+
+typedef struct _YumDbChangelogSets YumDbChangelogSets;
+
+YumDbChangelogSets *yum_db_changelog_sets_new (sqlite3 *db, GError **err);
+void          yum_db_changelog_sets_write   (YumDbChangelogSets *sets,
+                                             sqlite3 *db,
+                                             sqlite3_stmt *handle,
+                                             Package *p);
+void          yum_db_changelog_sets_free    (YumDbChangelogSets *sets);
+
 
 #endif /* __YUM_DB_H__ */
@@ -0,0 +1,389 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+
+#define DECOMPRESS_BUFFER_SIZE (128 * 1024)
+
+GQuark
+yum_decompress_error_quark (void)
+{
+    static GQuark quark;
+
+    if (!quark)
+        quark = g_quark_from_static_string ("yum_decompress_error");
+
+    return quark;
+}
+
+typedef enum {
+    FORMAT_PLAIN,
+    FORMAT_GZIP,
+    FORMAT_BZIP2,
+    FORMAT_XZ,
+    FORMAT_ZSTD
+} Format;
+
+static const struct {
+    Format format;
+    const char *name;
+    const char *magic;
+    gsize magic_len;
+} formats[] = {
+    { FORMAT_GZIP,  "gzip",  "\x1f\x8b", 2 },
+    { FORMAT_BZIP2, "bzip2", "BZh", 3 },
+    { FORMAT_XZ,    "xz",    "\xfd" "7zXZ\0", 6 },
+    { FORMAT_ZSTD,  "zstd",  "\x28\xb5\x2f\xfd", 4 },
+    { FORMAT_PLAIN, NULL, NULL, 0 }
+};
+
+/* Every decoder reads in from start to end and writes to out, the
+   buffers are shared */
+typedef struct {
+    FILE *in;
+    FILE *out;
+    guchar *inbuf;
+    guchar *outbuf;
+    GError **err;
+} Stream;
+
+static gsize
+stream_read (Stream *s)
+{
+    gsize n = fread (s->inbuf, 1, DECOMPRESS_BUFFER_SIZE, s->in);
+
+    if (n == 0 && ferror (s->in))
+        g_set_error (s->err, YUM_DECOMPRESS_ERROR, YUM_DECOMPRESS_ERROR,
+                     "Can not read: %s", g_strerror (errno));
+
+    return n;
+}
+
+static gboolean
+stream_write (Stream *s, gsize len)
+{
+    if (len && fwrite (s->outbuf, 1, len, s->out) != len) {
+        g_set_error (s->err, YUM_DECOMPRESS_ERROR, YUM_DECOMPRESS_ERROR,
+                     "Can not write: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+stream_corrupt (Stream *s, const char *format_name)
+{
+    g_set_error (s->err, YUM_DECOMPRESS_ERROR, YUM_DECOMPRESS_ERROR,
+                 "Corrupt %s data", format_name);
+}
+
+static void
+decompress_plain (Stream *s)
+{
+    gsize n;
+
+    while ((n = stream_read (s)) > 0) {
+        memcpy (s->outbuf, s->inbuf, n);
+        if (!stream_write (s, n))
+            return;
+    }
+}
+
+#ifdef HAVE_ZLIB
+static void
+decompress_gzip (Stream *s)
+{
+    z_stream z;
+    int rc = Z_OK;
+    gboolean full = FALSE;
+
+    memset (&z, 0, sizeof (z));
+    /* 32 lets zlib take the gzip header */
+    if (inflateInit2 (&z, 15 + 32) != Z_OK) {
+        stream_corrupt (s, "gzip");
+        return;
+    }
+
+    while (!*s->err) {
+        /* A full buffer may leave output behind without taking input,
+           unless the stream just ended */
+        if (z.avail_in == 0 && (!full || rc == Z_STREAM_END)) {
+            z.avail_in = stream_read (s);
+            z.next_in = s->inbuf;
+            if (z.avail_in == 0)
+                break;
+        }
+
+        /* Concatenated members follow one another */
+        if (rc == Z_STREAM_END && z.avail_in > 0)
+            inflateReset (&z);
+
+        z.next_out = s->outbuf;
+        z.avail_out = DECOMPRESS_BUFFER_SIZE;
+        rc = inflate (&z, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            stream_corrupt (s, "gzip");
+            break;
+        }
+
+        full = z.avail_out == 0;
+        stream_write (s, DECOMPRESS_BUFFER_SIZE - z.avail_out);
+    }
+
+    if (!*s->err && rc != Z_STREAM_END)
+        stream_corrupt (s, "gzip");
+
+    inflateEnd (&z);
+}
+#endif
+
+#ifdef HAVE_BZIP2
+static void
+decompress_bzip2 (Stream *s)
+{
+    bz_stream bz;
+    int rc = BZ_OK;
+    gboolean full = FALSE;
+
+    memset (&bz, 0, sizeof (bz));
+    if (BZ2_bzDecompressInit (&bz, 0, 0) != BZ_OK) {
+        stream_corrupt (s, "bzip2");
+        return;
+    }
+
+    while (!*s->err) {
+        if (bz.avail_in == 0 && (!full || rc == BZ_STREAM_END)) {
+            bz.avail_in = stream_read (s);
+            bz.next_in = (char *) s->inbuf;
+            if (bz.avail_in == 0)
+                break;
+        }
+
+        /* Concatenated streams, as pbzip2 writes them */
+        if (rc == BZ_STREAM_END && bz.avail_in > 0) {
+            char *next_in = bz.next_in;
+            unsigned int avail_in = bz.avail_in;
+
+            BZ2_bzDecompressEnd (&bz);
+            memset (&bz, 0, sizeof (bz));
+            BZ2_bzDecompressInit (&bz, 0, 0);
+            bz.next_in = next_in;
+            bz.avail_in = avail_in;
+        }
+
+        bz.next_out = (char *) s->outbuf;
+        bz.avail_out = DECOMPRESS_BUFFER_SIZE;
+        rc = BZ2_bzDecompress (&bz);
+        if (rc != BZ_OK && rc != BZ_STREAM_END) {
+            stream_corrupt (s, "bzip2");
+            break;
+        }
+
+        full = bz.avail_out == 0;
+        stream_write (s, DECOMPRESS_BUFFER_SIZE - bz.avail_out);
+    }
+
+    if (!*s->err && rc != BZ_STREAM_END)
+        stream_corrupt (s, "bzip2");
+
+    BZ2_bzDecompressEnd (&bz);
+}
+#endif
+
+#ifdef HAVE_LZMA
+static void
+decompress_xz (Stream *s)
+{
+    lzma_stream xz = LZMA_STREAM_INIT;
+    lzma_action action = LZMA_RUN;
+    lzma_ret rc;
+
+    if (lzma_stream_decoder (&xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+        stream_corrupt (s, "xz");
+        return;
+    }
+
+    do {
+        if (xz.avail_in == 0 && action == LZMA_RUN) {
+            xz.avail_in = stream_read (s);
+            xz.next_in = s->inbuf;
+            if (xz.avail_in == 0)
+                action = LZMA_FINISH;
+            if (*s->err)
+                break;
+        }
+
+        xz.next_out = s->outbuf;
+        xz.avail_out = DECOMPRESS_BUFFER_SIZE;
+        rc = lzma_code (&xz, action);
+        if (rc != LZMA_OK && rc != LZMA_STREAM_END) {
+            stream_corrupt (s, "xz");
+            break;
+        }
+
+        if (!stream_write (s, DECOMPRESS_BUFFER_SIZE - xz.avail_out))
+            break;
+    } while (rc != LZMA_STREAM_END);
+
+    lzma_end (&xz);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void
+decompress_zstd (Stream *s)
+{
+    ZSTD_DStream *zs;
+    ZSTD_inBuffer in = { s->inbuf, 0, 0 };
+    size_t rc = 0;
+    gboolean full = FALSE;
+
+    zs = ZSTD_createDStream ();
+    ZSTD_initDStream (zs);
+
+    while (!*s->err) {
+        ZSTD_outBuffer out = { s->outbuf, DECOMPRESS_BUFFER_SIZE, 0 };
+
+        if (in.pos == in.size && (!full || rc == 0)) {
+            in.size = stream_read (s);
+            in.pos = 0;
+            if (in.size == 0)
+                break;
+        }
+
+        rc = ZSTD_decompressStream (zs, &out, &in);
+        if (ZSTD_isError (rc)) {
+            stream_corrupt (s, "zstd");
+            break;
+        }
+
+        full = out.pos == out.size;
+        stream_write (s, out.pos);
+    }
+
+    /* A frame left unfinished */
+    if (!*s->err && rc != 0)
+        stream_corrupt (s, "zstd");
+
+    ZSTD_freeDStream (zs);
+}
+#endif
+
+static Format
+detect_format (FILE *in, const char **name)
+{
+    guchar magic[8];
+    gsize n;
+    int i;
+
+    n = fread (magic, 1, sizeof (magic), in);
+    rewind (in);
+
+    for (i = 0; formats[i].name; i++) {
+        if (n >= formats[i].magic_len &&
+            !memcmp (magic, formats[i].magic, formats[i].magic_len)) {
+            *name = formats[i].name;
+            return formats[i].format;
+        }
+    }
+
+    *name = NULL;
+    return FORMAT_PLAIN;
+}
+
+void
+yum_decompress_file (const char *src, const char *dest, GError **err)
+{
+    Stream s;
+    const char *name;
+
+    memset (&s, 0, sizeof (s));
+    s.err = err;
+
+    s.in = fopen (src, "rb");
+    if (!s.in) {
+        g_set_error (err, YUM_DECOMPRESS_ERROR, YUM_DECOMPRESS_ERROR,
+                     "Can not open %s: %s", src, g_strerror (errno));
+        return;
+    }
+
+    s.out = fopen (dest, "wb");
+    if (!s.out) {
+        g_set_error (err, YUM_DECOMPRESS_ERROR, YUM_DECOMPRESS_ERROR,
+                     "Can not create %s: %s", dest, g_strerror (errno));
+        fclose (s.in);
+        return;
+    }
+
+    s.inbuf = g_malloc (DECOMPRESS_BUFFER_SIZE);
+    s.outbuf = g_malloc (DECOMPRESS_BUFFER_SIZE);
+
+    switch (detect_format (s.in, &name)) {
+    case FORMAT_PLAIN:
+        decompress_plain (&s);
+        break;
+#ifdef HAVE_ZLIB
+    case FORMAT_GZIP:
+        decompress_gzip (&s);
+        break;
+#endif
+#ifdef HAVE_BZIP2
+    case FORMAT_BZIP2:
+        decompress_bzip2 (&s);
+        break;
+#endif
+#ifdef HAVE_LZMA
+    case FORMAT_XZ:
+        decompress_xz (&s);
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case FORMAT_ZSTD:
+        decompress_zstd (&s);
+        break;
+#endif
+    default:
+        g_set_error (err, YUM_DECOMPRESS_ERROR, YUM_DECOMPRESS_ERROR,
+                     "%s: %s support is not built in", src, name);
+        break;
+    }
+
+    if (fclose (s.out) != 0 && !*err)
+        g_set_error (err, YUM_DECOMPRESS_ERROR, YUM_DECOMPRESS_ERROR,
+                     "Can not write %s: %s", dest, g_strerror (errno));
+    fclose (s.in);
+
+    g_free (s.inbuf);
+    g_free (s.outbuf);
+}
@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef __YUM_DECOMPRESS_H__
+#define __YUM_DECOMPRESS_H__
+
+#include <glib.h>
+
+#define YUM_DECOMPRESS_ERROR yum_decompress_error_quark()
+GQuark yum_decompress_error_quark (void);
+
+/* Streams src to dest, decompressing gzip, bzip2, xz or zstd as found
+   by the magic at the start of src. Anything else is copied as is. */
+void yum_decompress_file (const char *src,
+                          const char *dest,
+                          GError **err);
+
+#endif /* __YUM_DECOMPRESS_H__ */
@@ -0,0 +1,180 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* rpm compares versions segment by segment: runs of digits as numbers,
+   runs of letters as strings, anything else only separates them. '~'
+   sorts before everything, the end of the string included, '^' after
+   the end but before any segment, and a number beats letters.
+
+   The tokens below carry that order in their type, so comparing token
+   lists is rpmvercmp() and writing them out in order gives a key that
+   memcmp() sorts the same way. */
+
+#include <string.h>
+
+#include "evr.h"
+
+typedef enum {
+    TOKEN_TILDE  = 0x01,
+    TOKEN_END    = 0x02,
+    TOKEN_CARET  = 0x03,
+    TOKEN_ALPHA  = 0x04,
+    TOKEN_NUMBER = 0x05
+} TokenType;
+
+typedef struct {
+    const char *p;
+    const char *end;
+} Cursor;
+
+/* rpm's risalpha() and risdigit(), the locale does not matter */
+#define IS_ALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+static void
+cursor_init (Cursor *c, const char *s, gssize len)
+{
+    c->p = s ? s : "";
+    c->end = c->p + (len < 0 ? strlen (c->p) : (gsize) len);
+}
+
+/* Segments come back in seg and len, numbers without leading zeros */
+static TokenType
+cursor_next (Cursor *c, const char **seg, gsize *len)
+{
+    const char *start;
+
+    while (c->p < c->end && !IS_ALPHA (*c->p) && !IS_DIGIT (*c->p) &&
+           *c->p != '~' && *c->p != '^')
+        c->p++;
+
+    if (c->p == c->end)
+        return TOKEN_END;
+
+    if (*c->p == '~' || *c->p == '^')
+        return *c->p++ == '~' ? TOKEN_TILDE : TOKEN_CARET;
+
+    start = c->p;
+    if (IS_DIGIT (*c->p)) {
+        while (c->p < c->end && IS_DIGIT (*c->p))
+            c->p++;
+        while (start < c->p && *start == '0')
+            start++;
+        *seg = start;
+        *len = c->p - start;
+        return TOKEN_NUMBER;
+    }
+
+    while (c->p < c->end && IS_ALPHA (*c->p))
+        c->p++;
+    *seg = start;
+    *len = c->p - start;
+    return TOKEN_ALPHA;
+}
+
+int
+yum_evr_compare (const char *a, gssize a_len, const char *b, gssize b_len)
+{
+    Cursor ca, cb;
+    TokenType ta, tb;
+    const char *sa = NULL, *sb = NULL;
+    gsize la = 0, lb = 0;
+    int rc;
+
+    cursor_init (&ca, a, a_len);
+    cursor_init (&cb, b, b_len);
+
+    for (;;) {
+        ta = cursor_next (&ca, &sa, &la);
+        tb = cursor_next (&cb, &sb, &lb);
+
+        if (ta != tb)
+            return ta < tb ? -1 : 1;
+
+        switch (ta) {
+        case TOKEN_END:
+            return 0;
+        case TOKEN_NUMBER:
+            /* The longer number is the larger one */
+            if (la != lb)
+                return la < lb ? -1 : 1;
+            rc = memcmp (sa, sb, la);
+            break;
+        case TOKEN_ALPHA:
+            rc = memcmp (sa, sb, MIN (la, lb));
+            if (!rc && la != lb)
+                rc = la < lb ? -1 : 1;
+            break;
+        default:
+            rc = 0;
+            break;
+        }
+
+        if (rc)
+            return rc < 0 ? -1 : 1;
+    }
+}
+
+static void
+key_append (GString *key, const char *s)
+{
+    Cursor c;
+    TokenType type;
+    const char *seg;
+    gsize len;
+
+    cursor_init (&c, s, -1);
+
+    do {
+        type = cursor_next (&c, &seg, &len);
+        g_string_append_c (key, type);
+
+        switch (type) {
+        case TOKEN_NUMBER:
+            /* Length first, so that larger numbers sort later */
+            if (len < 0xff)
+                g_string_append_c (key, len);
+            else {
+                g_string_append_c (key, 0xff);
+                g_string_append_c (key, (len >> 24) & 0xff);
+                g_string_append_c (key, (len >> 16) & 0xff);
+                g_string_append_c (key, (len >> 8) & 0xff);
+                g_string_append_c (key, len & 0xff);
+            }
+            g_string_append_len (key, seg, len);
+            break;
+        case TOKEN_ALPHA:
+            /* Below any letter, a prefix sorts first */
+            g_string_append_len (key, seg, len);
+            g_string_append_c (key, '\0');
+            break;
+        default:
+            break;
+        }
+    } while (type != TOKEN_END);
+}
+
+void
+yum_evr_key (GString *key,
+             const char *epoch,
+             const char *version,
+             const char *release)
+{
+    key_append (key, epoch && *epoch ? epoch : "0");
+    key_append (key, version);
+    key_append (key, release);
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef __YUM_EVR_H__
+#define __YUM_EVR_H__
+
+#include <glib.h>
+
+/* rpmvercmp(), on strings of a given length, -1 for NUL terminated */
+int  yum_evr_compare (const char *a, gssize a_len,
+                      const char *b, gssize b_len);
+
+/* Appends a key to key which sorts byte by byte the way rpm sorts the
+   epoch, version and release. Missing epochs count as 0. */
+void yum_evr_key     (GString *key,
+                      const char *epoch,
+                      const char *version,
+                      const char *release);
+
+#endif /* __YUM_EVR_H__ */
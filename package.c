@@ -15,6 +15,10 @@
  * 02111-1307, USA.
  */
 
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "package.h"
 
 #define PACKAGE_CHUNK_SIZE 2048
@@ -56,13 +60,104 @@ package_new (void)
 
     package = g_new0 (Package, 1);
     package->chunk = g_string_chunk_new (PACKAGE_CHUNK_SIZE);
+    package->refcount = 1;
 
     return package;
 }
 
+Package *
+package_ref (Package *package)
+{
+    g_atomic_int_inc (&package->refcount);
+
+    return package;
+}
+
+static inline int
+hex_value (guchar c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+
+    return -1;
+}
+
+/* Decodes lowercase hex only, so the digest prints back unchanged.
+   Returns FALSE for anything else. */
+static gboolean
+hex_decode (const char *hex, gsize len, guchar *out)
+{
+    gsize i = 0;
+
+#ifdef __SSE2__
+    /* 16 characters into 8 bytes at a time */
+    const __m128i zero = _mm_setzero_si128 ();
+
+    for (; i + 16 <= len; i += 16, out += 8) {
+        __m128i v, digit, alpha, nibbles, words;
+
+        v = _mm_loadu_si128 ((const __m128i *) (hex + i));
+        digit = _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 ('0' - 1)),
+                               _mm_cmplt_epi8 (v, _mm_set1_epi8 ('9' + 1)));
+        alpha = _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 ('a' - 1)),
+                               _mm_cmplt_epi8 (v, _mm_set1_epi8 ('f' + 1)));
+
+        if (_mm_movemask_epi8 (_mm_or_si128 (digit, alpha)) != 0xffff)
+            return FALSE;
+
+        nibbles = _mm_or_si128
+            (_mm_and_si128 (digit, _mm_sub_epi8 (v, _mm_set1_epi8 ('0'))),
+             _mm_and_si128 (alpha, _mm_sub_epi8 (v, _mm_set1_epi8 ('a' - 10))));
+
+        /* Every 16 bit lane holds the high nibble in its low byte */
+        words = _mm_or_si128
+            (_mm_and_si128 (_mm_slli_epi16 (nibbles, 4),
+                            _mm_set1_epi16 (0x00f0)),
+             _mm_srli_epi16 (nibbles, 8));
+
+        _mm_storel_epi64 ((__m128i *) out, _mm_packus_epi16 (words, zero));
+    }
+#endif
+
+    for (; i + 2 <= len; i += 2) {
+        int hi = hex_value (hex[i]);
+        int lo = hex_value (hex[i + 1]);
+
+        if (hi < 0 || lo < 0)
+            return FALSE;
+
+        *out++ = (hi << 4) | lo;
+    }
+
+    return i == len;
+}
+
+/* The binary digest is used by the typed layout */
+void
+package_set_pkgid (Package *package, const char *pkgId, gssize len)
+{
+    if (len < 0)
+        len = strlen (pkgId);
+
+    package->pkgId = g_string_chunk_insert_len (package->chunk, pkgId, len);
+    package->pkgIdLen = len;
+
+    if (len > 0 && len <= PACKAGE_ID_BIN_MAX * 2 &&
+        hex_decode (pkgId, len, package->pkgIdBin))
+        package->pkgIdBinLen = len / 2;
+    else
+        package->pkgIdBinLen = 0;
+}
+
+/* Drops a reference, the package is freed with the last one. */
 void
 package_free (Package *package)
 {
+    if (!g_atomic_int_dec_and_test (&package->refcount))
+        return;
+
     g_string_chunk_free (package->chunk);
 
     if (package->requires) {
@@ -97,3 +192,299 @@ package_free (Package *package)
 
     g_free (package);
 }
+
+/* Package id sets. Digests are random already, so their first bytes
+   serve as the hash of an open addressing table with linear probing.
+   The digest width is taken from the first one inserted; other widths,
+   digests narrower than the four bytes hashed and ids which are not
+   lowercase hex go to a string hash table. */
+
+#define PACKAGE_ID_SET_MIN_SIZE 1024
+
+struct _PackageIdSet {
+    guint width;                /* Digest bytes, 0 until the first one */
+    guint size;                 /* Slots, a power of two */
+    guint count;
+    guchar *digests;
+    gint64 *values;
+    guchar *used;
+
+    GHashTable *others;         /* pkgId -> gint64 * */
+};
+
+PackageIdSet *
+package_id_set_new (void)
+{
+    PackageIdSet *set;
+
+    set = g_new0 (PackageIdSet, 1);
+    set->others = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, g_free);
+
+    return set;
+}
+
+void
+package_id_set_free (PackageIdSet *set)
+{
+    g_free (set->digests);
+    g_free (set->values);
+    g_free (set->used);
+    g_hash_table_destroy (set->others);
+    g_free (set);
+}
+
+guint
+package_id_set_size (PackageIdSet *set)
+{
+    return set->count + g_hash_table_size (set->others);
+}
+
+static inline guint
+id_set_slot (PackageIdSet *set, const guchar *digest)
+{
+    guint32 hash;
+
+    memcpy (&hash, digest, sizeof (hash));
+
+    return hash & (set->size - 1);
+}
+
+/* The slot holding digest, or the free slot it would go to */
+static guint
+id_set_find (PackageIdSet *set, const guchar *digest)
+{
+    guint i = id_set_slot (set, digest);
+
+    while (set->used[i] &&
+           memcmp (set->digests + (gsize) i * set->width, digest, set->width))
+        i = (i + 1) & (set->size - 1);
+
+    return i;
+}
+
+static void
+id_set_resize (PackageIdSet *set, guint size)
+{
+    guchar *digests = set->digests;
+    gint64 *values = set->values;
+    guchar *used = set->used;
+    guint old_size = set->size;
+    guint i;
+
+    set->size = size;
+    set->digests = g_malloc ((gsize) size * set->width);
+    set->values = g_new (gint64, size);
+    set->used = g_new0 (guchar, size);
+
+    for (i = 0; i < old_size; i++) {
+        const guchar *digest = digests + (gsize) i * set->width;
+        guint j;
+
+        if (!used[i])
+            continue;
+
+        j = id_set_find (set, digest);
+        memcpy (set->digests + (gsize) j * set->width, digest, set->width);
+        set->values[j] = values[i];
+        set->used[j] = 1;
+    }
+
+    g_free (digests);
+    g_free (values);
+    g_free (used);
+}
+
+static void
+id_set_insert_digest (PackageIdSet *set, const guchar *digest, gint64 value)
+{
+    guint i;
+
+    /* Kept at most three quarters full */
+    if ((set->count + 1) * 4 > set->size * 3)
+        id_set_resize (set, set->size ? set->size * 2
+                       : PACKAGE_ID_SET_MIN_SIZE);
+
+    i = id_set_find (set, digest);
+    if (!set->used[i]) {
+        memcpy (set->digests + (gsize) i * set->width, digest, set->width);
+        set->used[i] = 1;
+        set->count++;
+    }
+
+    set->values[i] = value;
+}
+
+static gboolean
+id_set_lookup_digest (PackageIdSet *set, const guchar *digest, gint64 *value)
+{
+    guint i;
+
+    if (!set->count)
+        return FALSE;
+
+    i = id_set_find (set, digest);
+    if (!set->used[i])
+        return FALSE;
+
+    if (value)
+        *value = set->values[i];
+
+    return TRUE;
+}
+
+static gboolean
+id_set_takes (PackageIdSet *set, guint width)
+{
+    if (width < sizeof (guint32))
+        return FALSE;
+
+    if (set->width == 0)
+        set->width = width;
+
+    return width == set->width;
+}
+
+static void
+id_set_insert_other (PackageIdSet *set, const char *pkgId, gsize len,
+                     gint64 value)
+{
+    gint64 *v = g_new (gint64, 1);
+
+    *v = value;
+    g_hash_table_insert (set->others, g_strndup (pkgId, len), v);
+}
+
+static gboolean
+id_set_lookup_other (PackageIdSet *set, const char *pkgId, gint64 *value)
+{
+    gint64 *v = g_hash_table_lookup (set->others, pkgId);
+
+    if (v && value)
+        *value = *v;
+
+    return v != NULL;
+}
+
+static guint
+id_decode (const char *pkgId, gsize len, guchar *digest)
+{
+    if (len > 0 && len % 2 == 0 && len <= PACKAGE_ID_BIN_MAX * 2 &&
+        hex_decode (pkgId, len, digest))
+        return len / 2;
+
+    return 0;
+}
+
+void
+package_id_set_insert (PackageIdSet *set, const char *pkgId, gssize len,
+                       gint64 value)
+{
+    guchar digest[PACKAGE_ID_BIN_MAX];
+
+    if (len < 0)
+        len = strlen (pkgId);
+
+    if (id_set_takes (set, id_decode (pkgId, len, digest)))
+        id_set_insert_digest (set, digest, value);
+    else
+        id_set_insert_other (set, pkgId, len, value);
+}
+
+void
+package_id_set_insert_package (PackageIdSet *set, Package *package,
+                               gint64 value)
+{
+    if (id_set_takes (set, package->pkgIdBinLen))
+        id_set_insert_digest (set, package->pkgIdBin, value);
+    else
+        id_set_insert_other (set, package->pkgId,
+                             strlen (package->pkgId), value);
+}
+
+gboolean
+package_id_set_lookup (PackageIdSet *set, const char *pkgId, gssize len,
+                       gint64 *value)
+{
+    guchar digest[PACKAGE_ID_BIN_MAX];
+    guint width;
+
+    if (len < 0)
+        len = strlen (pkgId);
+
+    width = id_decode (pkgId, len, digest);
+    if (width && width == set->width)
+        return id_set_lookup_digest (set, digest, value);
+
+    return id_set_lookup_other (set, pkgId, value);
+}
+
+gboolean
+package_id_set_lookup_package (PackageIdSet *set, Package *package,
+                               gint64 *value)
+{
+    if (package->pkgIdBinLen && package->pkgIdBinLen == set->width)
+        return id_set_lookup_digest (set, package->pkgIdBin, value);
+
+    return id_set_lookup_other (set, package->pkgId, value);
+}
+
+void
+package_id_set_foreach (PackageIdSet *set, PackageIdFn fn, gpointer data)
+{
+    GHashTableIter iter;
+    gpointer value;
+    guint i;
+
+    for (i = 0; i < set->size; i++) {
+        if (set->used[i])
+            fn (set->values[i], data);
+    }
+
+    g_hash_table_iter_init (&iter, set->others);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        fn (*(gint64 *) value, data);
+}
+
+/* Calls fn for every entry of set whose pkgId is not in other */
+void
+package_id_set_foreach_missing (PackageIdSet *set, PackageIdSet *other,
+                                PackageIdFn fn, gpointer data)
+{
+    static const char hex[] = "0123456789abcdef";
+    GHashTableIter iter;
+    gpointer key, value;
+    guint i, j;
+
+    for (i = 0; i < set->size; i++) {
+        const guchar *digest = set->digests + (gsize) i * set->width;
+        gboolean found;
+
+        if (!set->used[i])
+            continue;
+
+        if (set->width == other->width)
+            found = id_set_lookup_digest (other, digest, NULL);
+        else {
+            /* Another width can only be in the string table */
+            char pkgId[PACKAGE_ID_BIN_MAX * 2 + 1];
+
+            for (j = 0; j < set->width; j++) {
+                pkgId[j * 2] = hex[digest[j] >> 4];
+                pkgId[j * 2 + 1] = hex[digest[j] & 0xf];
+            }
+            pkgId[j * 2] = '\0';
+
+            found = id_set_lookup_other (other, pkgId, NULL);
+        }
+
+        if (!found)
+            fn (set->values[i], data);
+    }
+
+    g_hash_table_iter_init (&iter, set->others);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (!package_id_set_lookup (other, key, -1, NULL))
+            fn (*(gint64 *) value, data);
+    }
+}
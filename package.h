@@ -29,38 +29,60 @@ typedef struct {
     gboolean pre;
 } Dependency;
 
+/* Text taken from element content keeps its length in the matching _len
+   field, 0 if the text is missing or came from somewhere else */
+
 typedef struct {
     char *type;
     char *name;
+    gsize name_len;
 } PackageFile;
 
 typedef struct {
     char *author;
     gint64 date;
     char *changelog;
+    gsize changelog_len;
 } ChangelogEntry;
 
+/* Longest digest kept in binary, sha512 */
+#define PACKAGE_ID_BIN_MAX 64
+
 typedef struct {
     gint64 pkgKey;
     char *pkgId;
+    gsize pkgIdLen;
+    guchar pkgIdBin[PACKAGE_ID_BIN_MAX];
+    guint pkgIdBinLen;          /* 0 if pkgId is not a hex digest */
     char *name;
+    gsize name_len;
     char *arch;
+    gsize arch_len;
     char *version;
     char *epoch;
     char *release;
     char *summary;
+    gsize summary_len;
     char *description;
+    gsize description_len;
     char *url;
+    gsize url_len;
     gint64 time_file;
     gint64 time_build;
     char *rpm_license;
+    gsize rpm_license_len;
     char *rpm_vendor;
+    gsize rpm_vendor_len;
     char *rpm_group;
+    gsize rpm_group_len;
     char *rpm_buildhost;
+    gsize rpm_buildhost_len;
     char *rpm_sourcerpm;
+    gsize rpm_sourcerpm_len;
     gint64 rpm_header_start;
     gint64 rpm_header_end;
     char *rpm_packager;
+    gsize rpm_packager_len;
     gint64 size_package;
     gint64 size_installed;
     gint64 size_archive;
@@ -77,6 +99,7 @@ typedef struct {
     GSList *changelogs;
 
     GStringChunk *chunk;
+    gint refcount;
 } Package;
 
 typedef void (*PackageFn) (Package *pkg, gpointer data);
@@ -85,6 +108,42 @@ Dependency     *dependency_new      (void);
 PackageFile    *package_file_new    (void);
 ChangelogEntry *changelog_entry_new (void);
 Package        *package_new         (void);
+Package        *package_ref         (Package *package);
+void            package_set_pkgid   (Package *package,
+                                     const char *pkgId,
+                                     gssize len);
 void            package_free        (Package *package);
 
+/* Set of pkgIds, each with a value such as its pkgKey. Hex digests are
+   kept in binary in a flat table, anything else in a string table. */
+
+typedef struct _PackageIdSet PackageIdSet;
+
+typedef void (*PackageIdFn) (gint64 value, gpointer data);
+
+PackageIdSet   *package_id_set_new  (void);
+void            package_id_set_free (PackageIdSet *set);
+guint           package_id_set_size (PackageIdSet *set);
+void            package_id_set_insert (PackageIdSet *set,
+                                       const char *pkgId,
+                                       gssize len,
+                                       gint64 value);
+void            package_id_set_insert_package (PackageIdSet *set,
+                                               Package *package,
+                                               gint64 value);
+gboolean        package_id_set_lookup (PackageIdSet *set,
+                                       const char *pkgId,
+                                       gssize len,
+                                       gint64 *value);
+gboolean        package_id_set_lookup_package (PackageIdSet *set,
+                                               Package *package,
+                                               gint64 *value);
+void            package_id_set_foreach (PackageIdSet *set,
+                                        PackageIdFn fn,
+                                        gpointer data);
+void            package_id_set_foreach_missing (PackageIdSet *set,
+                                                PackageIdSet *other,
+                                                PackageIdFn fn,
+                                                gpointer data);
+
 #endif /* __YUM_PACKAGE_H__ */
@@ -0,0 +1,597 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* Batched lookups against finished caches. A Query holds one read only
+   connection to a primary cache, with the filelists cache attached when
+   there is one, and keeps its statements prepared between calls. Every
+   method takes a list of names and answers with a list of pkgKey tuples
+   in the same order, the SQL runs without the GIL. */
+
+#include <Python.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <sqlite3.h>
+
+#include "query.h"
+
+typedef enum {
+    QUERY_PROVIDES,
+    QUERY_REQUIRES,
+    QUERY_CONFLICTS,
+    QUERY_OBSOLETES,
+    QUERY_FILES,
+    QUERY_FILELIST,
+    QUERY_STATEMENTS
+} QueryStatement;
+
+/* The views read the same in every layout */
+static const char *query_sql[QUERY_STATEMENTS] = {
+    "SELECT pkgKey FROM main.provides WHERE name = ?",
+    "SELECT pkgKey FROM main.requires WHERE name = ?",
+    "SELECT pkgKey FROM main.conflicts WHERE name = ?",
+    "SELECT pkgKey FROM main.obsoletes WHERE name = ?",
+    "SELECT pkgKey FROM main.files WHERE name = ?",
+    "SELECT pkgKey, filenames FROM fl.filelist WHERE dirname = ?"
+};
+
+/* A filelists pkgKey and the primary one of the same package */
+typedef struct {
+    gint64 filelist;
+    gint64 primary;
+} KeyPair;
+
+typedef struct {
+    PyObject_HEAD
+    sqlite3 *db;
+    gboolean filelists;
+    gboolean busy;
+    sqlite3_stmt *statements[QUERY_STATEMENTS];
+    GArray *keys;                  /* KeyPairs by filelist key */
+} Query;
+
+/* One lookup of a batch */
+typedef struct {
+    const char *name;
+    GArray *pkgKeys;
+} QueryItem;
+
+/* sqlite takes URI filenames percent encoded */
+static char *
+query_uri (const char *path)
+{
+    GString *uri;
+
+    uri = g_string_new ("file:");
+    for (; *path; path++) {
+        if (*path == '%' || *path == '?' || *path == '#')
+            g_string_append_printf (uri, "%%%02X", (guchar) *path);
+        else
+            g_string_append_c (uri, *path);
+    }
+    g_string_append (uri, "?mode=ro&immutable=1");
+
+    return g_string_free (uri, FALSE);
+}
+
+static void
+query_set_error (Query *self, const char *what)
+{
+    PyErr_Format (PyExc_TypeError, "Can not %s: %s", what,
+                  sqlite3_errmsg (self->db));
+}
+
+static void
+query_finalize (Query *self)
+{
+    int i;
+
+    for (i = 0; i < QUERY_STATEMENTS; i++) {
+        if (self->statements[i]) {
+            sqlite3_finalize (self->statements[i]);
+            self->statements[i] = NULL;
+        }
+    }
+
+    if (self->keys) {
+        g_array_free (self->keys, TRUE);
+        self->keys = NULL;
+    }
+
+    if (self->db) {
+        sqlite3_close (self->db);
+        self->db = NULL;
+    }
+}
+
+/* Prepared once per connection */
+static sqlite3_stmt *
+query_statement (Query *self, QueryStatement statement)
+{
+    int rc;
+
+    if (!self->statements[statement]) {
+        rc = sqlite3_prepare_v2 (self->db, query_sql[statement], -1,
+                                 &self->statements[statement], NULL);
+        if (rc != SQLITE_OK) {
+            query_set_error (self, "prepare query");
+            return NULL;
+        }
+    }
+
+    return self->statements[statement];
+}
+
+static int
+key_pair_cmp (gconstpointer a, gconstpointer b)
+{
+    gint64 x = ((const KeyPair *) a)->filelist;
+    gint64 y = ((const KeyPair *) b)->filelist;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+pkg_key_cmp (gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *) a;
+    gint64 y = *(const gint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* The two caches number their packages apart, they share the pkgId.
+   Called without the GIL. */
+static gboolean
+query_map_keys (Query *self)
+{
+    GHashTable *ids;
+    GArray *primary;
+    sqlite3_stmt *handle = NULL;
+    gboolean ok = FALSE;
+    gint64 key;
+    int rc;
+
+    ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    primary = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    rc = sqlite3_prepare_v2 (self->db,
+                             "SELECT pkgKey, pkgId FROM main.packages",
+                             -1, &handle, NULL);
+    if (rc != SQLITE_OK)
+        goto out;
+
+    while ((rc = sqlite3_step (handle)) == SQLITE_ROW) {
+        key = sqlite3_column_int64 (handle, 0);
+        g_array_append_val (primary, key);
+        g_hash_table_insert (ids,
+                             g_strdup ((const char *)
+                                       sqlite3_column_text (handle, 1)),
+                             GUINT_TO_POINTER (primary->len));
+    }
+    sqlite3_finalize (handle);
+    handle = NULL;
+    if (rc != SQLITE_DONE)
+        goto out;
+
+    rc = sqlite3_prepare_v2 (self->db,
+                             "SELECT pkgKey, pkgId FROM fl.packages",
+                             -1, &handle, NULL);
+    if (rc != SQLITE_OK)
+        goto out;
+
+    self->keys = g_array_new (FALSE, FALSE, sizeof (KeyPair));
+    while ((rc = sqlite3_step (handle)) == SQLITE_ROW) {
+        KeyPair pair;
+        guint index;
+
+        index = GPOINTER_TO_UINT
+            (g_hash_table_lookup (ids, sqlite3_column_text (handle, 1)));
+        if (!index)
+            continue;
+
+        pair.filelist = sqlite3_column_int64 (handle, 0);
+        pair.primary = g_array_index (primary, gint64, index - 1);
+        g_array_append_val (self->keys, pair);
+    }
+    g_array_sort (self->keys, key_pair_cmp);
+    ok = rc == SQLITE_DONE;
+
+ out:
+    if (handle)
+        sqlite3_finalize (handle);
+    g_hash_table_destroy (ids);
+    g_array_free (primary, TRUE);
+
+    if (!ok && self->keys) {
+        g_array_free (self->keys, TRUE);
+        self->keys = NULL;
+    }
+
+    return ok;
+}
+
+static gboolean
+query_collect (sqlite3_stmt *handle, const char *name, GArray *pkgKeys)
+{
+    gint64 key;
+    int rc;
+
+    sqlite3_bind_text (handle, 1, name, -1, SQLITE_STATIC);
+    while ((rc = sqlite3_step (handle)) == SQLITE_ROW) {
+        key = sqlite3_column_int64 (handle, 0);
+        g_array_append_val (pkgKeys, key);
+    }
+    sqlite3_reset (handle);
+
+    return rc == SQLITE_DONE;
+}
+
+static gboolean
+filenames_contain (const char *filenames, const char *name, gsize len)
+{
+    const char *p = filenames;
+    const char *end;
+
+    while (p && *p) {
+        end = strchr (p, '/');
+        if ((end ? (gsize) (end - p) : strlen (p)) == len &&
+            !strncmp (p, name, len))
+            return TRUE;
+        p = end ? end + 1 : NULL;
+    }
+
+    return FALSE;
+}
+
+/* Owners listed in filelists, beyond the files primary carries */
+static gboolean
+query_collect_filelist (Query *self, sqlite3_stmt *handle, const char *path,
+                        GArray *pkgKeys)
+{
+    const char *slash;
+    const char *name;
+    char *dir;
+    int rc;
+
+    /* Split the way the filelists were written */
+    slash = strrchr (path, '/');
+    if (!slash || !slash[1])
+        return TRUE;
+
+    name = slash + 1;
+    while (slash > path && *slash == '/')
+        slash--;
+    dir = g_strndup (path, slash - path + 1);
+
+    sqlite3_bind_text (handle, 1, dir, -1, SQLITE_STATIC);
+    while ((rc = sqlite3_step (handle)) == SQLITE_ROW) {
+        KeyPair pair;
+        KeyPair *found;
+
+        if (!filenames_contain ((const char *) sqlite3_column_text (handle, 1),
+                                name, strlen (name)))
+            continue;
+
+        pair.filelist = sqlite3_column_int64 (handle, 0);
+        found = bsearch (&pair, self->keys->data, self->keys->len,
+                         sizeof (KeyPair), key_pair_cmp);
+        if (found)
+            g_array_append_val (pkgKeys, found->primary);
+    }
+    sqlite3_reset (handle);
+    g_free (dir);
+
+    return rc == SQLITE_DONE;
+}
+
+static PyObject *
+query_results (QueryItem *items, Py_ssize_t n)
+{
+    PyObject *list;
+    PyObject *keys;
+    Py_ssize_t i;
+    guint j, len;
+
+    list = PyList_New (n);
+    if (!list)
+        return NULL;
+
+    for (i = 0; i < n; i++) {
+        GArray *pkgKeys = items[i].pkgKeys;
+
+        /* Sorted, every package once */
+        g_array_sort (pkgKeys, pkg_key_cmp);
+        for (j = 0, len = 0; j < pkgKeys->len; j++) {
+            if (len && g_array_index (pkgKeys, gint64, len - 1) ==
+                g_array_index (pkgKeys, gint64, j))
+                continue;
+            g_array_index (pkgKeys, gint64, len++) =
+                g_array_index (pkgKeys, gint64, j);
+        }
+
+        keys = PyTuple_New (len);
+        if (!keys) {
+            Py_DECREF (list);
+            return NULL;
+        }
+        for (j = 0; j < len; j++)
+            PyTuple_SET_ITEM (keys, j, PyLong_FromLongLong
+                              (g_array_index (pkgKeys, gint64, j)));
+        PyList_SET_ITEM (list, i, keys);
+    }
+
+    return list;
+}
+
+static PyObject *
+query_run (Query *self, PyObject *args, QueryStatement statement)
+{
+    PyObject *names;
+    PyObject *seq;
+    PyObject *result = NULL;
+    QueryItem *items;
+    sqlite3_stmt *handles[2] = { NULL, NULL };
+    Py_ssize_t n, i;
+    gboolean ok = TRUE;
+    const char *failed = NULL;
+
+    if (!PyArg_ParseTuple (args, "O", &names))
+        return NULL;
+
+    if (!self->db) {
+        PyErr_SetString (PyExc_TypeError, "Query is closed");
+        return NULL;
+    }
+    if (self->busy) {
+        PyErr_SetString (PyExc_TypeError,
+                         "Query is in use by another thread");
+        return NULL;
+    }
+
+    handles[0] = query_statement (self, statement);
+    if (!handles[0])
+        return NULL;
+    if (statement == QUERY_FILES && self->filelists) {
+        handles[1] = query_statement (self, QUERY_FILELIST);
+        if (!handles[1])
+            return NULL;
+    }
+
+    seq = PySequence_Fast (names, "names must be a sequence of strings");
+    if (!seq)
+        return NULL;
+
+    n = PySequence_Fast_GET_SIZE (seq);
+    items = g_new0 (QueryItem, n);
+    for (i = 0; i < n; i++) {
+        items[i].name = PyString_AsString (PySequence_Fast_GET_ITEM (seq, i));
+        if (!items[i].name)
+            goto out;
+        items[i].pkgKeys = g_array_new (FALSE, FALSE, sizeof (gint64));
+    }
+
+    /* seq keeps the names alive */
+    self->busy = TRUE;
+    Py_BEGIN_ALLOW_THREADS
+
+    if (handles[1] && !self->keys && !query_map_keys (self)) {
+        ok = FALSE;
+        failed = "map filelists packages";
+    }
+
+    for (i = 0; ok && i < n; i++) {
+        ok = query_collect (handles[0], items[i].name, items[i].pkgKeys);
+        if (ok && handles[1])
+            ok = query_collect_filelist (self, handles[1], items[i].name,
+                                         items[i].pkgKeys);
+        if (!ok)
+            failed = "run query";
+    }
+
+    Py_END_ALLOW_THREADS
+    self->busy = FALSE;
+
+    if (ok)
+        result = query_results (items, n);
+    else
+        query_set_error (self, failed);
+
+ out:
+    for (i = 0; i < n; i++) {
+        if (items[i].pkgKeys)
+            g_array_free (items[i].pkgKeys, TRUE);
+    }
+    g_free (items);
+    Py_DECREF (seq);
+
+    return result;
+}
+
+static PyObject *
+query_whatprovides (Query *self, PyObject *args)
+{
+    return query_run (self, args, QUERY_PROVIDES);
+}
+
+static PyObject *
+query_whatrequires (Query *self, PyObject *args)
+{
+    return query_run (self, args, QUERY_REQUIRES);
+}
+
+static PyObject *
+query_whatconflicts (Query *self, PyObject *args)
+{
+    return query_run (self, args, QUERY_CONFLICTS);
+}
+
+static PyObject *
+query_whatobsoletes (Query *self, PyObject *args)
+{
+    return query_run (self, args, QUERY_OBSOLETES);
+}
+
+static PyObject *
+query_fileowners (Query *self, PyObject *args)
+{
+    return query_run (self, args, QUERY_FILES);
+}
+
+static PyObject *
+query_close (Query *self, PyObject *args)
+{
+    if (self->busy) {
+        PyErr_SetString (PyExc_TypeError,
+                         "Query is in use by another thread");
+        return NULL;
+    }
+
+    query_finalize (self);
+    Py_RETURN_NONE;
+}
+
+static int
+query_init (Query *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "primary", "filelists", NULL };
+    const char *primary;
+    const char *filelists = NULL;
+    char *uri;
+    sqlite3_stmt *handle;
+    int rc;
+
+    if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|z", kwlist,
+                                      &primary, &filelists))
+        return -1;
+
+    /* __init__ can be called again, not while another thread runs a
+       lookup on the database it would close */
+    if (self->busy) {
+        PyErr_SetString (PyExc_TypeError,
+                         "Query is in use by another thread");
+        return -1;
+    }
+
+    query_finalize (self);
+
+    uri = query_uri (primary);
+    rc = sqlite3_open_v2 (uri, &self->db,
+                          SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+    g_free (uri);
+    if (rc != SQLITE_OK) {
+        query_set_error (self, "open primary cache");
+        query_finalize (self);
+        return -1;
+    }
+
+    self->filelists = filelists != NULL;
+    if (!self->filelists)
+        return 0;
+
+    rc = sqlite3_prepare_v2 (self->db, "ATTACH DATABASE ? AS fl",
+                             -1, &handle, NULL);
+    if (rc == SQLITE_OK) {
+        uri = query_uri (filelists);
+        sqlite3_bind_text (handle, 1, uri, -1, g_free);
+        rc = sqlite3_step (handle);
+        sqlite3_finalize (handle);
+    }
+    if (rc != SQLITE_DONE && rc != SQLITE_OK) {
+        query_set_error (self, "attach filelists cache");
+        query_finalize (self);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+query_dealloc (Query *self)
+{
+    query_finalize (self);
+    self->ob_type->tp_free ((PyObject *) self);
+}
+
+static PyMethodDef query_methods[] = {
+    {"whatprovides", (PyCFunction) query_whatprovides, METH_VARARGS,
+     "pkgKeys of the packages providing each name."},
+    {"whatrequires", (PyCFunction) query_whatrequires, METH_VARARGS,
+     "pkgKeys of the packages requiring each name."},
+    {"whatconflicts", (PyCFunction) query_whatconflicts, METH_VARARGS,
+     "pkgKeys of the packages conflicting with each name."},
+    {"whatobsoletes", (PyCFunction) query_whatobsoletes, METH_VARARGS,
+     "pkgKeys of the packages obsoleting each name."},
+    {"fileowners", (PyCFunction) query_fileowners, METH_VARARGS,
+     "pkgKeys of the packages owning each path."},
+    {"close", (PyCFunction) query_close, METH_NOARGS,
+     "Close the caches."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject QueryType = {
+    PyObject_HEAD_INIT (NULL)
+    0,                              /* ob_size */
+    "_sqlitecache.Query",           /* tp_name */
+    sizeof (Query),                 /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor) query_dealloc,     /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "Query(primary, filelists=None): batched lookups in finished caches, "
+    "see README.",                  /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    query_methods,                  /* tp_methods */
+    0,                              /* tp_members */
+    0,                              /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    (initproc) query_init,          /* tp_init */
+    0,                              /* tp_alloc */
+    PyType_GenericNew,              /* tp_new */
+};
+
+void
+yum_query_register (PyObject *module)
+{
+    if (PyType_Ready (&QueryType) < 0)
+        return;
+
+    Py_INCREF (&QueryType);
+    PyModule_AddObject (module, "Query", (PyObject *) &QueryType);
+}
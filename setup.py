@@ -1,15 +1,33 @@
 import os
 from distutils.core import setup, Extension
 
-pc = os.popen("pkg-config --cflags-only-I glib-2.0 libxml-2.0 sqlite3", "r")
+pkgs = "glib-2.0 gthread-2.0 libxml-2.0 sqlite3"
+macros = []
+
+# zstd is optional, it is needed for the compressed_changelogs option and
+# zstd compressed upstream databases. YMP_WITHOUT_ZSTD=1 leaves it out
+# even when it is installed, as the spec does when built --without zstd.
+if not os.environ.get("YMP_WITHOUT_ZSTD") and \
+        os.system("pkg-config --exists libzstd") == 0:
+    pkgs += " libzstd"
+    macros.append(('HAVE_ZSTD', None))
+
+# Decompressors for the upstream databases taken by import_*
+for pkg, macro in (("zlib", "HAVE_ZLIB"), ("bzip2", "HAVE_BZIP2"),
+                   ("liblzma", "HAVE_LZMA")):
+    if os.system("pkg-config --exists %s" % pkg) == 0:
+        pkgs += " " + pkg
+        macros.append((macro, None))
+
+pc = os.popen("pkg-config --cflags-only-I %s" % pkgs, "r")
 includes = list(map(lambda x:x[2:], pc.readline().split()))
 pc.close()
 
-pc = os.popen("pkg-config --libs-only-l glib-2.0 libxml-2.0 sqlite3", "r")
+pc = os.popen("pkg-config --libs-only-l %s" % pkgs, "r")
 libs = list(map(lambda x:x[2:], pc.readline().split()))
 pc.close()
 
-pc = os.popen("pkg-config --libs-only-L glib-2.0 libxml-2.0 sqlite3", "r")
+pc = os.popen("pkg-config --libs-only-L %s" % pkgs, "r")
 libdirs = list(map(lambda x:x[2:], pc.readline().split()))
 pc.close()
 
@@ -17,9 +35,13 @@ module = Extension('_sqlitecache',
                    include_dirs = includes,
                    libraries = libs,
                    library_dirs = libdirs,
+                   define_macros = macros,
                    sources = ['package.c',
                               'xml-parser.c',
                               'db.c',
+                              'decompress.c',
+                              'evr.c',
+                              'query.c',
                               'sqlitecache.c'])
 
 setup (name = 'yum-metadata-parser',
@@ -17,12 +17,21 @@
 
 #include <Python.h>
 
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
 #include "xml-parser.h"
 #include "db.h"
+#include "decompress.h"
 #include "package.h"
-
-/* Make room for 2500 package ids, 40 bytes + '\0' each */
-#define PACKAGE_IDS_CHUNK 41 * 2500
+#include "query.h"
 
 typedef struct _UpdateInfo UpdateInfo;
 
@@ -37,27 +46,65 @@ typedef void (*XmlParseFn)  (const char *filename,
 
 typedef void (*WriteDbPackageFn) (UpdateInfo *update_info, Package *package);
 
-typedef void (*IndexTablesFn) (sqlite3 *db, GError **err);
+
+typedef void (*InfoFinishFn) (UpdateInfo *update_info, GError **err);
+typedef void (*InfoFlushFn) (UpdateInfo *update_info, GError **err);
+
+/* Tables a clustered build sorts by their lookup key */
+typedef struct {
+    const char *table;
+    const char *key;
+} ClusterKey;
 
 struct _UpdateInfo {
     sqlite3 *db;
+    const char *db_filename;
+    const char *checksum;
     sqlite3_stmt *remove_handle;
     guint32 count_from_md;
     guint32 packages_seen;
     guint32 add_count;
     guint32 del_count;
-    GHashTable *current_packages;
-    GHashTable *all_packages;
-    GStringChunk *package_ids_chunk;
+    PackageIdSet *current_packages;
+    PackageIdSet *all_packages;
     GTimer *timer;
     gpointer python_callback;
+
+    /* Take a database the repository built instead of the XML */
+    gboolean import;
+
+    /* Build options */
+    gboolean parallel_writers;
+    gboolean parallel_encoders;
+    gboolean clustered;
+    guint layout;
+    const char *primary_db;
+    guint32 checkpoint_interval;
+    const char *delta;
+    const char *shared_store;
+    gboolean deterministic;
+    GError *checkpoint_error;
+
+    /* pkgKeys borrowed from primary_db, see update_info_read_primary */
+    gboolean reuses_primary_keys;
+    gboolean reuses_primary_dirnames;
+    PackageIdSet *primary_keys;
+    char *primary_checksum;
+    gint64 next_key;
+
+    YumDbStrings *strings[YUM_DB_DICTS];
     
     InfoInitFn info_init;
+    InfoFinishFn info_finish;
+    InfoFlushFn info_flush;
     InfoCleanFn info_clean;
     CreateTablesFn create_tables;
     WriteDbPackageFn write_package;
     XmlParseFn xml_parse;
     IndexTablesFn index_tables;
+    IndexTablesFn prune_tables;    /* Drops what the removals left unused */
+    IndexTablesFn resolve_tables;  /* Run after the removals, may be NULL */
+    const ClusterKey *cluster_keys;
 
     gpointer user_data;
 };
@@ -65,54 +112,73 @@ struct _UpdateInfo {
 static void
 update_info_init (UpdateInfo *info, GError **err)
 {
-    const char *sql;
-    int rc;
-
-    sql = "DELETE FROM packages WHERE pkgKey = ?";
-    rc = sqlite3_prepare (info->db, sql, -1, &info->remove_handle, NULL);
-    if (rc != SQLITE_OK) {
-        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
-                     "Can not prepare package removal: %s",
-                     sqlite3_errmsg (info->db));
-        sqlite3_finalize (info->remove_handle);
-        return;
-    }
-
     info->count_from_md = 0;
     info->packages_seen = 0;
     info->add_count = 0;
     info->del_count = 0;
-    info->all_packages = g_hash_table_new (g_str_hash, g_str_equal);
-    info->package_ids_chunk = g_string_chunk_new (PACKAGE_IDS_CHUNK);
+    info->all_packages = package_id_set_new ();
     info->timer = g_timer_new ();
     g_timer_start (info->timer);
     info->current_packages = yum_db_read_package_ids (info->db, err);
 }
 
 static void
-remove_entry (gpointer key, gpointer value, gpointer user_data)
+remove_entry (gint64 pkgKey, gpointer user_data)
 {
     UpdateInfo *info = (UpdateInfo *) user_data;
+    int rc;
 
-    if (g_hash_table_lookup (info->all_packages, key) == NULL) {
-        int rc;
+    sqlite3_bind_int64 (info->remove_handle, 1, pkgKey);
+    rc = sqlite3_step (info->remove_handle);
+    sqlite3_reset (info->remove_handle);
 
-        sqlite3_bind_int (info->remove_handle, 1, GPOINTER_TO_INT (value));
-        rc = sqlite3_step (info->remove_handle);
-        sqlite3_reset (info->remove_handle);
+    if (rc != SQLITE_DONE)
+        g_warning ("Error removing package from SQL: %s",
+                   sqlite3_errmsg (info->db));
 
-        if (rc != SQLITE_DONE)
-            g_warning ("Error removing package from SQL: %s",
-                       sqlite3_errmsg (info->db));
+    info->del_count++;
+}
 
-        info->del_count++;
-    }
+static void
+update_info_stage_tables (UpdateInfo *info, GError **err)
+{
+    const ClusterKey *k;
+
+    for (k = info->cluster_keys; k && k->table && !*err; k++)
+        yum_db_stage_table (info->db, k->table, info->layout, err);
 }
 
 static void
-update_info_remove_old_entries (UpdateInfo *info)
+update_info_cluster_tables (UpdateInfo *info, GError **err)
 {
-    g_hash_table_foreach (info->current_packages, remove_entry, info);
+    const ClusterKey *k;
+
+    for (k = info->cluster_keys; k && k->table && !*err; k++)
+        yum_db_cluster_table (info->db, k->table, k->key, info->layout, err);
+}
+
+/* Prepared only now: staging, clustering and the shards change the
+   schema after update_info_init(), which expires older statements */
+static void
+update_info_remove_old_entries (UpdateInfo *info, GError **err)
+{
+    const char *sql;
+    int rc;
+
+    sql = "DELETE FROM packages WHERE pkgKey = ?";
+    rc = sqlite3_prepare (info->db, sql, -1, &info->remove_handle, NULL);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not prepare package removal: %s",
+                     sqlite3_errmsg (info->db));
+        return;
+    }
+
+    package_id_set_foreach_missing (info->current_packages,
+                                    info->all_packages, remove_entry, info);
+
+    if (info->del_count && info->prune_tables)
+        info->prune_tables (info->db, info->layout, err);
 }
 
 static void
@@ -129,11 +195,9 @@ update_info_done (UpdateInfo *info, GError **err)
     if (info->remove_handle)
         sqlite3_finalize (info->remove_handle);
     if (info->current_packages)
-        g_hash_table_destroy (info->current_packages);
+        package_id_set_free (info->current_packages);
     if (info->all_packages)
-        g_hash_table_destroy (info->all_packages);
-    if (info->package_ids_chunk)
-        g_string_chunk_free (info->package_ids_chunk);
+        package_id_set_free (info->all_packages);
 
     g_timer_stop (info->timer);
     if (!*err) {
@@ -145,73 +209,182 @@ update_info_done (UpdateInfo *info, GError **err)
     g_timer_destroy (info->timer);
 }
 
+static void
+max_key (gint64 pkgKey, gpointer user_data)
+{
+    gint64 *max = (gint64 *) user_data;
+
+    *max = MAX (*max, pkgKey);
+}
+
+/* Read the pkgKeys primary assigned, so the same pkgId gets the same
+   pkgKey here. Failing that the keys are assigned independently. */
+static void
+update_info_read_primary (UpdateInfo *info)
+{
+    sqlite3 *primary = NULL;
+    GError *err = NULL;
+    int rc;
+
+    rc = sqlite3_open_v2 (info->primary_db, &primary,
+                          SQLITE_OPEN_READONLY, NULL);
+    if (rc != SQLITE_OK) {
+        g_warning ("Can not open %s: %s", info->primary_db,
+                   sqlite3_errmsg (primary));
+        goto cleanup;
+    }
+
+    info->primary_checksum = yum_db_dbinfo_checksum (primary, &err);
+    if (!err && info->primary_checksum)
+        info->primary_keys = yum_db_read_package_ids (primary, &err);
+
+    if (err || !info->primary_keys) {
+        g_warning ("Can not read pkgKeys from %s: %s", info->primary_db,
+                   err ? err->message : "no checksum");
+        g_clear_error (&err);
+        if (info->primary_keys)
+            package_id_set_free (info->primary_keys);
+        info->primary_keys = NULL;
+        g_free (info->primary_checksum);
+        info->primary_checksum = NULL;
+        goto cleanup;
+    }
+
+    /* Packages primary does not know get keys past its own */
+    info->next_key = 0;
+    package_id_set_foreach (info->primary_keys, max_key, &info->next_key);
+
+ cleanup:
+    if (primary)
+        sqlite3_close (primary);
+}
+
+/* Directories get the ids primary gave them, new ones the ids after
+   those. A cache being resumed already has them. */
+static void
+update_info_share_dirnames (UpdateInfo *info)
+{
+    sqlite3 *primary = NULL;
+
+    if (sqlite3_open_v2 (info->primary_db, &primary,
+                         SQLITE_OPEN_READONLY, NULL) == SQLITE_OK)
+        yum_db_strings_share (info->strings[YUM_DB_DICT_DIRNAMES], primary);
+
+    sqlite3_close (primary);
+}
+
 
 /* Primary */
 
+static const ClusterKey primary_cluster_keys[] = {
+    { "requires",  "name" },
+    { "provides",  "name" },
+    { "conflicts", "name" },
+    { "obsoletes", "name" },
+    { "files",     "name" },
+    { NULL, NULL }
+};
+
+typedef gboolean (*WriteListFn) (sqlite3 *db, sqlite3_stmt *handle,
+                                 gint64 pkgKey, GSList *list);
+
+/* With parallel writers every dependency table and the files table gets
+   a thread and a shard database of its own. Packages are handed over with
+   their pkgKey already assigned, the shards are merged in at the end. */
+
+#define WRITER_SHARDS 5
+#define WRITER_SHARD_QUEUE_MAX 1024
+
+typedef struct {
+    const char *table;
+    glong list_offset;
+    WriteListFn write;
+
+    char *path;
+    sqlite3 *db;
+    sqlite3_stmt *handle;
+    GAsyncQueue *queue;
+    GThread *thread;
+
+    GMutex *lock;
+    GCond *cond;
+    guint *queued;
+
+    /* The first failure of the thread, the shard is not merged then */
+    int rc;
+    char *error;
+} WriterShard;
+
 typedef struct {
     UpdateInfo update_info;
     sqlite3_stmt *pkg_handle;
+    sqlite3_stmt *detail_handle;
     sqlite3_stmt *requires_handle;
     sqlite3_stmt *provides_handle;
     sqlite3_stmt *conflicts_handle;
     sqlite3_stmt *obsoletes_handle;
     sqlite3_stmt *files_handle;
-} PackageWriterInfo;
-
-static void
-package_writer_info_init (UpdateInfo *update_info, sqlite3 *db, GError **err)
-{
-    PackageWriterInfo *info = (PackageWriterInfo *) update_info;
+    sqlite3_stmt *deps_handle;
 
-    info->pkg_handle = yum_db_package_prepare (db, err);
-    if (*err)
-        return;
-    info->requires_handle = yum_db_dependency_prepare (db, "requires", err);
-    if (*err)
-        return;
-    info->provides_handle = yum_db_dependency_prepare (db, "provides", err);
-    if (*err)
-        return;
-    info->conflicts_handle = yum_db_dependency_prepare (db, "conflicts", err);
-    if (*err)
-        return;
-    info->obsoletes_handle = yum_db_dependency_prepare (db, "obsoletes", err);
-    if (*err)
-        return;
-    info->files_handle = yum_db_file_prepare (db, err);
-}
+    gint64 last_pkgKey;
+    WriterShard shards[WRITER_SHARDS];
+    GMutex shards_lock;
+    GCond shards_cond;
+    guint shards_queued;
+} PackageWriterInfo;
 
-static void
+static gboolean
 write_deps (sqlite3 *db, sqlite3_stmt *handle, gint64 pkgKey, 
             GSList *deps)
 {
     GSList *iter;
+    gboolean ok = TRUE;
 
     for (iter = deps; iter; iter = iter->next)
-        yum_db_dependency_write (db, handle, pkgKey, (Dependency *) iter->data,
-                                 FALSE);
+        ok &= yum_db_dependency_write (db, handle, pkgKey,
+                                       (Dependency *) iter->data, FALSE);
+
+    return ok;
 }
 
-static void
+static gboolean
 write_requirements (sqlite3 *db, sqlite3_stmt *handle, gint64 pkgKey,
             GSList *deps)
 {
     GSList *iter;
+    gboolean ok = TRUE;
 
     for (iter = deps; iter; iter = iter->next)
-        yum_db_dependency_write (db, handle, pkgKey, (Dependency *) iter->data,
-                                 TRUE);
+        ok &= yum_db_dependency_write (db, handle, pkgKey,
+                                       (Dependency *) iter->data, TRUE);
+
+    return ok;
 }
 
+static gboolean
+write_files (sqlite3 *db, sqlite3_stmt *handle, gint64 pkgKey, GSList *files)
+{
+    GSList *iter;
+    gboolean ok = TRUE;
+
+    for (iter = files; iter; iter = iter->next)
+        ok &= yum_db_file_write (db, handle, pkgKey,
+                                 (PackageFile *) iter->data);
+
+    return ok;
+}
 
 static void
-write_files (sqlite3 *db, sqlite3_stmt *handle, Package *pkg)
+write_package_row (PackageWriterInfo *info, Package *package)
 {
-    GSList *iter;
+    UpdateInfo *update_info = (UpdateInfo *) info;
+
+    yum_db_package_write (update_info->db, info->pkg_handle,
+                          update_info->layout, package);
 
-    for (iter = pkg->files; iter; iter = iter->next)
-        yum_db_file_write (db, handle, pkg->pkgKey,
-                           (PackageFile *) iter->data);
+    if (info->detail_handle)
+        yum_db_package_detail_write (update_info->db, info->detail_handle,
+                                     update_info->layout, package);
 }
 
 static void
@@ -219,7 +392,7 @@ write_package_to_db (UpdateInfo *update_info, Package *package)
 {
     PackageWriterInfo *info = (PackageWriterInfo *) update_info;
 
-    yum_db_package_write (update_info->db, info->pkg_handle, package);
+    write_package_row (info, package);
 
     write_requirements (update_info->db, info->requires_handle,
                     package->pkgKey, package->requires);
@@ -230,7 +403,311 @@ write_package_to_db (UpdateInfo *update_info, Package *package)
     write_deps (update_info->db, info->obsoletes_handle,
                 package->pkgKey, package->obsoletes);
 
-    write_files (update_info->db, info->files_handle, package);
+    write_files (update_info->db, info->files_handle,
+                 package->pkgKey, package->files);
+}
+
+static void
+write_packed_package_to_db (UpdateInfo *update_info, Package *package)
+{
+    PackageWriterInfo *info = (PackageWriterInfo *) update_info;
+
+    write_package_row (info, package);
+    yum_db_package_deps_write (update_info->db, info->deps_handle, package);
+
+    write_files (update_info->db, info->files_handle,
+                 package->pkgKey, package->files);
+}
+
+static void
+writer_shard_fail (WriterShard *shard, int rc)
+{
+    if (shard->rc != SQLITE_OK)
+        return;
+
+    shard->rc = rc;
+    shard->error = g_strdup (sqlite3_errmsg (shard->db));
+}
+
+static gpointer
+writer_shard_thread (gpointer data)
+{
+    WriterShard *shard = (WriterShard *) data;
+    Package *p;
+    int rc;
+
+    rc = sqlite3_exec (shard->db, "BEGIN", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        writer_shard_fail (shard, rc);
+
+    /* The shard itself is pushed as the end marker. Packages are still
+       taken off the queue after a failure, the parser waits on it. */
+    while ((p = g_async_queue_pop (shard->queue)) != (gpointer) shard) {
+        if (shard->rc == SQLITE_OK &&
+            !shard->write (shard->db, shard->handle, p->pkgKey,
+                           G_STRUCT_MEMBER (GSList *, p, shard->list_offset)))
+            writer_shard_fail (shard, sqlite3_errcode (shard->db));
+        package_free (p);
+
+        g_mutex_lock (shard->lock);
+        (*shard->queued)--;
+        g_cond_signal (shard->cond);
+        g_mutex_unlock (shard->lock);
+    }
+
+    if (shard->rc == SQLITE_OK) {
+        rc = sqlite3_exec (shard->db, "COMMIT", NULL, NULL, NULL);
+        if (rc != SQLITE_OK)
+            writer_shard_fail (shard, rc);
+    }
+
+    return NULL;
+}
+
+static void
+write_package_to_shards (UpdateInfo *update_info, Package *package)
+{
+    PackageWriterInfo *info = (PackageWriterInfo *) update_info;
+    int i;
+
+    /* Stable keys are picked when the package row is written */
+    if (!(update_info->layout & YUM_DB_LAYOUT_STABLE_KEYS))
+        package->pkgKey = ++info->last_pkgKey;
+    write_package_row (info, package);
+
+    g_mutex_lock (&info->shards_lock);
+    while (info->shards_queued >= WRITER_SHARD_QUEUE_MAX)
+        g_cond_wait (&info->shards_cond, &info->shards_lock);
+    info->shards_queued += WRITER_SHARDS;
+    g_mutex_unlock (&info->shards_lock);
+
+    for (i = 0; i < WRITER_SHARDS; i++)
+        g_async_queue_push (info->shards[i].queue, package_ref (package));
+}
+
+static void
+writer_shards_stop (PackageWriterInfo *info)
+{
+    int i;
+
+    for (i = 0; i < WRITER_SHARDS; i++) {
+        WriterShard *shard = &info->shards[i];
+
+        if (shard->thread) {
+            g_async_queue_push (shard->queue, shard);
+            g_thread_join (shard->thread);
+            shard->thread = NULL;
+        }
+
+        if (shard->queue) {
+            g_async_queue_unref (shard->queue);
+            shard->queue = NULL;
+        }
+
+        if (shard->handle) {
+            sqlite3_finalize (shard->handle);
+            shard->handle = NULL;
+        }
+
+        if (shard->db) {
+            sqlite3_close (shard->db);
+            shard->db = NULL;
+        }
+    }
+}
+
+static void
+writer_shards_finish (UpdateInfo *update_info, GError **err)
+{
+    PackageWriterInfo *info = (PackageWriterInfo *) update_info;
+    int i;
+
+    writer_shards_stop (info);
+
+    /* A shard missing rows would leave a cache that looks complete */
+    for (i = 0; i < WRITER_SHARDS && !*err; i++) {
+        if (info->shards[i].rc != SQLITE_OK)
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not write %s shard: %s",
+                         info->shards[i].table, info->shards[i].error);
+    }
+
+    for (i = 0; i < WRITER_SHARDS && !*err; i++)
+        yum_db_merge_shard (update_info->db, info->shards[i].path,
+                            info->shards[i].table, update_info->layout, err);
+}
+
+static void
+writer_shards_init (PackageWriterInfo *info, GError **err)
+{
+    UpdateInfo *update_info = (UpdateInfo *) info;
+    sqlite3_stmt *handle = NULL;
+    int i, j;
+
+    const char *tables[] = { "requires", "provides", "conflicts", "obsoletes",
+                             "files" };
+    const glong offsets[] = { G_STRUCT_OFFSET (Package, requires),
+                              G_STRUCT_OFFSET (Package, provides),
+                              G_STRUCT_OFFSET (Package, conflicts),
+                              G_STRUCT_OFFSET (Package, obsoletes),
+                              G_STRUCT_OFFSET (Package, files) };
+    const WriteListFn writers[] = { write_requirements, write_deps,
+                                    write_deps, write_deps, write_files };
+
+    g_mutex_init (&info->shards_lock);
+    g_cond_init (&info->shards_cond);
+
+    /* Keys are handed out here, continue after whatever is there */
+    if (sqlite3_prepare (update_info->db, "SELECT MAX(pkgKey) FROM packages",
+                         -1, &handle, NULL) == SQLITE_OK &&
+        sqlite3_step (handle) == SQLITE_ROW)
+        info->last_pkgKey = sqlite3_column_int64 (handle, 0);
+    sqlite3_finalize (handle);
+
+    for (i = 0; i < WRITER_SHARDS; i++) {
+        WriterShard *shard = &info->shards[i];
+
+        shard->table = tables[i];
+        shard->list_offset = offsets[i];
+        shard->write = writers[i];
+        shard->lock = &info->shards_lock;
+        shard->cond = &info->shards_cond;
+        shard->queued = &info->shards_queued;
+
+        shard->path = g_strdup_printf ("%s-%s", update_info->db_filename,
+                                       shard->table);
+        unlink (shard->path);
+
+        if (sqlite3_open (shard->path, &shard->db) != SQLITE_OK) {
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not open %s shard: %s",
+                         shard->table, sqlite3_errmsg (shard->db));
+            return;
+        }
+
+        sqlite3_exec (shard->db, "PRAGMA synchronous = 0", NULL, NULL, NULL);
+        sqlite3_exec (shard->db, "PRAGMA journal_mode = OFF", NULL, NULL, NULL);
+
+        /* Rows get their requireKey when the shard is merged */
+        yum_db_create_primary_tables (shard->db,
+                                      update_info->layout &
+                                      ~YUM_DB_LAYOUT_PROVIDERS, err);
+        if (*err)
+            return;
+
+        /* Shards share the dictionaries so their ids agree */
+        for (j = 0; j < YUM_DB_DICTS; j++) {
+            if (!update_info->strings[j])
+                continue;
+
+            yum_db_strings_attach (update_info->strings[j], shard->db, err);
+            if (*err)
+                return;
+        }
+
+        if (shard->write == write_files)
+            shard->handle = yum_db_file_prepare (shard->db,
+                                                 update_info->layout, err);
+        else
+            shard->handle = yum_db_dependency_prepare (shard->db, shard->table,
+                                                       update_info->layout,
+                                                       err);
+        if (*err)
+            return;
+
+        shard->queue = g_async_queue_new ();
+        shard->thread = g_thread_try_new (shard->table, writer_shard_thread,
+                                          shard, err);
+        if (*err)
+            return;
+    }
+
+    update_info->write_package = write_package_to_shards;
+    update_info->info_finish = writer_shards_finish;
+}
+
+static void
+writer_shards_clean (PackageWriterInfo *info)
+{
+    int i;
+
+    writer_shards_stop (info);
+
+    for (i = 0; i < WRITER_SHARDS; i++) {
+        if (info->shards[i].path) {
+            unlink (info->shards[i].path);
+            g_free (info->shards[i].path);
+        }
+        g_free (info->shards[i].error);
+    }
+
+    if (info->update_info.parallel_writers) {
+        g_mutex_clear (&info->shards_lock);
+        g_cond_clear (&info->shards_cond);
+    }
+}
+
+static void
+package_writer_info_init (UpdateInfo *update_info, sqlite3 *db, GError **err)
+{
+    PackageWriterInfo *info = (PackageWriterInfo *) update_info;
+
+    info->detail_handle = yum_db_package_detail_prepare (db,
+                                                         update_info->layout,
+                                                         err);
+    if (*err)
+        return;
+
+    /* One row per package, nothing worth sharding */
+    if (update_info->layout & YUM_DB_LAYOUT_PACKED_DEPS) {
+        info->pkg_handle = yum_db_package_prepare (db, update_info->layout,
+                                                   err);
+        if (*err)
+            return;
+        info->deps_handle = yum_db_package_deps_prepare (db, err);
+        if (*err)
+            return;
+        info->files_handle = yum_db_file_prepare (db, update_info->layout,
+                                                  err);
+
+        update_info->write_package = write_packed_package_to_db;
+        return;
+    }
+
+    if (update_info->parallel_writers) {
+        info->pkg_handle = yum_db_package_prepare (db, update_info->layout,
+                                                   err);
+        if (*err)
+            return;
+
+        writer_shards_init (info, err);
+        return;
+    }
+
+    info->pkg_handle = yum_db_package_prepare (db, update_info->layout, err);
+    if (*err)
+        return;
+    info->requires_handle = yum_db_dependency_prepare (db, "requires",
+                                                       update_info->layout,
+                                                       err);
+    if (*err)
+        return;
+    info->provides_handle = yum_db_dependency_prepare (db, "provides",
+                                                       update_info->layout,
+                                                       err);
+    if (*err)
+        return;
+    info->conflicts_handle = yum_db_dependency_prepare (db, "conflicts",
+                                                       update_info->layout,
+                                                       err);
+    if (*err)
+        return;
+    info->obsoletes_handle = yum_db_dependency_prepare (db, "obsoletes",
+                                                       update_info->layout,
+                                                       err);
+    if (*err)
+        return;
+    info->files_handle = yum_db_file_prepare (db, update_info->layout, err);
 }
 
 static void
@@ -240,6 +717,8 @@ package_writer_info_clean (UpdateInfo *update_info)
     
     if (info->pkg_handle)
         sqlite3_finalize (info->pkg_handle);
+    if (info->detail_handle)
+        sqlite3_finalize (info->detail_handle);
     if (info->requires_handle)
         sqlite3_finalize (info->requires_handle);
     if (info->provides_handle)
@@ -250,47 +729,226 @@ package_writer_info_clean (UpdateInfo *update_info)
         sqlite3_finalize (info->obsoletes_handle);
     if (info->files_handle)
         sqlite3_finalize (info->files_handle);
+    if (info->deps_handle)
+        sqlite3_finalize (info->deps_handle);
+
+    writer_shards_clean (info);
 }
 
 
 /* Filelists */
 
+static const ClusterKey filelist_cluster_keys[] = {
+    { "filelist", "dirname" },
+    { NULL, NULL }
+};
+
+/* With parallel encoders the file lists are encoded on a thread pool.
+   Jobs are queued in package order and written from the head of the
+   queue as they finish, encoders are recycled by the inserting thread. */
+
+#define ENCODER_JOBS_PER_THREAD 4
+
+typedef struct {
+    Package *package;
+    YumDbFilelistEncoder *encoder;
+    gboolean done;
+} FilelistJob;
+
 typedef struct {
     UpdateInfo update_info;
     sqlite3_stmt *pkg_handle;
     sqlite3_stmt *file_handle;
+    YumDbFilelistEncoder *encoder;
+
+    GThreadPool *pool;
+    guint max_jobs;
+    GQueue jobs;
+    GSList *free_encoders;
+    GMutex jobs_lock;
+    GCond jobs_cond;
 } FileListInfo;
 
 static void
-update_filelist_info_init (UpdateInfo *update_info, sqlite3 *db, GError **err)
+write_filelist_package_to_db (UpdateInfo *update_info, Package *package)
 {
     FileListInfo *info = (FileListInfo *) update_info;
 
-    info->pkg_handle = yum_db_package_ids_prepare (db, err);
+    yum_db_package_ids_write (update_info->db, info->pkg_handle,
+                              update_info->layout, package);
+
+    yum_db_filelist_encode (info->encoder, package);
+    yum_db_filelists_write (update_info->db, info->file_handle,
+                            info->encoder, package->pkgKey);
+}
+
+static void
+filelist_encode_job (gpointer data, gpointer user_data)
+{
+    FilelistJob *job = (FilelistJob *) data;
+    FileListInfo *info = (FileListInfo *) user_data;
+
+    yum_db_filelist_encode (job->encoder, job->package);
+
+    g_mutex_lock (&info->jobs_lock);
+    job->done = TRUE;
+    g_cond_broadcast (&info->jobs_cond);
+    g_mutex_unlock (&info->jobs_lock);
+}
+
+/* Writes the oldest job, waiting for it if asked to */
+static gboolean
+filelist_jobs_write_head (FileListInfo *info, gboolean wait)
+{
+    FilelistJob *job;
+    gboolean done;
+
+    job = g_queue_peek_head (&info->jobs);
+    if (!job)
+        return FALSE;
+
+    g_mutex_lock (&info->jobs_lock);
+    while (wait && !job->done)
+        g_cond_wait (&info->jobs_cond, &info->jobs_lock);
+    done = job->done;
+    g_mutex_unlock (&info->jobs_lock);
+
+    if (!done)
+        return FALSE;
+
+    g_queue_pop_head (&info->jobs);
+
+    yum_db_filelists_write (info->update_info.db, info->file_handle,
+                            job->encoder, job->package->pkgKey);
+
+    info->free_encoders = g_slist_prepend (info->free_encoders, job->encoder);
+    package_free (job->package);
+    g_free (job);
+
+    return TRUE;
+}
+
+static void
+write_filelist_package_to_pool (UpdateInfo *update_info, Package *package)
+{
+    FileListInfo *info = (FileListInfo *) update_info;
+    FilelistJob *job;
+
+    /* The pkgKey is needed by the rows, the id goes in right away */
+    yum_db_package_ids_write (update_info->db, info->pkg_handle,
+                              update_info->layout, package);
+
+    while (g_queue_get_length (&info->jobs) >= info->max_jobs)
+        filelist_jobs_write_head (info, TRUE);
+
+    job = g_new0 (FilelistJob, 1);
+    job->package = package_ref (package);
+
+    if (info->free_encoders) {
+        job->encoder = info->free_encoders->data;
+        info->free_encoders = g_slist_delete_link (info->free_encoders,
+                                                   info->free_encoders);
+    } else
+        job->encoder = yum_db_filelist_encoder_new ();
+
+    g_queue_push_tail (&info->jobs, job);
+    g_thread_pool_push (info->pool, job, NULL);
+
+    while (filelist_jobs_write_head (info, FALSE))
+        ;
+}
+
+static void
+filelist_encoders_finish (UpdateInfo *update_info, GError **err)
+{
+    FileListInfo *info = (FileListInfo *) update_info;
+
+    while (filelist_jobs_write_head (info, TRUE))
+        ;
+}
+
+static void
+filelist_encoders_init (FileListInfo *info, GError **err)
+{
+    UpdateInfo *update_info = (UpdateInfo *) info;
+    guint threads = MAX (g_get_num_processors () - 1, 1);
+
+    g_mutex_init (&info->jobs_lock);
+    g_cond_init (&info->jobs_cond);
+    g_queue_init (&info->jobs);
+    info->max_jobs = threads * ENCODER_JOBS_PER_THREAD;
+
+    info->pool = g_thread_pool_new (filelist_encode_job, info, threads,
+                                    TRUE, err);
     if (*err)
         return;
 
-    info->file_handle = yum_db_filelists_prepare (db, err);
+    update_info->write_package = write_filelist_package_to_pool;
+    update_info->info_finish = filelist_encoders_finish;
+    update_info->info_flush = filelist_encoders_finish;
 }
 
 static void
-update_filelist_info_clean (UpdateInfo *update_info)
+filelist_encoders_clean (FileListInfo *info)
+{
+    FilelistJob *job;
+    GSList *iter;
+
+    if (!info->update_info.parallel_encoders)
+        return;
+
+    /* Lets queued jobs finish, their rows are dropped on errors */
+    if (info->pool)
+        g_thread_pool_free (info->pool, FALSE, TRUE);
+
+    while ((job = g_queue_pop_head (&info->jobs))) {
+        yum_db_filelist_encoder_free (job->encoder);
+        package_free (job->package);
+        g_free (job);
+    }
+
+    for (iter = info->free_encoders; iter; iter = iter->next)
+        yum_db_filelist_encoder_free (iter->data);
+    g_slist_free (info->free_encoders);
+
+    g_mutex_clear (&info->jobs_lock);
+    g_cond_clear (&info->jobs_cond);
+}
+
+static void
+update_filelist_info_init (UpdateInfo *update_info, sqlite3 *db, GError **err)
 {
     FileListInfo *info = (FileListInfo *) update_info;
 
-    if (info->pkg_handle)
-        sqlite3_finalize (info->pkg_handle);
-    if (info->file_handle)
-        sqlite3_finalize (info->file_handle);
+    info->pkg_handle = yum_db_package_ids_prepare (db, update_info->layout,
+                                                    err);
+    if (*err)
+        return;
+
+    info->file_handle = yum_db_filelists_prepare (db, update_info->layout,
+                                                   err);
+    if (*err)
+        return;
+
+    if (update_info->parallel_encoders)
+        filelist_encoders_init (info, err);
+    else
+        info->encoder = yum_db_filelist_encoder_new ();
 }
 
 static void
-write_filelist_package_to_db (UpdateInfo *update_info, Package *package)
+update_filelist_info_clean (UpdateInfo *update_info)
 {
     FileListInfo *info = (FileListInfo *) update_info;
 
-    yum_db_package_ids_write (update_info->db, info->pkg_handle, package);
-    yum_db_filelists_write (update_info->db, info->file_handle, package);
+    filelist_encoders_clean (info);
+
+    if (info->pkg_handle)
+        sqlite3_finalize (info->pkg_handle);
+    if (info->file_handle)
+        sqlite3_finalize (info->file_handle);
+    if (info->encoder)
+        yum_db_filelist_encoder_free (info->encoder);
 }
 
 
@@ -300,17 +958,56 @@ typedef struct {
     UpdateInfo update_info;
     sqlite3_stmt *pkg_handle;
     sqlite3_stmt *changelog_handle;
+    YumDbCompressor *compressor;
+    YumDbChangelogSets *sets;
 } UpdateOtherInfo;
 
 static void
-update_other_info_init (UpdateInfo *update_info, sqlite3 *db, GError **err)
+update_other_info_init (UpdateInfo *update_info, sqlite3 *db, GError **err)
+{
+    UpdateOtherInfo *info = (UpdateOtherInfo *) update_info;
+
+    /* Changelogs are compressed once the dictionary is trained on them */
+    if (update_info->layout & YUM_DB_LAYOUT_COMPRESSED) {
+        yum_db_stage_table (db, "changelog", update_info->layout, err);
+        if (*err)
+            return;
+    }
+
+    info->pkg_handle = yum_db_package_ids_prepare (db, update_info->layout,
+                                                   err);
+    if (*err)
+        return;
+
+    info->changelog_handle = yum_db_changelog_prepare (db, update_info->layout,
+                                                        err);
+    if (*err)
+        return;
+
+    if (update_info->layout & YUM_DB_LAYOUT_CHANGELOG_SETS)
+        info->sets = yum_db_changelog_sets_new (db, err);
+}
+
+static void
+update_other_info_finish (UpdateInfo *update_info, GError **err)
 {
     UpdateOtherInfo *info = (UpdateOtherInfo *) update_info;
-    info->pkg_handle = yum_db_package_ids_prepare (db, err);
+
+    if (!(update_info->layout & YUM_DB_LAYOUT_COMPRESSED))
+        return;
+
+    /* The staging table is read while the rows are copied */
+    sqlite3_finalize (info->changelog_handle);
+    info->changelog_handle = NULL;
+
+    info->compressor = yum_db_compressor_new ();
+    yum_db_compressor_train (info->compressor, update_info->db, "changelog",
+                             update_info->layout, err);
     if (*err)
         return;
 
-    info->changelog_handle = yum_db_changelog_prepare (db, err);
+    yum_db_cluster_table (update_info->db, "changelog", NULL,
+                          update_info->layout, err);
 }
 
 static void
@@ -322,6 +1019,10 @@ update_other_info_clean (UpdateInfo *update_info)
         sqlite3_finalize (info->pkg_handle);
     if (info->changelog_handle)
         sqlite3_finalize (info->changelog_handle);
+    if (info->compressor)
+        yum_db_compressor_free (info->compressor);
+    if (info->sets)
+        yum_db_changelog_sets_free (info->sets);
 }
 
 static void
@@ -329,8 +1030,14 @@ write_other_package_to_db (UpdateInfo *update_info, Package *package)
 {
     UpdateOtherInfo *info = (UpdateOtherInfo *) update_info;
 
-    yum_db_package_ids_write (update_info->db, info->pkg_handle, package);
-    yum_db_changelog_write (update_info->db, info->changelog_handle, package);
+    yum_db_package_ids_write (update_info->db, info->pkg_handle,
+                              update_info->layout, package);
+    if (info->sets)
+        yum_db_changelog_sets_write (info->sets, update_info->db,
+                                     info->changelog_handle, package);
+    else
+        yum_db_changelog_write (update_info->db, info->changelog_handle,
+                                package);
 }
 
 
@@ -356,6 +1063,49 @@ progress_cb (UpdateInfo *update_info)
     Py_XDECREF (result);
 }
 
+/* Commits what has been written so far together with a checkpoint,
+   an interrupted build resumes from the last one. The rows refer to the
+   new strings, which go in first; the checkpoint row goes last so that
+   it never counts packages whose rows are not all there. On an error
+   nothing is committed. */
+static void
+update_info_checkpoint (UpdateInfo *info, GError **err)
+{
+    int rc;
+    int i;
+
+    if (info->info_flush)
+        info->info_flush (info, err);
+
+    for (i = 0; i < YUM_DB_DICTS && !*err; i++) {
+        if (info->strings[i])
+            yum_db_strings_write (info->strings[i], info->db, err);
+    }
+
+    if (!*err)
+        yum_db_checkpoint (info->db, info->checksum, info->layout,
+                           info->primary_checksum, err);
+
+    if (!*err) {
+        rc = sqlite3_exec (info->db, "COMMIT", NULL, NULL, NULL);
+        if (rc != SQLITE_OK)
+            g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                         "Can not commit checkpoint: %s",
+                         sqlite3_errmsg (info->db));
+    }
+
+    if (*err) {
+        sqlite3_exec (info->db, "ROLLBACK", NULL, NULL, NULL);
+        return;
+    }
+
+    rc = sqlite3_exec (info->db, "BEGIN", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not begin transaction: %s",
+                     sqlite3_errmsg (info->db));
+}
+
 static void
 update_package_cb (Package *p, gpointer user_data)
 {
@@ -366,16 +1116,27 @@ update_package_cb (Package *p, gpointer user_data)
         return;
     }
 
-    g_hash_table_insert (update_info->all_packages,
-                         g_string_chunk_insert (update_info->package_ids_chunk,
-                                                p->pkgId),
-                         GINT_TO_POINTER (1));
+    /* A failed checkpoint ends the build, see update_packages() */
+    if (update_info->checkpoint_error)
+        return;
+
+    package_id_set_insert_package (update_info->all_packages, p, 0);
+
+    if (!package_id_set_lookup_package (update_info->current_packages,
+                                        p, NULL)) {
+
+        if (update_info->primary_keys &&
+            !package_id_set_lookup_package (update_info->primary_keys,
+                                            p, &p->pkgKey))
+            p->pkgKey = ++update_info->next_key;
 
-    if (g_hash_table_lookup (update_info->current_packages,
-                             p->pkgId) == NULL) {
-        
         update_info->write_package (update_info, p);
         update_info->add_count++;
+
+        if (update_info->checkpoint_interval &&
+            update_info->add_count % update_info->checkpoint_interval == 0)
+            update_info_checkpoint (update_info,
+                                    &update_info->checkpoint_error);
     }
 
     if (update_info->count_from_md > 0 && update_info->python_callback) {
@@ -384,6 +1145,177 @@ update_package_cb (Package *p, gpointer user_data)
     }
 }
 
+/* Deltas start from the cache being replaced, which stays in place until
+   the new one is renamed over it */
+static gboolean
+update_info_delta_baseline (UpdateInfo *info)
+{
+    sqlite3 *db = NULL;
+    char *checksum = NULL;
+    gboolean baseline;
+    GError *err = NULL;
+
+    if (!g_file_test (info->db_filename, G_FILE_TEST_EXISTS))
+        return FALSE;
+
+    if (sqlite3_open_v2 (info->db_filename, &db, SQLITE_OPEN_READONLY,
+                         NULL) == SQLITE_OK)
+        checksum = yum_db_dbinfo_checksum (db, &err);
+    sqlite3_close (db);
+
+    if (err)
+        g_error_free (err);
+
+    baseline = checksum && strcmp (checksum, info->checksum);
+    g_free (checksum);
+
+    return baseline;
+}
+
+static void
+update_info_write_delta (UpdateInfo *info, const char *partial)
+{
+    GError *err = NULL;
+
+    yum_db_delta_write (info->db_filename, partial, info->delta, &err);
+    if (err) {
+        g_warning ("No delta written: %s", err->message);
+        g_error_free (err);
+    }
+}
+
+/* Shared store: caches built on this host, named after everything that
+   decides their content. A lock per name makes concurrent builders of
+   the same metadata wait for the first one. */
+
+static char *
+store_filename (UpdateInfo *info)
+{
+    char *name;
+    char *filename;
+
+    name = g_strdup_printf ("%s-%d.%d-%u%s%s%s.sqlite", info->checksum,
+                            YUM_SQLITE_CACHE_DBVERSION,
+                            YUM_SQLITE_CACHE_REVISION, info->layout,
+                            info->deterministic ? "d" : "",
+                            info->primary_checksum ? "-" : "",
+                            info->primary_checksum ? info->primary_checksum
+                            : "");
+    g_strdelimit (name, "/", '_');
+
+    filename = g_build_filename (info->shared_store, name, NULL);
+    g_free (name);
+
+    return filename;
+}
+
+static int
+store_lock (const char *store_filename)
+{
+    char *lock_filename;
+    int fd;
+
+    lock_filename = g_strconcat (store_filename, ".lock", NULL);
+    fd = open (lock_filename, O_RDWR | O_CREAT, 0644);
+    g_free (lock_filename);
+
+    if (fd < 0) {
+        g_warning ("Can not lock %s: %s", store_filename, g_strerror (errno));
+        return -1;
+    }
+
+    if (flock (fd, LOCK_EX | LOCK_NB) != 0) {
+        g_message ("Waiting for another build of %s", store_filename);
+        flock (fd, LOCK_EX);
+    }
+
+    return fd;
+}
+
+/* The lock file goes once the cache is in the store, anyone still
+   waiting on it finds the cache */
+static void
+store_unlock (const char *store_filename, int fd, gboolean stored)
+{
+    char *lock_filename;
+
+    if (fd < 0)
+        return;
+
+    if (stored) {
+        lock_filename = g_strconcat (store_filename, ".lock", NULL);
+        unlink (lock_filename);
+        g_free (lock_filename);
+    }
+
+    close (fd);
+}
+
+/* Hard link, else reflink, else copy src to a temporary file which is
+   renamed to dest */
+static gboolean
+store_install (const char *src, const char *dest)
+{
+    char *tmp_filename;
+    GError *err = NULL;
+    gboolean done = FALSE;
+
+    tmp_filename = g_strdup_printf ("%s.%d.tmp", dest, (int) getpid ());
+    unlink (tmp_filename);
+
+    if (link (src, tmp_filename) == 0)
+        done = TRUE;
+
+#ifdef FICLONE
+    if (!done) {
+        int in = open (src, O_RDONLY);
+        int out = open (tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        done = in >= 0 && out >= 0 && ioctl (out, FICLONE, in) == 0;
+        if (in >= 0)
+            close (in);
+        if (out >= 0)
+            close (out);
+    }
+#endif
+
+    /* A database is no compressed format, this copies it as is */
+    if (!done) {
+        yum_decompress_file (src, tmp_filename, &err);
+        done = err == NULL;
+    }
+
+    if (done && rename (tmp_filename, dest) != 0)
+        done = FALSE;
+
+    if (!done) {
+        g_warning ("Can not install %s as %s: %s", src, dest,
+                   err ? err->message : g_strerror (errno));
+        unlink (tmp_filename);
+    }
+
+    if (err)
+        g_error_free (err);
+    g_free (tmp_filename);
+
+    return done;
+}
+
+static gboolean
+store_fetch (UpdateInfo *info, const char *store_filename)
+{
+    if (!yum_db_current (store_filename, info->checksum, info->layout,
+                         info->primary_checksum))
+        return FALSE;
+
+    if (!store_install (store_filename, info->db_filename))
+        return FALSE;
+
+    g_message ("Using cache from the shared store");
+
+    return TRUE;
+}
+
 static char *
 update_packages (UpdateInfo *update_info,
                  const char *md_filename,
@@ -393,17 +1325,115 @@ update_packages (UpdateInfo *update_info,
                  GError **err)
 {
     char *db_filename;
+    char *partial;
+    gboolean baseline = FALSE;
+    gboolean built;
+    char *stored = NULL;
+    int store_fd = -1;
+    int rc;
+    int i;
 
     db_filename = yum_db_filename (md_filename);
+    partial = yum_db_partial_filename (db_filename);
+    update_info->db_filename = db_filename;
+    update_info->checksum = checksum;
+
+    /* Staged and sharded tables only reach the cache at the end */
+    if (update_info->checkpoint_interval &&
+        (update_info->clustered || update_info->parallel_writers ||
+         update_info->layout & YUM_DB_LAYOUT_COMPRESSED)) {
+        g_message ("Checkpoints need tables written in place, disabled");
+        update_info->checkpoint_interval = 0;
+    }
+
+    /* The writer threads intern into one dictionary in whatever order
+       they get to it */
+    if (update_info->deterministic && update_info->parallel_writers &&
+        update_info->layout & YUM_DB_LAYOUT_DICT) {
+        g_message ("String ids depend on thread timing, "
+                   "parallel_writers disabled");
+        update_info->parallel_writers = FALSE;
+    }
+
+    if (update_info->primary_db && update_info->reuses_primary_keys)
+        update_info_read_primary (update_info);
+
+    if (update_info->shared_store &&
+        !yum_db_current (db_filename, checksum, update_info->layout,
+                         update_info->primary_checksum)) {
+        gboolean found;
+
+        stored = store_filename (update_info);
+
+        /* Only a miss takes the lock, and looks again once it has it */
+        found = store_fetch (update_info, stored);
+        if (!found) {
+            store_fd = store_lock (stored);
+            found = store_fetch (update_info, stored);
+        }
+
+        if (found) {
+            store_unlock (stored, store_fd, TRUE);
+            g_free (stored);
+            g_free (update_info->primary_checksum);
+            if (update_info->primary_keys)
+                package_id_set_free (update_info->primary_keys);
+            g_free (partial);
+            return db_filename;
+        }
+    }
+
+    if (update_info->delta)
+        baseline = update_info_delta_baseline (update_info);
+
     update_info->db = yum_db_open (db_filename, checksum,
+                                   update_info->layout,
+                                   update_info->primary_checksum,
                                    update_info->create_tables,
+                                   update_info->index_tables,
                                    err);
 
     if (*err)
         goto cleanup;
 
-    if (!update_info->db)
+    if (!update_info->db) {
+        if (stored) {
+            store_unlock (stored, store_fd, FALSE);
+            g_free (stored);
+        }
+        if (update_info->primary_keys)
+            package_id_set_free (update_info->primary_keys);
+        g_free (update_info->primary_checksum);
+        g_free (partial);
         return db_filename;
+    }
+
+    if (update_info->layout & YUM_DB_LAYOUT_DICT)
+        update_info->strings[YUM_DB_DICT_STRINGS] =
+            yum_db_strings_new (YUM_DB_DICT_STRINGS);
+    if (update_info->layout & YUM_DB_LAYOUT_DIRNAMES)
+        update_info->strings[YUM_DB_DICT_DIRNAMES] =
+            yum_db_strings_new (YUM_DB_DICT_DIRNAMES);
+
+    for (i = 0; i < YUM_DB_DICTS; i++) {
+        if (!update_info->strings[i])
+            continue;
+
+        yum_db_strings_attach (update_info->strings[i], update_info->db, err);
+        if (*err)
+            goto cleanup;
+    }
+
+    if (update_info->strings[YUM_DB_DICT_DIRNAMES] &&
+        update_info->reuses_primary_dirnames && update_info->primary_keys)
+        update_info_share_dirnames (update_info);
+
+    /* The checkpoint table must exist before statements are prepared */
+    if (update_info->checkpoint_interval) {
+        yum_db_checkpoint_create (update_info->db, err);
+        if (*err)
+            goto cleanup;
+    }
 
     update_info_init (update_info, err);
     if (*err)
@@ -412,6 +1442,12 @@ update_packages (UpdateInfo *update_info,
     update_info->python_callback = python_callback;
     update_info->user_data = user_data;
 
+    if (update_info->clustered) {
+        update_info_stage_tables (update_info, err);
+        if (*err)
+            goto cleanup;
+    }
+
     update_info->info_init (update_info, update_info->db, err);
     if (*err)
         goto cleanup;
@@ -422,24 +1458,102 @@ update_packages (UpdateInfo *update_info,
                             update_package_cb,
                             update_info,
                             err);
+    if (update_info->checkpoint_error) {
+        g_clear_error (err);
+        g_propagate_prefixed_error (err, update_info->checkpoint_error,
+                                    "Checkpoint failed: ");
+        update_info->checkpoint_error = NULL;
+    }
     if (*err)
         goto cleanup;
-    sqlite3_exec (update_info->db, "COMMIT", NULL, NULL, NULL);
+    rc = sqlite3_exec (update_info->db, "COMMIT", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not commit packages: %s",
+                     sqlite3_errmsg (update_info->db));
+        goto cleanup;
+    }
+
+    if (update_info->info_finish) {
+        update_info->info_finish (update_info, err);
+        if (*err)
+            goto cleanup;
+    }
+
+    if (update_info->clustered) {
+        update_info_cluster_tables (update_info, err);
+        if (*err)
+            goto cleanup;
+    }
 
-    update_info->index_tables (update_info->db, err);
+    for (i = 0; i < YUM_DB_DICTS; i++) {
+        if (!update_info->strings[i])
+            continue;
+
+        yum_db_strings_write (update_info->strings[i], update_info->db, err);
+        if (*err)
+            goto cleanup;
+    }
+
+    update_info->index_tables (update_info->db, update_info->layout, err);
+    if (*err)
+        goto cleanup;
+
+    update_info_remove_old_entries (update_info, err);
     if (*err)
         goto cleanup;
 
-    update_info_remove_old_entries (update_info);
-    yum_db_dbinfo_update (update_info->db, checksum, err);
+    if (update_info->resolve_tables) {
+        update_info->resolve_tables (update_info->db, update_info->layout,
+                                     err);
+        if (*err)
+            goto cleanup;
+    }
+
+    yum_db_dbinfo_update (update_info->db, checksum, update_info->layout,
+                          update_info->primary_checksum, err);
 
  cleanup:
     update_info->info_clean (update_info);
     update_info_done (update_info, err);
 
+    for (i = 0; i < YUM_DB_DICTS; i++) {
+        if (update_info->strings[i]) {
+            yum_db_strings_free (update_info->strings[i]);
+            update_info->strings[i] = NULL;
+        }
+    }
+
+    built = update_info->db && !*err;
     if (update_info->db)
         sqlite3_close (update_info->db);
 
+    /* Before anything else reads the finished cache */
+    if (built && update_info->deterministic)
+        yum_db_rewrite (partial, err);
+
+    if (built && baseline && !*err)
+        update_info_write_delta (update_info, partial);
+
+    /* Readers only ever see complete caches, see yum_db_open() */
+    if (built && !*err && rename (partial, db_filename) != 0)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not rename %s: %s", partial, g_strerror (errno));
+    g_free (partial);
+
+    if (stored) {
+        gboolean published = FALSE;
+
+        if (built && !*err)
+            published = store_install (db_filename, stored);
+        store_unlock (stored, store_fd, published);
+        g_free (stored);
+    }
+
+    if (update_info->primary_keys)
+        package_id_set_free (update_info->primary_keys);
+    g_free (update_info->primary_checksum);
+
     if (*err) {
         g_free (db_filename);
         db_filename = NULL;
@@ -448,6 +1562,56 @@ update_packages (UpdateInfo *update_info,
     return db_filename;
 }
 
+/* The upstream database is decompressed next to the cache and only
+   replaces it once it passed yum_db_import */
+static char *
+import_database (UpdateInfo *update_info,
+                 const char *location,
+                 const char *checksum,
+                 GError **err)
+{
+    char *db_filename;
+    char *tmp_filename;
+    GTimer *timer;
+
+    if (update_info->layout) {
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Upstream databases come in their own layout, "
+                     "layout options do not apply");
+        return NULL;
+    }
+
+    db_filename = yum_db_filename (location);
+    if (yum_db_current (db_filename, checksum, 0, NULL))
+        return db_filename;
+
+    timer = g_timer_new ();
+    tmp_filename = g_strconcat (db_filename, ".import", NULL);
+
+    yum_decompress_file (location, tmp_filename, err);
+    if (!*err)
+        yum_db_import (tmp_filename, checksum, update_info->create_tables,
+                       update_info->index_tables, err);
+
+    if (!*err && rename (tmp_filename, db_filename) != 0)
+        g_set_error (err, YUM_DB_ERROR, YUM_DB_ERROR,
+                     "Can not rename %s: %s", tmp_filename,
+                     g_strerror (errno));
+
+    if (*err) {
+        unlink (tmp_filename);
+        g_free (db_filename);
+        db_filename = NULL;
+    } else
+        g_message ("Imported upstream database in %.2f seconds",
+                   g_timer_elapsed (timer, NULL));
+
+    g_free (tmp_filename);
+    g_timer_destroy (timer);
+
+    return db_filename;
+}
+
 /*********************************************************************/
 
 static gboolean
@@ -456,14 +1620,22 @@ py_parse_args (PyObject *args,
                const char **checksum,
                PyObject **log,
                PyObject **progress,
-               PyObject **repoid)
+               PyObject **repoid,
+               PyObject **options)
 {
     PyObject *callback;
 
-    if (!PyArg_ParseTuple (args, "ssOO", md_filename, checksum, &callback,
-                           repoid))
+    if (!PyArg_ParseTuple (args, "ssOO|O", md_filename, checksum, &callback,
+                           repoid, options))
         return FALSE;
 
+    if (*options == Py_None)
+        *options = NULL;
+    else if (*options && !PyDict_Check (*options)) {
+        PyErr_SetString (PyExc_TypeError, "options must be a dict");
+        return FALSE;
+    }
+
     if (PyObject_HasAttrString (callback, "log")) {
         *log = PyObject_GetAttrString (callback, "log");
 
@@ -485,6 +1657,102 @@ py_parse_args (PyObject *args,
     return TRUE;
 }
 
+static gboolean
+py_option_bool (PyObject *options, const char *name)
+{
+    PyObject *value;
+
+    if (!options)
+        return FALSE;
+
+    value = PyDict_GetItemString (options, name);
+
+    return value && PyObject_IsTrue (value) == 1;
+}
+
+static guint32
+py_option_uint (PyObject *options, const char *name)
+{
+    PyObject *value;
+    long n;
+
+    if (!options)
+        return 0;
+
+    value = PyDict_GetItemString (options, name);
+    if (!value || !(PyInt_Check (value) || PyLong_Check (value)))
+        return 0;
+
+    n = PyInt_AsLong (value);
+    if (n < 0) {
+        PyErr_Clear ();
+        return 0;
+    }
+
+    return MIN (n, G_MAXUINT32);
+}
+
+static const char *
+py_option_string (PyObject *options, const char *name)
+{
+    PyObject *value;
+
+    if (!options)
+        return NULL;
+
+    value = PyDict_GetItemString (options, name);
+    if (!value || !PyString_Check (value))
+        return NULL;
+
+    return PyString_AsString (value);
+}
+
+static void
+py_parse_options (PyObject *options, UpdateInfo *update_info)
+{
+    update_info->parallel_writers = py_option_bool (options,
+                                                    "parallel_writers");
+    update_info->parallel_encoders = py_option_bool (options,
+                                                     "parallel_encoders");
+    update_info->clustered = py_option_bool (options, "clustered");
+    update_info->primary_db = py_option_string (options, "primary_db");
+    update_info->checkpoint_interval = py_option_uint (options,
+                                                       "checkpoint_interval");
+    update_info->delta = py_option_string (options, "delta");
+    update_info->shared_store = py_option_string (options, "shared_store");
+    update_info->deterministic = py_option_bool (options, "deterministic");
+
+    if (py_option_bool (options, "dict_strings"))
+        update_info->layout |= YUM_DB_LAYOUT_DICT;
+    if (py_option_bool (options, "typed_columns"))
+        update_info->layout |= YUM_DB_LAYOUT_TYPED;
+    if (py_option_bool (options, "packed_deps"))
+        update_info->layout |= YUM_DB_LAYOUT_PACKED_DEPS;
+    if (py_option_bool (options, "dirnames"))
+        update_info->layout |= YUM_DB_LAYOUT_DIRNAMES;
+    if (py_option_bool (options, "stable_keys"))
+        update_info->layout |= YUM_DB_LAYOUT_STABLE_KEYS;
+    if (py_option_bool (options, "split_packages"))
+        update_info->layout |= YUM_DB_LAYOUT_SPLIT;
+    if (py_option_bool (options, "changelog_sets"))
+        update_info->layout |= YUM_DB_LAYOUT_CHANGELOG_SETS;
+    /* Packed requires have no rows to point at */
+    if (py_option_bool (options, "resolve_requires") &&
+        !(update_info->layout & YUM_DB_LAYOUT_PACKED_DEPS))
+        update_info->layout |= YUM_DB_LAYOUT_PROVIDERS;
+#ifdef HAVE_ZSTD
+    if (py_option_bool (options, "compressed_changelogs"))
+        update_info->layout |= YUM_DB_LAYOUT_COMPRESSED;
+#else
+    if (py_option_bool (options, "compressed_changelogs"))
+        g_message ("Built without zstd, compressed_changelogs ignored");
+#endif
+}
+
+/* Only the thread running the update may call back into python, the
+   writer threads get the default handler. */
+static GThread *log_thread = NULL;
+
 static void
 log_cb (const gchar *log_domain,
         GLogLevelFlags log_level,
@@ -499,6 +1767,11 @@ log_cb (const gchar *log_domain,
     if (!callback)
         return;
 
+    if (g_thread_self () != log_thread) {
+        g_log_default_handler (log_domain, log_level, message, NULL);
+        return;
+    }
+
     args = PyTuple_New (2);
 
     switch (log_level) {
@@ -533,21 +1806,30 @@ py_update (PyObject *self, PyObject *args, UpdateInfo *update_info)
     PyObject *log = NULL;
     PyObject *progress = NULL;
     PyObject *repoid = NULL;
+    PyObject *options = NULL;
     guint log_id = 0;
     char *db_filename;
     PyObject *ret = NULL;
     GError *err = NULL;
 
     if (!py_parse_args (args, &md_filename, &checksum, &log, &progress,
-                        &repoid))
+                        &repoid, &options))
         return NULL;
 
+    /* Before the options, which may log about themselves */
     GLogLevelFlags level = G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_WARNING |
         G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_DEBUG;
+    log_thread = g_thread_self ();
     log_id = g_log_set_handler (NULL, level, log_cb, log);
 
-    db_filename = update_packages (update_info, md_filename, checksum,
-                                   progress, repoid, &err);
+    py_parse_options (options, update_info);
+
+    if (update_info->import)
+        db_filename = import_database (update_info, md_filename, checksum,
+                                       &err);
+    else
+        db_filename = update_packages (update_info, md_filename, checksum,
+                                       progress, repoid, &err);
 
     g_log_remove_handler (NULL, log_id);
 
@@ -574,6 +1856,9 @@ py_update_primary (PyObject *self, PyObject *args)
     info.update_info.write_package = write_package_to_db;
     info.update_info.xml_parse = yum_xml_parse_primary;
     info.update_info.index_tables = yum_db_index_primary_tables;
+    info.update_info.prune_tables = yum_db_prune_primary_tables;
+    info.update_info.resolve_tables = yum_db_resolve_requires;
+    info.update_info.cluster_keys = primary_cluster_keys;
 
     return py_update (self, args, (UpdateInfo *) &info);
 }
@@ -588,8 +1873,12 @@ py_update_filelist (PyObject *self, PyObject *args)
     info.update_info.info_clean = update_filelist_info_clean;
     info.update_info.create_tables = yum_db_create_filelist_tables;
     info.update_info.write_package = write_filelist_package_to_db;
+    info.update_info.reuses_primary_keys = TRUE;
+    info.update_info.reuses_primary_dirnames = TRUE;
     info.update_info.xml_parse = yum_xml_parse_filelists;
     info.update_info.index_tables = yum_db_index_filelist_tables;
+    info.update_info.prune_tables = yum_db_prune_filelist_tables;
+    info.update_info.cluster_keys = filelist_cluster_keys;
 
     return py_update (self, args, (UpdateInfo *) &info);
 }
@@ -601,33 +1890,131 @@ py_update_other (PyObject *self, PyObject *args)
     memset (&info, 0, sizeof (UpdateOtherInfo));
 
     info.update_info.info_init = update_other_info_init;
+    info.update_info.info_finish = update_other_info_finish;
     info.update_info.info_clean = update_other_info_clean;
     info.update_info.create_tables = yum_db_create_other_tables;
     info.update_info.write_package = write_other_package_to_db;
+    info.update_info.reuses_primary_keys = TRUE;
     info.update_info.xml_parse = yum_xml_parse_other;
     info.update_info.index_tables = yum_db_index_other_tables;
+    info.update_info.prune_tables = yum_db_prune_other_tables;
 
     return py_update (self, args, (UpdateInfo *) &info);
 }
 
+static PyObject *
+py_import (PyObject *self, PyObject *args,
+           CreateTablesFn create_tables, IndexTablesFn index_tables)
+{
+    UpdateInfo info;
+    memset (&info, 0, sizeof (UpdateInfo));
+
+    info.import = TRUE;
+    info.create_tables = create_tables;
+    info.index_tables = index_tables;
+
+    return py_update (self, args, &info);
+}
+
+static PyObject *
+py_import_primary (PyObject *self, PyObject *args)
+{
+    return py_import (self, args, yum_db_create_primary_tables,
+                      yum_db_index_primary_tables);
+}
+
+static PyObject *
+py_import_filelist (PyObject *self, PyObject *args)
+{
+    return py_import (self, args, yum_db_create_filelist_tables,
+                      yum_db_index_filelist_tables);
+}
+
+static PyObject *
+py_import_other (PyObject *self, PyObject *args)
+{
+    return py_import (self, args, yum_db_create_other_tables,
+                      yum_db_index_other_tables);
+}
+
+/* Deltas may be downloaded compressed, they are unpacked next to the
+   cache first */
+static PyObject *
+py_apply_delta (PyObject *self, PyObject *args)
+{
+    const char *db_filename;
+    const char *delta;
+    char *tmp_filename;
+    GError *err = NULL;
+
+    if (!PyArg_ParseTuple (args, "ss", &db_filename, &delta))
+        return NULL;
+
+    tmp_filename = g_strconcat (db_filename, ".delta", NULL);
+
+    yum_decompress_file (delta, tmp_filename, &err);
+    if (!err)
+        yum_db_delta_apply (db_filename, tmp_filename, &err);
+
+    unlink (tmp_filename);
+    g_free (tmp_filename);
+
+    if (err) {
+        PyErr_SetString (PyExc_TypeError, err->message);
+        g_error_free (err);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef SqliteMethods[] = {
     {"update_primary", py_update_primary, METH_VARARGS,
-     "Parse YUM primary.xml metadata."},
+     "Parse YUM primary.xml metadata, see README for the build options."},
     {"update_filelist", py_update_filelist, METH_VARARGS,
-     "Parse YUM filelists.xml metadata."},
+     "Parse YUM filelists.xml metadata, see README for the build options."},
     {"update_other", py_update_other, METH_VARARGS,
-     "Parse YUM other.xml metadata."},
+     "Parse YUM other.xml metadata, see README for the build options."},
+    {"import_primary", py_import_primary, METH_VARARGS,
+     "Import a primary_db the repository built, see README."},
+    {"import_filelist", py_import_filelist, METH_VARARGS,
+     "Import a filelists_db the repository built, see README."},
+    {"import_other", py_import_other, METH_VARARGS,
+     "Import an other_db the repository built, see README."},
+    {"apply_delta", py_apply_delta, METH_VARARGS,
+     "Patch a cache with a delta written by the delta option, see README."},
 
     {NULL, NULL, 0, NULL}
 };
 
+/* Entry point for sqlite3_load_extension(), registered as an auto
+   extension on import too so every connection of the process, yum's
+   included, can read the packed layout. */
+int
+sqlite3_sqlitecache_init (sqlite3 *db, char **errmsg, const void *api)
+{
+    return yum_db_register_functions (db);
+}
+
 PyMODINIT_FUNC
 init_sqlitecache (void)
 {
     PyObject * m, * d;
+    gboolean uri;
+
+    /* The sqlite3 module takes no uri argument on python 2, this lets
+       open_database() pass immutable=1. sqlite only accepts it before
+       its first connection. */
+    uri = sqlite3_config (SQLITE_CONFIG_URI, 1) == SQLITE_OK ||
+        sqlite3_compileoption_used ("USE_URI");
+
+    sqlite3_auto_extension ((void (*) (void)) sqlite3_sqlitecache_init);
 
     m = Py_InitModule ("_sqlitecache", SqliteMethods);
 
     d = PyModule_GetDict(m);
     PyDict_SetItemString(d, "DBVERSION", PyInt_FromLong(YUM_SQLITE_CACHE_DBVERSION));
+    PyDict_SetItemString(d, "URI_FILENAMES", PyBool_FromLong(uri));
+
+    yum_query_register (m);
 }
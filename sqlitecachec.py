@@ -12,6 +12,8 @@
 # along with this program; if not, write to the Free Software
 # Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
+import os
+import urllib
 try:
     import sqlite3 as sqlite
 except ImportError:
@@ -20,14 +22,21 @@ import _sqlitecache
 
 DBVERSION = _sqlitecache.DBVERSION
 
+# Default mmap_size of immutable opens
+MMAP_SIZE = 256 * 1024 * 1024
+
 class RepodataParserSqlite:
-    def __init__(self, storedir, repoid, callback=None):
+    def __init__(self, storedir, repoid, callback=None, options=None):
+        """options is a dict of cache build options, see README"""
         self.callback = callback
         self.repoid = repoid
+        self.options = options or {}
 
     def open_database(self, filename):
         if not filename:
             return None
+        if self.options.get('immutable'):
+            return self.open_immutable(filename)
         con = sqlite.connect(filename)
         con.text_factory = str
         if sqlite.version_info[0] > 1:
@@ -37,13 +46,37 @@ class RepodataParserSqlite:
         del cur
         return con
 
+    def open_immutable(self, filename):
+        """Open a finished cache read only, without locking when sqlite
+           takes URI filenames. Caches are replaced by rename, never
+           written in place, so an open connection keeps reading the file
+           it opened."""
+        if _sqlitecache.URI_FILENAMES:
+            uri = 'file:%s?mode=ro&immutable=1' % \
+                  urllib.quote(os.path.abspath(filename))
+            if self.options.get('shared_cache'):
+                uri += '&cache=shared'
+            con = sqlite.connect(uri)
+        else:
+            con = sqlite.connect(filename)
+        con.text_factory = str
+        if sqlite.version_info[0] > 1:
+            con.row_factory = sqlite.Row
+        cur = con.cursor()
+        cur.execute("pragma query_only = 1")
+        cur.execute("pragma mmap_size = %d" %
+                    int(self.options.get('mmap_size', MMAP_SIZE)))
+        del cur
+        return con
+
     def getPrimary(self, location, checksum):
         """Load primary.xml.gz from an sqlite cache and update it 
            if required"""
         return self.open_database(_sqlitecache.update_primary(location,
 															  checksum,
                                                               self.callback,
-                                                              self.repoid))
+                                                              self.repoid,
+                                                              self.options))
 
     def getFilelists(self, location, checksum):
         """Load filelist.xml.gz from an sqlite cache and update it if 
@@ -51,12 +84,30 @@ class RepodataParserSqlite:
         return self.open_database(_sqlitecache.update_filelist(location,
 															   checksum,
                                                                self.callback,
-                                                               self.repoid))
+                                                               self.repoid,
+                                                               self.options))
 
     def getOtherdata(self, location, checksum):
         """Load other.xml.gz from an sqlite cache and update it if required"""
         return self.open_database(_sqlitecache.update_other(location,
 															checksum,
                                                             self.callback,
-                                                            self.repoid))
+                                                            self.repoid,
+                                                            self.options))
+
+    def _import(self, fn, location, checksum):
+        return self.open_database(fn(location, checksum, self.callback,
+                                     self.repoid))
+
+    def importPrimary(self, location, checksum):
+        """Load primary_db from an upstream sqlite database"""
+        return self._import(_sqlitecache.import_primary, location, checksum)
+
+    def importFilelists(self, location, checksum):
+        """Load filelists_db from an upstream sqlite database"""
+        return self._import(_sqlitecache.import_filelist, location, checksum)
+
+    def importOtherdata(self, location, checksum):
+        """Load other_db from an upstream sqlite database"""
+        return self._import(_sqlitecache.import_other, location, checksum)
     
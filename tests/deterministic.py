@@ -0,0 +1,143 @@
+#!/usr/bin/python -tt
+# Builds the same small repository again and again with the deterministic
+# option, with and without the options that change how it gets built,
+# and checks that every build gives byte identical caches.
+#
+# Run after "python setup.py build", from the source tree:
+#   python tests/deterministic.py
+
+import glob
+import hashlib
+import os
+import shutil
+import sys
+import tempfile
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path[:0] = glob.glob(os.path.join(here, '..', 'build', 'lib*'))
+import _sqlitecache
+
+PACKAGES = 60
+
+# Variants that must not change the bytes of the cache
+VARIANTS = [
+    {},
+    {},
+    {'parallel_encoders': True},
+    {'parallel_writers': True},
+    {'checkpoint_interval': 7},
+    {'parallel_encoders': True, 'parallel_writers': True},
+]
+
+# Each layout is checked on its own, layouts give different files
+LAYOUTS = [
+    {},
+    {'dict_strings': True, 'dirnames': True, 'typed_columns': True},
+]
+
+def pkgid(i):
+    return hashlib.sha256('pkg%d' % i).hexdigest()
+
+def write_primary(path):
+    out = open(path, 'w')
+    out.write('<?xml version="1.0" encoding="UTF-8"?>\n'
+              '<metadata xmlns="http://linux.duke.edu/metadata/common" '
+              'xmlns:rpm="http://linux.duke.edu/metadata/rpm" '
+              'packages="%d">\n' % PACKAGES)
+    for i in range(PACKAGES):
+        out.write('''<package type="rpm">
+<name>pkg%(i)d</name><arch>x86_64</arch>
+<version epoch="0" ver="1.%(i)d" rel="1"/>
+<checksum type="sha256" pkgid="YES">%(id)s</checksum>
+<summary>Package %(i)d</summary><description>Package %(i)d.</description>
+<packager>Packager</packager><url>http://example.com/</url>
+<time file="%(i)d" build="%(i)d"/>
+<size package="100" installed="200" archive="300"/>
+<location href="pkg%(i)d.rpm"/>
+<format>
+<rpm:license>GPL</rpm:license><rpm:vendor>Vendor</rpm:vendor>
+<rpm:group>Group %(g)d</rpm:group><rpm:buildhost>host</rpm:buildhost>
+<rpm:sourcerpm>src%(g)d.src.rpm</rpm:sourcerpm>
+<rpm:header-range start="1" end="2"/>
+<rpm:provides>
+<rpm:entry name="pkg%(i)d" flags="EQ" epoch="0" ver="1.%(i)d" rel="1"/>
+<rpm:entry name="cap%(g)d"/>
+</rpm:provides>
+<rpm:requires>
+<rpm:entry name="cap%(r)d"/>
+<rpm:entry name="/usr/bin/tool%(r)d" pre="1"/>
+</rpm:requires>
+<file>/usr/bin/tool%(i)d</file>
+<file type="dir">/etc/pkg%(i)d</file>
+</format>
+</package>
+''' % {'i': i, 'id': pkgid(i), 'g': i % 7, 'r': (i * 3) % PACKAGES})
+    out.write('</metadata>\n')
+    out.close()
+
+def write_filelists(path):
+    out = open(path, 'w')
+    out.write('<?xml version="1.0" encoding="UTF-8"?>\n'
+              '<filelists xmlns="http://linux.duke.edu/metadata/filelists" '
+              'packages="%d">\n' % PACKAGES)
+    for i in range(PACKAGES):
+        out.write('<package pkgid="%s" name="pkg%d" arch="x86_64">\n'
+                  '<version epoch="0" ver="1.%d" rel="1"/>\n' %
+                  (pkgid(i), i, i))
+        out.write('<file>/usr/bin/tool%d</file>\n' % i)
+        out.write('<file type="dir">/etc/pkg%d</file>\n' % i)
+        for j in range(i % 5 + 1):
+            out.write('<file>/usr/share/pkg%d/file%d</file>\n' % (i % 9, j))
+        out.write('</package>\n')
+    out.write('</filelists>\n')
+    out.close()
+
+class Callback:
+    def log(self, level, message):
+        pass
+
+def build(source, work, options):
+    digests = []
+    os.mkdir(work)
+    for name, update in (('primary.xml', _sqlitecache.update_primary),
+                         ('filelists.xml', _sqlitecache.update_filelist)):
+        location = os.path.join(work, name)
+        shutil.copy(os.path.join(source, name), location)
+        checksum = hashlib.sha256(open(location).read()).hexdigest()
+        cache = update(location, checksum, Callback(), 'test', options)
+        digests.append(hashlib.sha256(open(cache, 'rb').read()).hexdigest())
+    return digests
+
+def main():
+    tmp = tempfile.mkdtemp(prefix='ymp-deterministic-')
+    failed = False
+    try:
+        write_primary(os.path.join(tmp, 'primary.xml'))
+        write_filelists(os.path.join(tmp, 'filelists.xml'))
+        n = 0
+        for layout in LAYOUTS:
+            expected = None
+            for variant in VARIANTS:
+                options = {'deterministic': True}
+                options.update(layout)
+                options.update(variant)
+                n += 1
+                digests = build(tmp, os.path.join(tmp, 'build%d' % n),
+                                options)
+                if expected is None:
+                    expected = digests
+                elif digests != expected:
+                    failed = True
+                    print 'FAIL %r: %s, expected %s' % (
+                        options, ' '.join(d[:12] for d in digests),
+                        ' '.join(d[:12] for d in expected))
+            print '%r: %s' % (layout, ' '.join(d[:12] for d in expected))
+    finally:
+        shutil.rmtree(tmp)
+
+    if failed:
+        sys.exit(1)
+    print 'ok'
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,185 @@
+#!/usr/bin/python -tt
+# Builds a small primary with resolve_requires and compares
+# requires_providers with the providers rpm would pick, worked out by
+# hand below: versioned provides, provides with and without epoch or
+# release, file and path requirements. Then removes packages from the
+# cache and checks that their rows went with them, on both sides.
+#
+# Run after "python setup.py build", from the source tree:
+#   python tests/providers.py
+
+import glob
+import hashlib
+import os
+import shutil
+import sqlite3
+import sys
+import tempfile
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path[:0] = glob.glob(os.path.join(here, '..', 'build', 'lib*'))
+import _sqlitecache
+
+# Each layout is built and checked on its own
+LAYOUTS = [
+    {},
+    {'dict_strings': True},
+    {'dict_strings': True, 'typed_columns': True, 'dirnames': True},
+    {'split_packages': True, 'stable_keys': True},
+    {'clustered': True, 'dict_strings': True},
+    {'parallel_writers': True, 'typed_columns': True},
+]
+
+# name: (provides, files), a provide is (name, flags, epoch, ver, rel)
+# with None for what the entry leaves out
+PROVIDERS = {
+    'p-lib-1': ([('lib', 'EQ', '0', '1.0', '1')], []),
+    'p-lib-2': ([('lib', 'EQ', None, '2.0', None)], []),
+    'p-lib-epoch': ([('lib', 'EQ', '1', '0.5', '1')], []),
+    'p-lib-any': ([('lib', None, None, None, None)], []),
+    'p-tool': ([('tool', 'EQ', '2', '3.0', None)], []),
+    'p-file': ([], ['/usr/bin/tool']),
+    'p-path': ([('/usr/bin/other', None, None, None, None)], []),
+}
+
+# name: (requirement, providers rpm picks)
+REQUIRERS = {
+    'r-lib': (('lib', None, None, None, None),
+              ['p-lib-1', 'p-lib-2', 'p-lib-epoch', 'p-lib-any']),
+    # A missing epoch is 0, the epoch 1 provide is newer than anything
+    'r-lib-ge': (('lib', 'GE', '0', '1.0', None),
+                 ['p-lib-1', 'p-lib-2', 'p-lib-epoch', 'p-lib-any']),
+    # No epoch on either side compares equal to 0
+    'r-lib-eq': (('lib', 'EQ', None, '1.0', '1'), ['p-lib-1', 'p-lib-any']),
+    # Without a release the requirement is equal to 1.0-1, so not less
+    'r-lib-lt': (('lib', 'LT', '0', '1.0', None), ['p-lib-any']),
+    # The provide without a release takes any release
+    'r-lib-rel': (('lib', 'EQ', '0', '2.0', '5'), ['p-lib-2', 'p-lib-any']),
+    'r-lib-gt': (('lib', 'GT', '1', '0.5', None), ['p-lib-any']),
+    # With a release on both sides the releases are compared
+    'r-lib-newer': (('lib', 'GE', '0', '1.0', '2'),
+                    ['p-lib-2', 'p-lib-epoch', 'p-lib-any']),
+    'r-lib-older': (('lib', 'LT', '0', '1.0', '2'), ['p-lib-1', 'p-lib-any']),
+    'r-tool': (('tool', 'GE', '2', '3.0', None), ['p-tool']),
+    'r-tool-epoch': (('tool', 'GE', '3', '1.0', None), []),
+    'r-tool-noepoch': (('tool', 'LT', None, '4.0', None), []),
+    'r-file': (('/usr/bin/tool', None, None, None, None), ['p-file']),
+    'r-path': (('/usr/bin/other', None, None, None, None), ['p-path']),
+    'r-missing': (('/usr/bin/missing', None, None, None, None), []),
+    'r-nothing': (('nothing', None, None, None, None), []),
+}
+
+# Removed one after the other, a provider and a requirer
+REMOVALS = ['p-lib-any', 'r-lib-ge']
+
+def pkgid(name):
+    return hashlib.sha256(name).hexdigest()
+
+def entry(dep):
+    name, flags, epoch, ver, rel = dep
+    attrs = [('name', name), ('flags', flags), ('epoch', epoch),
+             ('ver', ver), ('rel', rel)]
+    return '<rpm:entry %s/>' % ' '.join('%s="%s"' % (k, v)
+                                         for k, v in attrs if v is not None)
+
+def write_primary(path):
+    packages = {}
+    for name, (provides, files) in PROVIDERS.items():
+        packages[name] = (provides, [], files)
+    for name, (requirement, expected) in REQUIRERS.items():
+        packages[name] = ([], [requirement], [])
+
+    out = open(path, 'w')
+    out.write('<?xml version="1.0" encoding="UTF-8"?>\n'
+              '<metadata xmlns="http://linux.duke.edu/metadata/common" '
+              'xmlns:rpm="http://linux.duke.edu/metadata/rpm" '
+              'packages="%d">\n' % len(packages))
+    for name in sorted(packages):
+        provides, requires, files = packages[name]
+        out.write('''<package type="rpm">
+<name>%s</name><arch>noarch</arch>
+<version epoch="0" ver="1" rel="1"/>
+<checksum type="sha256" pkgid="YES">%s</checksum>
+<location href="%s.rpm"/>
+<format>
+''' % (name, pkgid(name), name))
+        out.write('<rpm:provides>%s</rpm:provides>\n' %
+                  ''.join(entry(dep) for dep in provides))
+        out.write('<rpm:requires>%s</rpm:requires>\n' %
+                  ''.join(entry(dep) for dep in requires))
+        for f in files:
+            out.write('<file>%s</file>\n' % f)
+        out.write('</format>\n</package>\n')
+    out.write('</metadata>\n')
+    out.close()
+
+def expected(removed):
+    pairs = set()
+    for name, (requirement, providers) in REQUIRERS.items():
+        if name in removed:
+            continue
+        for provider in providers:
+            if provider not in removed:
+                pairs.add((name, provider))
+    return pairs
+
+def resolved(db):
+    # Rows whose package, provider or requires row is gone drop out here
+    # and show up as dangling
+    return set(db.execute('SELECT p.name, q.name FROM requires_providers rp '
+                          'JOIN requires r ON r.requireKey = rp.requires '
+                          'AND r.pkgKey = rp.pkgKey '
+                          'JOIN packages p ON p.pkgKey = rp.pkgKey '
+                          'JOIN packages q ON q.pkgKey = rp.provider'))
+
+class Callback:
+    def log(self, level, message):
+        pass
+
+def check(tmp, n, layout, failures):
+    work = os.path.join(tmp, 'build%d' % n)
+    os.mkdir(work)
+    location = os.path.join(work, 'primary.xml')
+    shutil.copy(os.path.join(tmp, 'primary.xml'), location)
+    checksum = hashlib.sha256(open(location).read()).hexdigest()
+    options = {'resolve_requires': True}
+    options.update(layout)
+    cache = _sqlitecache.update_primary(location, checksum, Callback(),
+                                        'test', options)
+
+    db = sqlite3.connect(cache)
+    rows = db.execute('SELECT count(*) FROM requires_providers').fetchone()[0]
+    removed = []
+    for name in [None] + REMOVALS:
+        if name:
+            db.execute('DELETE FROM packages WHERE pkgId = ?', (pkgid(name),))
+            removed.append(name)
+            rows = db.execute('SELECT count(*) FROM '
+                              'requires_providers').fetchone()[0]
+        got = resolved(db)
+        want = expected(removed)
+        if got != want or rows != len(got):
+            failures.append('%r after removing %r: missing %s, extra %s, '
+                            '%d rows left dangling' % (
+                layout, removed, sorted(want - got), sorted(got - want),
+                rows - len(got)))
+    db.close()
+
+def main():
+    tmp = tempfile.mkdtemp(prefix='ymp-providers-')
+    failures = []
+    try:
+        write_primary(os.path.join(tmp, 'primary.xml'))
+        for n, layout in enumerate(LAYOUTS):
+            check(tmp, n, layout, failures)
+    finally:
+        shutil.rmtree(tmp)
+
+    for message in failures:
+        print 'FAIL', message
+    if failures:
+        sys.exit(1)
+    print '%d requirements in %d layouts ok' % (len(REQUIRERS), len(LAYOUTS))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,187 @@
+#!/usr/bin/python -tt
+# Checks rpm version ordering: rpmvercmp() and the rpmvercmp collation
+# against a table of cases, most of them from rpm's own rpmvercmp tests,
+# and the evr column of a cache built from packages with those versions,
+# which has to sort the same way byte by byte.
+#
+# Run after "python setup.py build", from the source tree:
+#   python tests/rpmvercmp.py
+
+import glob
+import hashlib
+import os
+import shutil
+import sqlite3
+import sys
+import tempfile
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path[:0] = glob.glob(os.path.join(here, '..', 'build', 'lib*'))
+import _sqlitecache
+
+# (a, b, sign of rpmvercmp(a, b))
+VERSIONS = [
+    ('1.0', '1.0', 0),
+    ('1.0', '2.0', -1),
+    ('2.0.1', '2.0.1', 0),
+    ('2.0', '2.0.1', -1),
+    ('2.0.1a', '2.0.1', 1),
+    ('5.5p1', '5.5p2', -1),
+    ('5.5p10', '5.5p1', 1),
+    ('10xyz', '10.1xyz', -1),
+    ('xyz10', 'xyz10.1', -1),
+    ('xyz.4', '8', -1),
+    ('xyz.4', '2', -1),
+    ('5.5p2', '5.6p1', -1),
+    ('5.6p1', '6.5p1', -1),
+    ('6.0.rc1', '6.0', 1),
+    ('10b2', '10a1', 1),
+    ('10a2', '10b2', -1),
+    ('1.0a', '1.0aa', -1),
+    # Leading zeros do not count
+    ('10.0001', '10.1', 0),
+    ('10.0001', '10.0039', -1),
+    ('4.999.9', '5.0', -1),
+    ('20101121', '20101122', -1),
+    ('99999999999999999999', '100000000000000000000', -1),
+    # Anything but letters, digits, ~ and ^ only separates
+    ('2.0', '2_0', 0),
+    ('a+', 'a_', 0),
+    ('+a', '_a', 0),
+    ('_+', '+_', 0),
+    ('+', '_', 0),
+    ('1.0', '1..0', 0),
+    # ~ sorts before everything, the end included
+    ('1.0~rc1', '1.0', -1),
+    ('1.0~rc1', '1.0~rc2', -1),
+    ('1.0~rc1~git123', '1.0~rc1', -1),
+    ('1.0~rc1', '1.0.rc1', -1),
+    # ^ sorts after the end but before any further segment
+    ('1.0^', '1.0', 1),
+    ('1.0^git1', '1.0', 1),
+    ('1.0^git1', '1.0^git2', -1),
+    ('1.0^git1', '1.01', -1),
+    ('1.0^20160101', '1.0.1', -1),
+    ('1.0^20160101^git1', '1.0^20160101', 1),
+    ('1.0~rc1^git1', '1.0~rc1', 1),
+    ('1.0^git1~pre', '1.0^git1', -1),
+    ('1.0~rc1^git1', '1.0~rc1^git1', 0),
+]
+
+# ((epoch, version, release), (epoch, version, release), sign); an epoch
+# of None is left out of the metadata and counts as 0
+EVRS = [
+    ((None, '1.0', '1'), ('0', '1.0', '1'), 0),
+    ((None, '2.0', '1'), ('1', '1.0', '1'), -1),
+    (('1', '1.0', '1'), ('0', '2.0', '1'), 1),
+    (('2', '0.1', '1'), ('10', '0.1', '1'), -1),
+    (('0', '1.0', '1'), ('0', '1.0', '2'), -1),
+    (('0', '1.0', '10'), ('0', '1.0', '9'), 1),
+    (('0', '1.0', '1.fc30'), ('0', '1.0', '1.fc30~bootstrap'), 1),
+    (('0', '1.0', '2'), ('0', '1.1', '1'), -1),
+    (('0', '1.0~rc1', '5'), ('0', '1.0', '1'), -1),
+]
+
+def sign(n):
+    return (n > 0) - (n < 0)
+
+def pkgid(evr):
+    return hashlib.sha256(repr(evr)).hexdigest()
+
+def all_evrs():
+    evrs = set()
+    for a, b, expected in VERSIONS:
+        evrs.add(('0', a, '1'))
+        evrs.add(('0', b, '1'))
+    for a, b, expected in EVRS:
+        evrs.add(a)
+        evrs.add(b)
+    return sorted(evrs)
+
+def write_primary(path, evrs):
+    out = open(path, 'w')
+    out.write('<?xml version="1.0" encoding="UTF-8"?>\n'
+              '<metadata xmlns="http://linux.duke.edu/metadata/common" '
+              'xmlns:rpm="http://linux.duke.edu/metadata/rpm" '
+              'packages="%d">\n' % len(evrs))
+    for evr in evrs:
+        epoch, version, release = evr
+        out.write('''<package type="rpm">
+<name>pkg</name><arch>noarch</arch>
+<version %sver="%s" rel="%s"/>
+<checksum type="sha256" pkgid="YES">%s</checksum>
+<location href="pkg.rpm"/>
+<format></format>
+</package>
+''' % (epoch is not None and 'epoch="%s" ' % epoch or '', version, release,
+       pkgid(evr)))
+    out.write('</metadata>\n')
+    out.close()
+
+class Callback:
+    def log(self, level, message):
+        pass
+
+def build(tmp, evrs):
+    location = os.path.join(tmp, 'primary.xml')
+    write_primary(location, evrs)
+    checksum = hashlib.sha256(open(location).read()).hexdigest()
+    return _sqlitecache.update_primary(location, checksum, Callback(), 'test')
+
+def main():
+    tmp = tempfile.mkdtemp(prefix='ymp-rpmvercmp-')
+    failed = []
+    try:
+        evrs = all_evrs()
+        db = sqlite3.connect(build(tmp, evrs))
+
+        for a, b, expected in VERSIONS:
+            for x, y, want in ((a, b, expected), (b, a, -expected)):
+                got = db.execute('SELECT rpmvercmp(?, ?)', (x, y)).fetchone()[0]
+                if got != want:
+                    failed.append('rpmvercmp(%r, %r) = %d, expected %d' %
+                                  (x, y, got, want))
+                got = db.execute('SELECT (? COLLATE rpmvercmp > ?) - '
+                                 '(? COLLATE rpmvercmp < ?)',
+                                 (x, y, x, y)).fetchone()[0]
+                if got != want:
+                    failed.append('collation %r, %r gives %d, expected %d' %
+                                  (x, y, got, want))
+
+        # evr keys compare as blobs, the way ORDER BY evr sorts them
+        pairs = [(('0', a, '1'), ('0', b, '1'), expected)
+                 for a, b, expected in VERSIONS] + EVRS
+        for a, b, expected in pairs:
+            got = db.execute('SELECT (x.evr > y.evr) - (x.evr < y.evr) '
+                             'FROM packages x, packages y '
+                             'WHERE x.pkgId = ? AND y.pkgId = ?',
+                             (pkgid(a), pkgid(b))).fetchone()[0]
+            if got != expected:
+                failed.append('evr %r against %r gives %d, expected %d' %
+                              (a, b, got, expected))
+
+        # Each package sorts after the previous one by epoch, version,
+        # then release
+        by_id = dict((pkgid(evr), evr) for evr in evrs)
+        ordered = [by_id[r[0]] for r in
+                   db.execute('SELECT pkgId FROM packages ORDER BY evr')]
+        for prev, cur in zip(ordered, ordered[1:]):
+            for x, y in zip(prev, cur):
+                got = db.execute('SELECT rpmvercmp(?, ?)',
+                                 (x or '0', y or '0')).fetchone()[0]
+                if got:
+                    break
+            if got > 0:
+                failed.append('ORDER BY evr puts %r before %r' % (prev, cur))
+        db.close()
+    finally:
+        shutil.rmtree(tmp)
+
+    for message in failed:
+        print 'FAIL', message
+    if failed:
+        sys.exit(1)
+    print '%d version and %d evr cases ok' % (len(VERSIONS), len(EVRS))
+
+if __name__ == '__main__':
+    main()
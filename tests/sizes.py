@@ -0,0 +1,210 @@
+#!/usr/bin/python -tt
+# Builds a synthetic repository, the same one for a given size, in the
+# layouts that change how large caches are and prints how large the
+# caches come out, along with the pages of the table holding the package
+# rows depsolving reads. The figures quoted for those options come from
+# this script with its default of 20000 packages.
+#
+# Run after "python setup.py build", from the source tree:
+#   python tests/sizes.py [packages]
+
+import glob
+import hashlib
+import os
+import random
+import shutil
+import sqlite3
+import sys
+import tempfile
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path[:0] = glob.glob(os.path.join(here, '..', 'build', 'lib*'))
+import _sqlitecache
+
+PACKAGES = 20000
+
+# Compared with the first, builds are deterministic so sizes repeat
+LAYOUTS = [
+    ('plain', {}),
+    ('dirnames', {'dirnames': True}),
+    ('compressed_changelogs', {'compressed_changelogs': True}),
+    ('split_packages', {'split_packages': True}),
+    ('stable_keys', {'stable_keys': True}),
+]
+
+LIBS = ['libc.so.6()(64bit)', 'libm.so.6()(64bit)', 'libz.so.1()(64bit)',
+        '/bin/sh', 'libfoo.so.1', '/usr/bin/perl']
+DIRS = ['/usr/bin', '/usr/lib64', '/usr/share/doc', '/usr/share/man/man1',
+        '/etc', '/usr/share/locale/de/LC_MESSAGES']
+FLAGS = ['EQ', 'GE', 'LE', 'LT', 'GT']
+
+def pkgid(i):
+    return hashlib.sha256('pkg%d' % i).hexdigest()
+
+def make_packages(count):
+    rng = random.Random(42)
+    packages = []
+    for i in range(count):
+        p = {'i': i, 'name': 'pkg%d' % i, 'src': i // 4, 'id': pkgid(i),
+             'epoch': i % 3,
+             'ver': '%d.%d' % (rng.randint(0, 5), rng.randint(0, 20)),
+             'rel': '%d.fc30' % rng.randint(1, 9)}
+        p['files'] = ['%s/%s-f%d' % (rng.choice(DIRS), p['name'], j)
+                      for j in range(rng.randint(1, 12))]
+        p['files'].append('/usr/bin/%s' % p['name'])
+        p['requires'] = rng.sample(LIBS, rng.randint(0, 4))
+        if i > 0:
+            other = packages[rng.randint(0, i - 1)]
+            p['versioned'] = (other['name'], rng.choice(FLAGS), other['ver'])
+        packages.append(p)
+    return packages
+
+def write_primary(path, packages):
+    out = open(path, 'w')
+    out.write('<?xml version="1.0" encoding="UTF-8"?>\n'
+              '<metadata xmlns="http://linux.duke.edu/metadata/common" '
+              'xmlns:rpm="http://linux.duke.edu/metadata/rpm" '
+              'packages="%d">\n' % len(packages))
+    for p in packages:
+        out.write('''<package type="rpm">
+<name>%(name)s</name><arch>x86_64</arch>
+<version epoch="%(epoch)d" ver="%(ver)s" rel="%(rel)s"/>
+<checksum type="sha256" pkgid="YES">%(id)s</checksum>
+<summary>Summary of %(name)s</summary>
+<description>A longer description of %(name)s.
+Second line.</description>
+<packager>Fedora Project</packager><url>http://example.com/%(name)s</url>
+<time file="1234" build="5678"/>
+<size package="100" installed="200" archive="300"/>
+<location href="Packages/%(name)s-%(ver)s-%(rel)s.x86_64.rpm"/>
+<format>
+<rpm:license>GPLv2+</rpm:license><rpm:vendor>Fedora</rpm:vendor>
+<rpm:group>Applications/System</rpm:group>
+<rpm:buildhost>build%(host)d.example.com</rpm:buildhost>
+<rpm:sourcerpm>src%(src)d-1.src.rpm</rpm:sourcerpm>
+<rpm:header-range start="100" end="%(end)d"/>
+<rpm:provides>
+<rpm:entry name="%(name)s" flags="EQ" epoch="%(epoch)d" ver="%(ver)s" rel="%(rel)s"/>
+<rpm:entry name="lib%(name)s.so.1()(64bit)"/>
+<rpm:entry name="virtual-%(virtual)d"/>
+</rpm:provides>
+<rpm:requires>
+''' % dict(p, host=p['i'] % 5, end=1000 + p['i'], virtual=p['i'] % 7))
+        for name in p['requires']:
+            out.write('<rpm:entry name="%s"/>\n' % name)
+        if 'versioned' in p:
+            out.write('<rpm:entry name="%s" flags="%s" epoch="0" ver="%s"/>\n'
+                      % p['versioned'])
+        out.write('<rpm:entry name="rpmlib(CompressedFileNames)" flags="LE" '
+                  'epoch="0" ver="3.0.4" rel="1"/>\n</rpm:requires>\n')
+        if p['i'] % 10 == 0:
+            out.write('<rpm:obsoletes><rpm:entry name="old%s" flags="LT" '
+                      'epoch="0" ver="1.0"/></rpm:obsoletes>\n' % p['name'])
+        if p['i'] % 13 == 0:
+            out.write('<rpm:conflicts><rpm:entry name="pkg%d"/>'
+                      '</rpm:conflicts>\n' % (p['i'] + 1))
+        for f in p['files']:
+            if f.startswith('/usr/bin/') or f.startswith('/etc/'):
+                out.write('<file>%s</file>\n' % f)
+        out.write('</format>\n</package>\n')
+    out.write('</metadata>\n')
+    out.close()
+
+def write_filelists(path, packages):
+    out = open(path, 'w')
+    out.write('<?xml version="1.0" encoding="UTF-8"?>\n'
+              '<filelists xmlns="http://linux.duke.edu/metadata/filelists" '
+              'packages="%d">\n' % len(packages))
+    for p in packages:
+        out.write('<package pkgid="%(id)s" name="%(name)s" arch="x86_64">\n'
+                  '<version epoch="%(epoch)d" ver="%(ver)s" rel="%(rel)s"/>\n'
+                  % p)
+        for f in p['files']:
+            out.write('<file>%s</file>\n' % f)
+        out.write('</package>\n')
+    out.write('</filelists>\n')
+    out.close()
+
+def write_other(path, packages):
+    out = open(path, 'w')
+    out.write('<?xml version="1.0" encoding="UTF-8"?>\n'
+              '<otherdata xmlns="http://linux.duke.edu/metadata/other" '
+              'packages="%d">\n' % len(packages))
+    for p in packages:
+        out.write('<package pkgid="%(id)s" name="%(name)s" arch="x86_64">\n'
+                  '<version epoch="%(epoch)d" ver="%(ver)s" rel="%(rel)s"/>\n'
+                  % p)
+        # Subpackages of a source package share its changelog
+        rng = random.Random(p['src'])
+        for k in range(rng.randint(0, 6)):
+            out.write('<changelog author="Dev %d &lt;dev%d@example.com&gt; '
+                      '- %s" date="%d">- Rebuilt for '
+                      'https://fedoraproject.org/wiki/Fedora_%d_Mass_Rebuild\n'
+                      '- bump src%d</changelog>\n'
+                      % (k % 3, k % 3, p['ver'], 1500000000 - k * 86400,
+                         20 + k, p['src']))
+        out.write('</package>\n')
+    out.write('</otherdata>\n')
+    out.close()
+
+class Callback:
+    def log(self, level, message):
+        pass
+
+def build(source, work, options):
+    caches = []
+    os.mkdir(work)
+    for name, update in (('primary.xml', _sqlitecache.update_primary),
+                         ('filelists.xml', _sqlitecache.update_filelist),
+                         ('other.xml', _sqlitecache.update_other)):
+        location = os.path.join(work, name)
+        shutil.copy(os.path.join(source, name), location)
+        checksum = hashlib.sha256(open(location).read()).hexdigest()
+        caches.append(update(location, checksum, Callback(), 'test', options))
+    return caches
+
+def megabytes(path):
+    return '%.1fMB' % (os.path.getsize(path) / 1e6)
+
+# Pages of the table holding the package rows depsolving reads, None when
+# sqlite was built without the dbstat table
+def package_pages(path):
+    db = sqlite3.connect(path)
+    try:
+        table = 'packages'
+        if db.execute("SELECT 1 FROM sqlite_master WHERE type = 'table' "
+                      "AND name = 'packages_data'").fetchone():
+            table = 'packages_data'
+        try:
+            return db.execute("SELECT count(*) FROM dbstat WHERE name = ?",
+                              (table,)).fetchone()[0]
+        except sqlite3.OperationalError:
+            return None
+    finally:
+        db.close()
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else PACKAGES
+    tmp = tempfile.mkdtemp(prefix='ymp-sizes-')
+    try:
+        packages = make_packages(count)
+        write_primary(os.path.join(tmp, 'primary.xml'), packages)
+        write_filelists(os.path.join(tmp, 'filelists.xml'), packages)
+        write_other(os.path.join(tmp, 'other.xml'), packages)
+        print '%d packages' % count
+        print '%-24s %10s %10s %10s %10s' % ('', 'primary', 'filelists',
+                                             'other', 'pkg pages')
+        for n, (name, layout) in enumerate(LAYOUTS):
+            options = {'deterministic': True}
+            options.update(layout)
+            caches = build(tmp, os.path.join(tmp, 'build%d' % n), options)
+            pages = package_pages(caches[0])
+            if pages is None:
+                pages = '-'
+            print '%-24s %10s %10s %10s %10s' % (
+                (name,) + tuple(megabytes(c) for c in caches) + (pages,))
+    finally:
+        shutil.rmtree(tmp)
+
+if __name__ == '__main__':
+    main()
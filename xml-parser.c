@@ -64,6 +64,17 @@ typedef struct {
     GString *text_buffer;
 } SAXContext;
 
+/* Copies the element text into the package, its length goes along so
+   the writers need not measure it again */
+static char *
+sax_text_insert (SAXContext *sctx, Package *p, gsize *len)
+{
+    *len = sctx->text_buffer->len;
+
+    return g_string_chunk_insert_len (p->chunk, sctx->text_buffer->str,
+                                      sctx->text_buffer->len);
+}
+
 typedef enum {
     PRIMARY_PARSER_TOPLEVEL = 0,
     PRIMARY_PARSER_PACKAGE,
@@ -376,33 +387,19 @@ primary_parser_package_end (PrimarySAXContext *ctx, const char *name)
         return;
 
     else if (!strcmp (name, "name"))
-        p->name = g_string_chunk_insert_len (p->chunk,
-                                             sctx->text_buffer->str,
-                                             sctx->text_buffer->len);
+        p->name = sax_text_insert (sctx, p, &p->name_len);
     else if (!strcmp (name, "arch"))
-        p->arch = g_string_chunk_insert_len (p->chunk,
-                                             sctx->text_buffer->str,
-                                             sctx->text_buffer->len);
+        p->arch = sax_text_insert (sctx, p, &p->arch_len);
     else if (!strcmp (name, "checksum"))
-        p->pkgId = g_string_chunk_insert_len (p->chunk,
-                                              sctx->text_buffer->str,
-                                              sctx->text_buffer->len);
+        package_set_pkgid (p, sctx->text_buffer->str, sctx->text_buffer->len);
     else if (!strcmp (name, "summary"))
-        p->summary = g_string_chunk_insert_len (p->chunk,
-                                                sctx->text_buffer->str,
-                                                sctx->text_buffer->len);
+        p->summary = sax_text_insert (sctx, p, &p->summary_len);
     else if (!strcmp (name, "description"))
-        p->description = g_string_chunk_insert_len (p->chunk,
-                                                    sctx->text_buffer->str,
-                                                    sctx->text_buffer->len);
+        p->description = sax_text_insert (sctx, p, &p->description_len);
     else if (!strcmp (name, "packager"))
-        p->rpm_packager = g_string_chunk_insert_len (p->chunk,
-                                                     sctx->text_buffer->str,
-                                                     sctx->text_buffer->len);
+        p->rpm_packager = sax_text_insert (sctx, p, &p->rpm_packager_len);
     else if (!strcmp (name, "url"))
-        p->url = g_string_chunk_insert_len (p->chunk,
-                                            sctx->text_buffer->str,
-                                            sctx->text_buffer->len);
+        p->url = sax_text_insert (sctx, p, &p->url_len);
 }
 
 static void
@@ -415,32 +412,20 @@ primary_parser_format_end (PrimarySAXContext *ctx, const char *name)
     g_assert (p != NULL);
 
     if (!strcmp (name, "rpm:license"))
-        p->rpm_license = g_string_chunk_insert_len (p->chunk,
-                                                    sctx->text_buffer->str,
-                                                    sctx->text_buffer->len);
+        p->rpm_license = sax_text_insert (sctx, p, &p->rpm_license_len);
     if (!strcmp (name, "rpm:vendor"))
-        p->rpm_vendor = g_string_chunk_insert_len (p->chunk,
-                                                   sctx->text_buffer->str,
-                                                   sctx->text_buffer->len);
+        p->rpm_vendor = sax_text_insert (sctx, p, &p->rpm_vendor_len);
     if (!strcmp (name, "rpm:group"))
-        p->rpm_group = g_string_chunk_insert_len (p->chunk,
-                                                  sctx->text_buffer->str,
-                                                  sctx->text_buffer->len);
+        p->rpm_group = sax_text_insert (sctx, p, &p->rpm_group_len);
     if (!strcmp (name, "rpm:buildhost"))
-        p->rpm_buildhost = g_string_chunk_insert_len (p->chunk,
-                                                      sctx->text_buffer->str,
-                                                      sctx->text_buffer->len);
+        p->rpm_buildhost = sax_text_insert (sctx, p, &p->rpm_buildhost_len);
     if (!strcmp (name, "rpm:sourcerpm"))
-        p->rpm_sourcerpm = g_string_chunk_insert_len (p->chunk,
-                                                      sctx->text_buffer->str,
-                                                      sctx->text_buffer->len);
+        p->rpm_sourcerpm = sax_text_insert (sctx, p, &p->rpm_sourcerpm_len);
     else if (!strcmp (name, "file")) {
         PackageFile *file = ctx->current_file != NULL ?
             ctx->current_file : package_file_new ();
 
-        file->name = g_string_chunk_insert_len (p->chunk,
-                                                sctx->text_buffer->str,
-                                                sctx->text_buffer->len);
+        file->name = sax_text_insert (sctx, p, &file->name_len);
 
         if (!file->type)
             file->type = g_string_chunk_insert_const (p->chunk, "file");
@@ -615,7 +600,7 @@ parse_package (const char **attrs, Package *p)
         value = attrs[++i];
 
         if (!strcmp (attr, "pkgid"))
-            p->pkgId = g_string_chunk_insert (p->chunk, value);
+            package_set_pkgid (p, value, -1);
         if (!strcmp (attr, "name"))
             p->name = g_string_chunk_insert (p->chunk, value);
         else if (!strcmp (attr, "arch"))
@@ -753,9 +738,7 @@ filelist_parser_package_end (FilelistSAXContext *ctx, const char *name)
 
     else if (!strcmp (name, "file")) {
         PackageFile *file = ctx->current_file;
-        file->name = g_string_chunk_insert_len (p->chunk,
-                                                sctx->text_buffer->str,
-                                                sctx->text_buffer->len);
+        file->name = sax_text_insert (sctx, p, &file->name_len);
         if (!file->type)
             file->type = g_string_chunk_insert_const (p->chunk, "file");
 
@@ -977,10 +960,9 @@ other_parser_package_end (OtherSAXContext *ctx, const char *name)
     }
 
     else if (!strcmp (name, "changelog")) {
-        ctx->current_entry->changelog =
-            g_string_chunk_insert_len (p->chunk,
-                                       sctx->text_buffer->str,
-                                       sctx->text_buffer->len);
+        ChangelogEntry *entry = ctx->current_entry;
+
+        entry->changelog = sax_text_insert (sctx, p, &entry->changelog_len);
 
         p->changelogs = g_slist_prepend (p->changelogs, ctx->current_entry);
         ctx->current_entry = NULL;
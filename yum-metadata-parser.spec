@@ -1,5 +1,9 @@
 %{!?python_sitelib_platform: %define python_sitelib_platform %(%{__python} -c "from distutils.sysconfig import get_python_lib; print get_python_lib(1)")}
 
+# zstd, for compressed_changelogs and zstd upstream databases, is on
+# unless built with --without zstd
+%bcond_without zstd
+
 Summary: A fast metadata parser for yum
 Name: yum-metadata-parser
 Version: 1.1.4
@@ -10,9 +14,15 @@ Group: Development/Libraries
 URL: http://devel.linux.duke.edu/cgi-bin/viewcvs.cgi/yum-metadata-parser/
 Requires: yum >= 2.6.2
 BuildRequires: python-devel
-BuildRequires: glib2-devel
+BuildRequires: glib2-devel >= 2.36
 BuildRequires: libxml2-devel
 BuildRequires: sqlite-devel
+%if %{with zstd}
+BuildRequires: libzstd-devel
+%endif
+BuildRequires: zlib-devel
+BuildRequires: bzip2-devel
+BuildRequires: xz-devel
 BuildRequires: pkgconfig
 BuildRoot:  %{_tmppath}/%{name}-%{version}-%{release}-root-%(%{__id_u} -n)
 
@@ -23,6 +33,9 @@ Fast metadata parser for yum implemented in C.
 %setup
 
 %build
+%if %{without zstd}
+export YMP_WITHOUT_ZSTD=1
+%endif
 %{__python} setup.py build
 
 %install